@@ -0,0 +1,45 @@
+#!/bin/sh
+
+SRCDIR=$(dirname $0)
+TMPDIR=$(mktemp -d)
+
+usage() {
+    echo "$0 [NUM] [OPTION]..."
+    echo
+    echo "Measures the compile time of synthetic programs of 10K, 100K and 1M"
+    echo "lines made by generate.awk, taking the best of NUM runs. The chart"
+    echo "shows the time per line, which stays flat if the compile time scales"
+    echo "linearly. The options are passed to am-lang."
+    echo "Example:"
+    echo "Compile every program 5 times by 4 worker processes"
+    echo "$0 5 --jobs=4"
+    exit 1
+}
+
+if [[ -z "$1" ]]; then
+    usage
+fi
+num=$1
+shift
+
+for lines in 10000 100000 1000000; do
+    awk -v lines=$lines -f "$SRCDIR/generate.awk" > "$TMPDIR/source.am"
+    for i in $(seq 1 $num); do
+        am-lang --compile "$@" "$TMPDIR/source.am" 2>&1 >/dev/null
+    done | awk -v lines=$lines '
+        { t = substr($NF, 1, length($NF) - 1) + 0 }
+        NR == 1 || t < best { best = t }
+        END { print lines, best }'
+done | awk '
+    { lines[NR] = $1; time[NR] = $2; us[NR] = $2 / $1 * 1e6
+      if (us[NR] > max) max = us[NR] }
+    END {
+        for (i = 1; i <= NR; ++i) {
+            bar = ""
+            for (k = 0; k < (max > 0 ? us[i] / max * 40 : 0); ++k) bar = bar "#"
+            printf "%8d lines %8.3fs %6.3f us/line %s\n", lines[i], time[i],
+                us[i], bar
+        }
+    }'
+
+rm -fr $TMPDIR
@@ -0,0 +1,58 @@
+# Generates a synthetic program of about 'lines' lines for the compile time
+# benchmark. Every function has many locals, deeply nested loops and ifs and
+# a long 'else if' chain, and calls two preceding functions, so that none of
+# them is dead.
+#
+# Usage: awk -v lines=LINES [-v locals=N] [-v depth=N] [-v chain=N] \
+#            -f generate.awk
+
+function indent(n,    s) {
+    s = ""
+    while (n-- > 0) {
+        s = s "    "
+    }
+    return s
+}
+
+BEGIN {
+    if (locals == 0) locals = 16
+    if (depth == 0) depth = 6
+    if (chain == 0) chain = 24
+    for (f = 0; n < lines; ++f) {
+        print "fn f" f "(a, b, c) {"
+        for (i = 0; i < locals; ++i) {
+            print "    let v" i " = " (i == 0 ? "a" : "v" (i - 1)) " + " \
+                (f * 7 + i) % 100 ";"
+        }
+        for (d = 1; d <= depth; ++d) {
+            print indent(d) (d % 2 ? "if a < " d " {" : "while b > " d " {")
+        }
+        print indent(depth + 1) "v0 = v0 + b * c;"
+        for (d = depth; d >= 1; --d) {
+            if (d % 2 == 0) {
+                print indent(d + 1) "b = b - 1;"
+            }
+            print indent(d) "}"
+        }
+        for (i = 0; i < chain; ++i) {
+            print "    " (i == 0 ? "if" : "} else if") " v1 == " i " {"
+            print "        v2 = v2 + " i ";"
+        }
+        print "    } else {"
+        print "        v2 = 0;"
+        print "    }"
+        if (f == 0) {
+            print "    return v0 + v2;"
+        } else {
+            print "    return f" f - 1 "(v0, v2, c) + f" int(f * 0.618) \
+                "(v1, v2, c);"
+        }
+        print "}"
+        n += locals + 2 * depth + int(depth / 2) + 2 * chain + 7
+    }
+    print "fn main() {"
+    print "    let x = 0;"
+    print "    in x;"
+    print "    out f" f - 1 "(x, x, x);"
+    print "}"
+}
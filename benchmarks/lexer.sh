@@ -0,0 +1,34 @@
+#!/bin/sh
+
+SRCDIR=$(dirname $0)
+TMPDIR=$(mktemp -d)
+
+usage() {
+    echo "$0 [SIZE] [NUM]"
+    echo
+    echo "Measures the throughput of the lexer on a source of SIZE megabytes"
+    echo "concatenated from the benchmarks."
+    echo "Example:"
+    echo "Lex a 100 MB source 5 times"
+    echo "$0 100 5"
+    exit 1
+}
+
+if [[ -z "$1" ]] || [[ -z "$2" ]]; then
+    usage
+fi
+
+cat "$SRCDIR"/*.am > "$TMPDIR/chunk.am"
+while [[ $(wc -c < "$TMPDIR/chunk.am") -lt 1048576 ]]; do
+    cat "$TMPDIR/chunk.am" "$TMPDIR/chunk.am" > "$TMPDIR/double.am"
+    mv "$TMPDIR/double.am" "$TMPDIR/chunk.am"
+done
+for i in $(seq 1 $1); do
+    cat "$TMPDIR/chunk.am"
+done > "$TMPDIR/source.am"
+
+for i in $(seq 1 $2); do
+    echo "$i/$2 $(am-lang --lex "$TMPDIR/source.am" 2>&1)"
+done;
+
+rm -fr $TMPDIR
@@ -0,0 +1,19 @@
+#include <cstddef>
+#include <cstdlib>
+#include "interpreter.hpp"
+#include "native.hpp"
+// Written by am-lang --embed at build time.
+#include "program.hpp"
+
+// Needed by the interpreter.
+int trace_flag;
+std::size_t stack_size = INTERPRETER_STACK_SIZE;
+std::size_t arena_size = INTERPRETER_ARENA_SIZE;
+
+// Runs a program compiled into the executable, it is neither parsed nor
+// verified at startup.
+int main() {
+    NativeFunctions natives;
+    return interpret(program::bytecode, program::constants, natives,
+            program::frame_sizes);
+}
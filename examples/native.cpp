@@ -0,0 +1,62 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include "interpreter.hpp"
+#include "lexer.hpp"
+#include "native.hpp"
+#include "parser.hpp"
+#include "verifier.hpp"
+
+// Needed by the interpreter.
+int trace_flag;
+std::size_t stack_size = INTERPRETER_STACK_SIZE;
+std::size_t arena_size = INTERPRETER_ARENA_SIZE;
+
+namespace {
+
+std::int64_t square(const std::int64_t* args, std::size_t num_args) {
+    return num_args == 1 ? args[0] * args[0] : 0;
+}
+
+std::int64_t sum(const std::int64_t* args, std::size_t num_args) {
+    std::int64_t result = 0;
+    for (std::size_t i = 0; i < num_args; ++i) {
+        result += args[i];
+    }
+    return result;
+}
+
+// The program calls the host functions like its own ones.
+const char source[] =
+    "fn main() {\n"
+    "    out square(7);\n"
+    "    out sum(1, 2, 3, square(2));\n"
+    "    return sum();\n"
+    "}\n";
+
+}
+
+// Embeds the interpreter, registers host functions and runs a program calling
+// them.
+int main() {
+    NativeFunctions natives;
+    if (!natives.add("square", square) || !natives.add("sum", sum)) {
+        std::fputs("Error: couldn't register the native functions\n", stderr);
+        return EXIT_FAILURE;
+    }
+    Parser::Options options;
+    options.native_functions_ = &natives;
+    Parser parser(Lexer(source), options);
+    parser.parse();
+    auto verification = verify(parser.bytecode().data(),
+            parser.bytecode().size(), parser.constants().data(),
+            parser.constants().size(), natives.size());
+    if (!verification.valid_) {
+        std::fprintf(stderr, "Error: %s at %zu\n", verification.error_,
+                verification.error_pos_);
+        return EXIT_FAILURE;
+    }
+    return interpret(parser.bytecode().data(), parser.constants().data(),
+            natives, verification.frame_sizes_.data());
+}
@@ -0,0 +1,117 @@
+#ifndef BUILTINS_HPP
+#define BUILTINS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "cxx_extensions.hpp"
+
+// Builtin functions, computed by the builtin instructions and by the constant
+// folding. All of them are defined for every argument, arithmetic wraps
+// around modulo 2^64.
+
+ALWAYS_INLINE
+std::uint64_t builtin_magnitude(std::int64_t n) {
+    auto magnitude = static_cast<std::uint64_t>(n);
+    return n < 0 ? -magnitude : magnitude;
+}
+
+ALWAYS_INLINE
+std::int64_t builtin_abs(std::int64_t n) {
+    return static_cast<std::int64_t>(builtin_magnitude(n));
+}
+
+ALWAYS_INLINE
+std::int64_t builtin_min(std::int64_t a, std::int64_t b) {
+    return std::min(a, b);
+}
+
+ALWAYS_INLINE
+std::int64_t builtin_max(std::int64_t a, std::int64_t b) {
+    return std::max(a, b);
+}
+
+ALWAYS_INLINE
+std::int64_t builtin_popcount(std::int64_t n) {
+    return __builtin_popcountll(static_cast<std::uint64_t>(n));
+}
+
+// Counts the leading zero bits, 64 for zero.
+ALWAYS_INLINE
+std::int64_t builtin_clz(std::int64_t n) {
+    return n == 0 ? 64 : __builtin_clzll(static_cast<std::uint64_t>(n));
+}
+
+// Counts the trailing zero bits, 64 for zero.
+ALWAYS_INLINE
+std::int64_t builtin_ctz(std::int64_t n) {
+    return n == 0 ? 64 : __builtin_ctzll(static_cast<std::uint64_t>(n));
+}
+
+// Computes the floor of the square root, 0 for negative numbers. The rounded
+// root of the double is off by at most one.
+ALWAYS_INLINE
+std::int64_t builtin_isqrt(std::int64_t n) {
+    if (n <= 0) {
+        return 0;
+    }
+    auto square = static_cast<std::uint64_t>(n);
+    auto root = static_cast<std::uint64_t>(std::sqrt(static_cast<double>(n)));
+    while (root * root > square) {
+        --root;
+    }
+    while ((root + 1) * (root + 1) <= square) {
+        ++root;
+    }
+    return root;
+}
+
+// Computes the greatest common divisor of the magnitudes by the binary
+// algorithm, gcd(0, 0) is 0. A divisor 2^63 wraps around like abs.
+ALWAYS_INLINE
+std::int64_t builtin_gcd(std::int64_t a, std::int64_t b) {
+    std::uint64_t x = builtin_magnitude(a);
+    std::uint64_t y = builtin_magnitude(b);
+    if (x == 0 || y == 0) {
+        return x | y;
+    }
+    int shift = __builtin_ctzll(x | y);
+    x >>= __builtin_ctzll(x);
+    do {
+        y >>= __builtin_ctzll(y);
+        if (x > y) {
+            std::swap(x, y);
+        }
+        y -= x;
+    } while (y != 0);
+    return x << shift;
+}
+
+// Raises the base to the exponent by squaring. Negative exponents truncate
+// the result towards zero, like the division, and give 0 for the zero base.
+ALWAYS_INLINE
+std::int64_t builtin_ipow(std::int64_t base, std::int64_t exponent) {
+    if (exponent < 0) {
+        if (base == 1 || base == -1) {
+            return (exponent & 1) != 0 ? base : 1;
+        }
+        return 0;
+    }
+    std::uint64_t result = 1;
+    auto factor = static_cast<std::uint64_t>(base);
+    for (auto e = static_cast<std::uint64_t>(exponent); e != 0; e >>= 1) {
+        if ((e & 1) != 0) {
+            result *= factor;
+        }
+        factor *= factor;
+    }
+    return result;
+}
+
+// Computes the high 64 bits of the 128-bit product.
+ALWAYS_INLINE
+std::int64_t builtin_mulhi(std::int64_t a, std::int64_t b) {
+    return static_cast<std::int64_t>((static_cast<__int128>(a) * b) >> 64);
+}
+
+#endif // !BUILTINS_HPP
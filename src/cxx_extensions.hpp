@@ -39,6 +39,12 @@
     #define COLD /* __attribute__((__cold__)) */
 #endif
 
+#if _HAS_ATTRIBUTE(__always_inline__)
+    #define ALWAYS_INLINE inline __attribute__((__always_inline__))
+#else
+    #define ALWAYS_INLINE inline
+#endif
+
 // Undefine the feature checking macros.
 
 #undef _HAS_ATTRIBUTE
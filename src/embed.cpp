@@ -0,0 +1,144 @@
+#include "embed.hpp"
+#include <cctype>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include "cxx_extensions.hpp"
+
+namespace {
+
+const char* const opcode_names[] = {
+    "CONST",
+    "ADDRR", "MULRR", "EQRR", "NERR", "ANDRR", "ORRR", "XORRR",
+    "ADDRI", "MULRI", "EQRI", "NERI", "ANDRI", "ORRI", "XORRI",
+    "SUBRR", "DIVRR", "MODRR", "LTRR", "LERR", "SHLRR", "SARRR", "SHRRR",
+    "SUBRI", "DIVRI", "MODRI", "LTRI", "LERI", "SHLRI", "SARRI", "SHRRI",
+    "SUBIR", "DIVIR", "MODIR", "LTIR", "LEIR", "SHLIR", "SARIR", "SHRIR",
+    "DIVMAGIC", "MODMAGIC", "DIVPOW2", "MODPOW2",
+    "NEG", "NOT", "BNOT", "TRI",
+    "ABS", "POPCOUNT", "CLZ", "CTZ", "ISQRT", "MIN", "MAX", "GCD", "IPOW",
+    "MULHI",
+    "MOVI", "MOVR",
+    "ANEW", "ALOAD", "ALOADU", "ASTORE", "ASTOREU",
+    "JMP", "JT", "JF", "JTAB",
+    "FORPREP", "FORLOOP",
+    "CALL", "CALLM", "STOREM", "CALLN", "LAZY", "RETR", "RETI",
+    "EXIT", "IN", "OUT",
+};
+
+static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) ==
+        Instruction::OUT + 1);
+
+// Checks whether the instruction uses the operand d instead of b and c.
+bool uses_d(Instruction::Opcode opcode) {
+    switch (opcode) {
+    case Instruction::CONST:
+    case Instruction::MOVI:
+    case Instruction::JMP:
+    case Instruction::JT:
+    case Instruction::JF:
+    case Instruction::JTAB:
+    case Instruction::FORPREP:
+    case Instruction::FORLOOP:
+    case Instruction::RETI:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Makes the name of the namespace from the name of the file without the
+// directory and the extension.
+std::string make_namespace(const char* filename) {
+    const char* slash = std::strrchr(filename, '/');
+    const char* begin = slash != nullptr ? slash + 1 : filename;
+    const char* dot = std::strchr(begin, '.');
+    const char* end = dot != nullptr ? dot : begin + std::strlen(begin);
+    std::string name;
+    if (begin == end || std::isdigit(static_cast<unsigned char>(*begin))) {
+        name.push_back('_');
+    }
+    for (const char* p = begin; p != end; ++p) {
+        name.push_back(std::isalnum(static_cast<unsigned char>(*p)) ? *p : '_');
+    }
+    return name;
+}
+
+void write_constant(std::FILE* file, std::int64_t value) {
+    // The negated minimum doesn't fit in a literal.
+    if (value == std::numeric_limits<std::int64_t>::min()) {
+        std::fputs("INT64_MIN", file);
+    } else {
+        std::fprintf(file, "INT64_C(%" PRId64 ")", value);
+    }
+}
+
+}
+
+bool write_header(const char* filename,
+        const std::vector<Instruction>& bytecode,
+        const std::vector<std::int64_t>& constants,
+        const std::vector<std::uint16_t>& frame_sizes) {
+    std::FILE* file = std::fopen(filename, "w");
+    if (UNLIKELY(file == nullptr)) {
+        return false;
+    }
+    std::string name = make_namespace(filename);
+    std::string guard = "AM_EMBED_";
+    for (char c : name) {
+        guard.push_back(std::toupper(static_cast<unsigned char>(c)));
+    }
+    std::fprintf(file,
+            "// Generated by am-lang, don't edit.\n"
+            "#ifndef %s_HPP\n"
+            "#define %s_HPP\n"
+            "\n"
+            "#include <cstdint>\n"
+            "#include \"instruction.hpp\"\n"
+            "\n"
+            "namespace %s {\n"
+            "\n"
+            "constexpr Instruction bytecode[] = {\n",
+            guard.c_str(), guard.c_str(), name.c_str());
+    for (std::size_t i = 0; i < bytecode.size(); ++i) {
+        const auto& instruction = bytecode[i];
+        if (uses_d(instruction.opcode())) {
+            std::fprintf(file, "    Instruction::make_ad(Instruction::%s, "
+                    "%u, %d), // %08zu\n", opcode_names[instruction.opcode()],
+                    instruction.a(), instruction.d(), i);
+        } else {
+            std::fprintf(file, "    Instruction::make_abc(Instruction::%s, "
+                    "%u, %u, %u), // %08zu\n",
+                    opcode_names[instruction.opcode()], instruction.a(),
+                    instruction.b(), instruction.c(), i);
+        }
+    }
+    // Arrays can't be empty.
+    std::fputs("};\n\nconstexpr std::int64_t constants[] = {\n", file);
+    if (constants.empty()) {
+        std::fputs("    0,\n", file);
+    }
+    for (std::int64_t constant : constants) {
+        std::fputs("    ", file);
+        write_constant(file, constant);
+        std::fputs(",\n", file);
+    }
+    std::fputs("};\n\nconstexpr std::uint16_t frame_sizes[] = {", file);
+    for (std::size_t i = 0; i < frame_sizes.size(); ++i) {
+        std::fputs(i % 16 == 0 ? "\n    " : " ", file);
+        std::fprintf(file, "%u,", frame_sizes[i]);
+    }
+    std::fprintf(file,
+            "\n};\n"
+            "\n"
+            "} // namespace %s\n"
+            "\n"
+            "#endif // !%s_HPP\n", name.c_str(), guard.c_str());
+    bool success = !std::ferror(file);
+    return std::fclose(file) == 0 && success;
+}
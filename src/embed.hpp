@@ -0,0 +1,18 @@
+#ifndef EMBED_HPP
+#define EMBED_HPP
+
+#include <cstdint>
+#include <vector>
+#include "instruction.hpp"
+
+// Writes the verified program to a C++ header, so that it's compiled into the
+// embedding program and interpreted without parsing it at startup. The header
+// defines the constexpr arrays 'bytecode', 'constants' and 'frame_sizes' in a
+// namespace named after the file, which are passed to interpret(). Returns
+// false on failure.
+bool write_header(const char* filename,
+        const std::vector<Instruction>& bytecode,
+        const std::vector<std::int64_t>& constants,
+        const std::vector<std::uint16_t>& frame_sizes);
+
+#endif // !EMBED_HPP
@@ -0,0 +1,298 @@
+#include "image.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <experimental/optional>
+#include <experimental/string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "assert.hpp"
+#include "cxx_extensions.hpp"
+
+// The image starts with the header, which is followed by the sections: the
+// constants, the bytecode, the function entries, the native entries and the
+// names. Every section is aligned to 8 bytes.
+struct Image::Header final {
+    char magic_[8];
+    std::uint32_t version_;
+    // ORDER_MARK in the byte order of the writer.
+    std::uint32_t order_mark_;
+    std::uint32_t num_opcodes_;
+    std::uint32_t reserved_;
+    std::uint64_t num_constants_;
+    std::uint64_t num_instructions_;
+    std::uint64_t num_functions_;
+    std::uint64_t num_natives_;
+    std::uint64_t names_size_;
+};
+
+// A function or a native function, natives are indexed by CALLN and don't
+// use the position and the number of arguments.
+struct Image::Entry final {
+    std::uint64_t pos_;
+    std::uint64_t num_args_;
+    std::uint64_t name_offset_;
+    std::uint64_t name_size_;
+};
+
+namespace {
+
+const char magic[8] = {'a', 'm', '-', 'i', 'm', 'a', 'g', 'e'};
+
+// Bumped whenever the encoding of the instructions or the layout changes.
+constexpr std::uint32_t VERSION = 2;
+
+constexpr std::uint32_t ORDER_MARK = 0x01020304;
+
+constexpr std::uint32_t NUM_OPCODES = Instruction::OUT + 1;
+
+constexpr std::size_t ALIGNMENT = 8;
+
+constexpr std::size_t align(std::size_t size) {
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+// Writes the bytes padded to the alignment, returns false on failure.
+bool write_section(std::FILE* file, const void* data, std::size_t size) {
+    static const char padding[ALIGNMENT] = {};
+    return std::fwrite(data, 1, size, file) == size &&
+        std::fwrite(padding, 1, align(size) - size, file) ==
+            align(size) - size;
+}
+
+// Advances the offset by the section of 'count' elements of the given size,
+// returns false if it doesn't fit in the image of the given size.
+bool advance(std::size_t* offset, std::uint64_t count, std::size_t size,
+        std::size_t image_size) {
+    if (*offset > image_size || count > (image_size - *offset) / size ||
+            align(count * size) > image_size - *offset) {
+        return false;
+    }
+    *offset += align(count * size);
+    return true;
+}
+
+}
+
+Image::Image()
+        : mapping_(nullptr), mapping_size_(0), header_(nullptr),
+          constants_(nullptr), bytecode_(nullptr), functions_(nullptr),
+          natives_(nullptr), names_(nullptr) {}
+
+Image::Image(Image&& other) : Image() {
+    *this = std::move(other);
+}
+
+Image& Image::operator=(Image&& other) {
+    std::swap(mapping_, other.mapping_);
+    std::swap(mapping_size_, other.mapping_size_);
+    std::swap(header_, other.header_);
+    std::swap(constants_, other.constants_);
+    std::swap(bytecode_, other.bytecode_);
+    std::swap(functions_, other.functions_);
+    std::swap(natives_, other.natives_);
+    std::swap(names_, other.names_);
+    return *this;
+}
+
+Image::~Image() {
+    if (mapping_ != nullptr) {
+        ::munmap(mapping_, mapping_size_);
+    }
+}
+
+bool Image::write(const char* filename,
+        const std::vector<Instruction>& bytecode,
+        const std::vector<std::int64_t>& constants,
+        const std::vector<Image::Function>& functions,
+        const NativeFunctions& natives) {
+    // Collect the entries and the names.
+    std::vector<char> names;
+    auto make_entry = [&names](std::size_t pos, std::size_t num_args,
+            std::experimental::string_view name) {
+        Image::Entry entry;
+        entry.pos_ = pos;
+        entry.num_args_ = num_args;
+        entry.name_offset_ = names.size();
+        entry.name_size_ = name.size();
+        names.insert(names.end(), name.begin(), name.end());
+        return entry;
+    };
+    std::vector<Image::Entry> function_entries;
+    function_entries.reserve(functions.size());
+    for (const auto& function : functions) {
+        function_entries.push_back(make_entry(function.pos_,
+                    function.num_args_, function.name_));
+    }
+    std::vector<Image::Entry> native_entries;
+    native_entries.reserve(natives.size());
+    for (std::size_t i = 0; i < natives.size(); ++i) {
+        native_entries.push_back(make_entry(0, 0, natives.name(i)));
+    }
+    Image::Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic_, magic, sizeof(magic));
+    header.version_ = VERSION;
+    header.order_mark_ = ORDER_MARK;
+    header.num_opcodes_ = NUM_OPCODES;
+    header.num_constants_ = constants.size();
+    header.num_instructions_ = bytecode.size();
+    header.num_functions_ = function_entries.size();
+    header.num_natives_ = native_entries.size();
+    header.names_size_ = names.size();
+    // Write the sections.
+    std::FILE* file = std::fopen(filename, "wb");
+    if (UNLIKELY(file == nullptr)) {
+        return false;
+    }
+    bool success = write_section(file, &header, sizeof(header)) &&
+        write_section(file, constants.data(),
+                constants.size() * sizeof(std::int64_t)) &&
+        write_section(file, bytecode.data(),
+                bytecode.size() * sizeof(Instruction)) &&
+        write_section(file, function_entries.data(),
+                function_entries.size() * sizeof(Image::Entry)) &&
+        write_section(file, native_entries.data(),
+                native_entries.size() * sizeof(Image::Entry)) &&
+        write_section(file, names.data(), names.size());
+    return std::fclose(file) == 0 && success;
+}
+
+std::experimental::optional<Image> Image::open(const char* filename) {
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (UNLIKELY(fd == -1)) {
+        return std::experimental::nullopt;
+    }
+    Image image;
+    struct stat status;
+    bool success = ::fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+        static_cast<std::size_t>(status.st_size) >= sizeof(Image::Header);
+    if (success) {
+        // The pages are only read, so they stay shared with the page cache.
+        void* mapping = ::mmap(nullptr, status.st_size, PROT_READ,
+                MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            image.mapping_ = mapping;
+            image.mapping_size_ = status.st_size;
+        }
+        success = mapping != MAP_FAILED && image.validate();
+    }
+    ::close(fd);
+    if (UNLIKELY(!success)) {
+        return std::experimental::nullopt;
+    }
+    return std::experimental::optional<Image>(std::move(image));
+}
+
+bool Image::links(const NativeFunctions& natives) const {
+    if (header_->num_natives_ > natives.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < header_->num_natives_; ++i) {
+        if (name(natives_[i]) != natives.name(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const Instruction* Image::bytecode() const {
+    return bytecode_;
+}
+
+std::size_t Image::bytecode_size() const {
+    return header_->num_instructions_;
+}
+
+const std::int64_t* Image::constants() const {
+    return constants_;
+}
+
+std::size_t Image::num_constants() const {
+    return header_->num_constants_;
+}
+
+std::size_t Image::num_functions() const {
+    return header_->num_functions_;
+}
+
+Image::Function Image::function(std::size_t index) const {
+    ASSERT_LT(index, num_functions());
+    const auto& entry = functions_[index];
+    Image::Function function;
+    function.pos_ = entry.pos_;
+    function.num_args_ = entry.num_args_;
+    function.name_ = name(entry);
+    return function;
+}
+
+bool Image::validate() {
+    const auto* base = static_cast<const char*>(mapping_);
+    header_ = reinterpret_cast<const Image::Header*>(base);
+    if (std::memcmp(header_->magic_, magic, sizeof(magic)) != 0 ||
+            header_->version_ != VERSION ||
+            header_->order_mark_ != ORDER_MARK ||
+            header_->num_opcodes_ != NUM_OPCODES ||
+            header_->num_instructions_ == 0 ||
+            header_->num_natives_ > NativeFunctions::MAX_FUNCTIONS) {
+        return false;
+    }
+    // Find the sections.
+    std::size_t offset = align(sizeof(Image::Header));
+    std::size_t constants = offset;
+    if (!advance(&offset, header_->num_constants_, sizeof(std::int64_t),
+                mapping_size_)) {
+        return false;
+    }
+    std::size_t bytecode = offset;
+    if (!advance(&offset, header_->num_instructions_, sizeof(Instruction),
+                mapping_size_)) {
+        return false;
+    }
+    std::size_t functions = offset;
+    if (!advance(&offset, header_->num_functions_, sizeof(Image::Entry),
+                mapping_size_)) {
+        return false;
+    }
+    std::size_t natives = offset;
+    if (!advance(&offset, header_->num_natives_, sizeof(Image::Entry),
+                mapping_size_)) {
+        return false;
+    }
+    std::size_t names = offset;
+    if (!advance(&offset, header_->names_size_, sizeof(char), mapping_size_)) {
+        return false;
+    }
+    constants_ = reinterpret_cast<const std::int64_t*>(base + constants);
+    bytecode_ = reinterpret_cast<const Instruction*>(base + bytecode);
+    functions_ = reinterpret_cast<const Image::Entry*>(base + functions);
+    natives_ = reinterpret_cast<const Image::Entry*>(base + natives);
+    names_ = base + names;
+    // Check the entries.
+    auto valid_name = [this](const Image::Entry& entry) {
+        return entry.name_offset_ <= header_->names_size_ &&
+            entry.name_size_ <= header_->names_size_ - entry.name_offset_;
+    };
+    for (std::size_t i = 0; i < header_->num_functions_; ++i) {
+        if (functions_[i].pos_ >= header_->num_instructions_ ||
+                !valid_name(functions_[i])) {
+            return false;
+        }
+    }
+    for (std::size_t i = 0; i < header_->num_natives_; ++i) {
+        if (!valid_name(natives_[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::experimental::string_view Image::name(const Image::Entry& entry) const {
+    return std::experimental::string_view(names_ + entry.name_offset_,
+            entry.name_size_);
+}
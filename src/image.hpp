@@ -0,0 +1,80 @@
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <experimental/optional>
+#include <experimental/string_view>
+#include <vector>
+#include "instruction.hpp"
+#include "native.hpp"
+
+// A precompiled program. The image is mapped into memory and its bytecode and
+// constants are interpreted in place, so the pages are shared by all processes
+// running it. The image is only valid for the compiler version and the byte
+// order it was written with.
+class Image final {
+public:
+    // A function of the program.
+    struct Function final {
+        std::size_t pos_;
+        std::size_t num_args_;
+        // The name of the function, empty if the names are stripped.
+        std::experimental::string_view name_;
+    };
+
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+    Image(Image&& other);
+    Image& operator=(Image&& other);
+    ~Image();
+
+    // Writes the image, returns false on failure. The names of the native
+    // functions called by CALLN are recorded to check them when loading.
+    static bool write(const char* filename,
+            const std::vector<Instruction>& bytecode,
+            const std::vector<std::int64_t>& constants,
+            const std::vector<Function>& functions,
+            const NativeFunctions& natives);
+
+    // Maps the image, returns nullopt if it can't be mapped or is malformed.
+    static std::experimental::optional<Image> open(const char* filename);
+
+    // Checks whether the native functions of the image are registered at the
+    // same indices.
+    bool links(const NativeFunctions& natives) const;
+
+    const Instruction* bytecode() const;
+    std::size_t bytecode_size() const;
+    const std::int64_t* constants() const;
+    std::size_t num_constants() const;
+    std::size_t num_functions() const;
+
+    // Gets the function with the given index, functions are sorted by their
+    // positions.
+    Function function(std::size_t index) const;
+
+private:
+    struct Header;
+    struct Entry;
+
+    Image();
+
+    // Checks the mapped header and sections, returns false if they are
+    // malformed.
+    bool validate();
+
+    // Gets the name stored at the entry.
+    std::experimental::string_view name(const Entry& entry) const;
+
+    void* mapping_;
+    std::size_t mapping_size_;
+    const Header* header_;
+    const std::int64_t* constants_;
+    const Instruction* bytecode_;
+    const Entry* functions_;
+    const Entry* natives_;
+    const char* names_;
+};
+
+#endif // !IMAGE_HPP
@@ -22,6 +22,15 @@ void Instruction::print(std::FILE* file) const {
     case Instruction::NERR:
         std::fprintf(file, "nerr  %u, %u, %u", a(), b(), c());
         break;
+    case Instruction::ANDRR:
+        std::fprintf(file, "andrr %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::ORRR:
+        std::fprintf(file, "orrr  %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::XORRR:
+        std::fprintf(file, "xorrr %u, %u, %u", a(), b(), c());
+        break;
     case Instruction::ADDRI:
         std::fprintf(file, "addri %u, %u, $%i", a(), b(),
                 static_cast<std::int8_t>(c()));
@@ -38,6 +47,18 @@ void Instruction::print(std::FILE* file) const {
         std::fprintf(file, "neri  %u, %u, $%i", a(), b(),
                 static_cast<std::int8_t>(c()));
         break;
+    case Instruction::ANDRI:
+        std::fprintf(file, "andri %u, %u, $%i", a(), b(),
+                static_cast<std::int8_t>(c()));
+        break;
+    case Instruction::ORRI:
+        std::fprintf(file, "orri  %u, %u, $%i", a(), b(),
+                static_cast<std::int8_t>(c()));
+        break;
+    case Instruction::XORRI:
+        std::fprintf(file, "xorri %u, %u, $%i", a(), b(),
+                static_cast<std::int8_t>(c()));
+        break;
     // Noncommutative binary instructions.
     case Instruction::SUBRR:
         std::fprintf(file, "subrr %u, %u, %u", a(), b(), c());
@@ -54,6 +75,15 @@ void Instruction::print(std::FILE* file) const {
     case Instruction::LERR:
         std::fprintf(file, "lerr  %u, %u, %u", a(), b(), c());
         break;
+    case Instruction::SHLRR:
+        std::fprintf(file, "shlrr %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::SARRR:
+        std::fprintf(file, "sarrr %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::SHRRR:
+        std::fprintf(file, "shrrr %u, %u, %u", a(), b(), c());
+        break;
     case Instruction::SUBRI:
         std::fprintf(file, "subri %u, %u, $%i", a(), b(),
                 static_cast<std::int8_t>(c()));
@@ -74,6 +104,18 @@ void Instruction::print(std::FILE* file) const {
         std::fprintf(file, "leri  %u, %u, $%i", a(), b(),
                 static_cast<std::int8_t>(c()));
         break;
+    case Instruction::SHLRI:
+        std::fprintf(file, "shlri %u, %u, $%i", a(), b(),
+                static_cast<std::int8_t>(c()));
+        break;
+    case Instruction::SARRI:
+        std::fprintf(file, "sarri %u, %u, $%i", a(), b(),
+                static_cast<std::int8_t>(c()));
+        break;
+    case Instruction::SHRRI:
+        std::fprintf(file, "shrri %u, %u, $%i", a(), b(),
+                static_cast<std::int8_t>(c()));
+        break;
     case Instruction::SUBIR:
         std::fprintf(file, "subir %u, $%i, %u", a(),
                 static_cast<std::int8_t>(b()), c());
@@ -94,6 +136,31 @@ void Instruction::print(std::FILE* file) const {
         std::fprintf(file, "leir  %u, $%i, %u", a(),
                 static_cast<std::int8_t>(b()), c());
         break;
+    case Instruction::SHLIR:
+        std::fprintf(file, "shlir %u, $%i, %u", a(),
+                static_cast<std::int8_t>(b()), c());
+        break;
+    case Instruction::SARIR:
+        std::fprintf(file, "sarir %u, $%i, %u", a(),
+                static_cast<std::int8_t>(b()), c());
+        break;
+    case Instruction::SHRIR:
+        std::fprintf(file, "shrir %u, $%i, %u", a(),
+                static_cast<std::int8_t>(b()), c());
+        break;
+    // Division by constant instructions.
+    case Instruction::DIVMAGIC:
+        std::fprintf(file, "divmagic %u, %u, $%u", a(), b(), c());
+        break;
+    case Instruction::MODMAGIC:
+        std::fprintf(file, "modmagic %u, %u, $%u", a(), b(), c());
+        break;
+    case Instruction::DIVPOW2:
+        std::fprintf(file, "divpow2 %u, %u, $%u", a(), b(), c());
+        break;
+    case Instruction::MODPOW2:
+        std::fprintf(file, "modpow2 %u, %u, $%u", a(), b(), c());
+        break;
     // Unary instructions.
     case Instruction::NEG:
         std::fprintf(file, "neg   %u, %u", a(), b());
@@ -101,6 +168,43 @@ void Instruction::print(std::FILE* file) const {
     case Instruction::NOT:
         std::fprintf(file, "not   %u, %u", a(), b());
         break;
+    case Instruction::BNOT:
+        std::fprintf(file, "bnot  %u, %u", a(), b());
+        break;
+    case Instruction::TRI:
+        std::fprintf(file, "tri   %u, %u", a(), b());
+        break;
+    // Builtin function instructions.
+    case Instruction::ABS:
+        std::fprintf(file, "abs   %u, %u", a(), b());
+        break;
+    case Instruction::POPCOUNT:
+        std::fprintf(file, "popcount %u, %u", a(), b());
+        break;
+    case Instruction::CLZ:
+        std::fprintf(file, "clz   %u, %u", a(), b());
+        break;
+    case Instruction::CTZ:
+        std::fprintf(file, "ctz   %u, %u", a(), b());
+        break;
+    case Instruction::ISQRT:
+        std::fprintf(file, "isqrt %u, %u", a(), b());
+        break;
+    case Instruction::MIN:
+        std::fprintf(file, "min   %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::MAX:
+        std::fprintf(file, "max   %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::GCD:
+        std::fprintf(file, "gcd   %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::IPOW:
+        std::fprintf(file, "ipow  %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::MULHI:
+        std::fprintf(file, "mulhi %u, %u, %u", a(), b(), c());
+        break;
     // Move instructions.
     case Instruction::MOVI:
         std::fprintf(file, "movi  %u, $%i", a(), d());
@@ -108,6 +212,22 @@ void Instruction::print(std::FILE* file) const {
     case Instruction::MOVR:
         std::fprintf(file, "movr  %u, %u", a(), b());
         break;
+    // Array instructions.
+    case Instruction::ANEW:
+        std::fprintf(file, "anew  %u, %u", a(), b());
+        break;
+    case Instruction::ALOAD:
+        std::fprintf(file, "aload %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::ALOADU:
+        std::fprintf(file, "aloadu %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::ASTORE:
+        std::fprintf(file, "astore %u, %u, %u", a(), b(), c());
+        break;
+    case Instruction::ASTOREU:
+        std::fprintf(file, "astoreu %u, %u, %u", a(), b(), c());
+        break;
     // Jump instructions.
     case Instruction::JMP:
         std::fprintf(file, "jmp   $%i", static_cast<std::int16_t>(d()));
@@ -120,10 +240,34 @@ void Instruction::print(std::FILE* file) const {
         std::fprintf(file, "jf    %u, $%i", a(),
                 static_cast<std::int16_t>(d()));
         break;
+    case Instruction::JTAB:
+        std::fprintf(file, "jtab  %u, $%u", a(),
+                static_cast<std::uint16_t>(d()));
+        break;
+    case Instruction::FORPREP:
+        std::fprintf(file, "forprep %u, $%i", a(),
+                static_cast<std::int16_t>(d()));
+        break;
+    case Instruction::FORLOOP:
+        std::fprintf(file, "forloop %u, $%i", a(),
+                static_cast<std::int16_t>(d()));
+        break;
     // Call/ret instructions.
     case Instruction::CALL:
         std::fprintf(file, "call  %u, %u", a(), b());
         break;
+    case Instruction::CALLM:
+        std::fprintf(file, "callm %u, %u, $%u", a(), b(), c());
+        break;
+    case Instruction::STOREM:
+        std::fprintf(file, "storem %u", a());
+        break;
+    case Instruction::CALLN:
+        std::fprintf(file, "calln %u, %u, $%u", a(), b(), c());
+        break;
+    case Instruction::LAZY:
+        std::fputs("lazy", file);
+        break;
     case Instruction::RETR:
         std::fprintf(file, "retr  %u", a());
         break;
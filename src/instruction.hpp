@@ -15,38 +15,87 @@ public:
         MULRR, // a <- b * c
         EQRR,  // a <- b == c
         NERR,  // a <- b != c
+        ANDRR, // a <- b & c
+        ORRR,  // a <- b | c
+        XORRR, // a <- b ^ c
         ADDRI, // a <- b + $c
         MULRI, // a <- b * $c
         EQRI,  // a <- b == $c
         NERI,  // a <- b != $c
+        ANDRI, // a <- b & $c
+        ORRI,  // a <- b | $c
+        XORRI, // a <- b ^ $c
         // Noncommutative binary instructions.
         SUBRR, // a <- b - c
         DIVRR, // a <- b / c
         MODRR, // a <- b % c
         LTRR,  // a <- b < c
         LERR,  // a <- b <= c
+        SHLRR, // a <- b << (c & 63)
+        SARRR, // a <- b >> (c & 63), arithmetic
+        SHRRR, // a <- b >> (c & 63), logical
         SUBRI, // a <- b - $c
         DIVRI, // a <- b / $c
         MODRI, // a <- b % $c
         LTRI,  // a <- b < $c
         LERI,  // a <- b <= $c
+        SHLRI, // a <- b << ($c & 63)
+        SARRI, // a <- b >> ($c & 63), arithmetic
+        SHRRI, // a <- b >> ($c & 63), logical
         SUBIR, // a <- $b - c
         DIVIR, // a <- $b / c
         MODIR, // a <- $b % c
         LTIR,  // a <- $b < c
         LEIR,  // a <- $b <= c
+        SHLIR, // a <- $b << (c & 63)
+        SARIR, // a <- $b >> (c & 63), arithmetic
+        SHRIR, // a <- $b >> (c & 63), logical
+        // Division by constant instructions.
+        DIVMAGIC, // a <- b / d, where m, s, d = constants[$c], ..., [$c + 2]
+        MODMAGIC, // a <- b % d, where m, s, d = constants[$c], ..., [$c + 2]
+        DIVPOW2,  // a <- b / (1 << $c)
+        MODPOW2,  // a <- b % (1 << $c)
         // Unary instructions.
         NEG,   // a <- -b
         NOT,   // a <- !b
+        BNOT,  // a <- ~b
+        TRI,   // a <- b * (b - 1) / 2
+        // Builtin function instructions.
+        ABS,      // a <- abs(b)
+        POPCOUNT, // a <- popcount(b)
+        CLZ,      // a <- clz(b)
+        CTZ,      // a <- ctz(b)
+        ISQRT,    // a <- isqrt(b)
+        MIN,      // a <- min(b, c)
+        MAX,      // a <- max(b, c)
+        GCD,      // a <- gcd(b, c)
+        IPOW,     // a <- ipow(b, c)
+        MULHI,    // a <- mulhi(b, c)
         // Move instructions.
         MOVI,  // a <- $d
         MOVR,  // a <- b
+        // Array instructions, arrays are referred to by their handles.
+        ANEW,    // a <- handle of a new zero-filled array of length b
+        ALOAD,   // a <- b[c]
+        ALOADU,  // a <- b[c] without the bounds check
+        ASTORE,  // a[b] <- c
+        ASTOREU, // a[b] <- c without the bounds check
         // Jump instructions.
         JMP,   // goto d
         JT,    // if a != 0 goto $d
         JF,    // if a == 0 goto $d
+        JTAB,  // take the min(a, $d)-th of the following $d + 1 jumps
+        // Numeric loop instructions, a is the index, a + 1 the limit turned
+        // into the count of the remaining iterations, a + 2 the step and
+        // a + 3 the copy of the index used by the loop body.
+        FORPREP, // a + 1 <- count, a + 3 <- a, or goto $d if there is none
+        FORLOOP, // if a + 1 != 0: a + 1 -= 1, a += a + 2, a + 3 <- a, goto $d
         // Call/ret instructions.
         CALL,  // a <- a(a + 1, a + 2, ..., a + b)
+        CALLM, // a <- a(a + 1, a + 2, ..., a + b) memoized in the cache $c
+        STOREM, // stores a in the cache of the last missed CALLM
+        CALLN, // a <- natives[$c](a + 1, a + 2, ..., a + b)
+        LAZY,  // compile the function of this stub and enter it
         RETR,  // return a
         RETI,  // return $d
         // System instructions.
@@ -101,29 +150,40 @@ public:
         d_ = d;
     }
 
+    // The factories initialize the members of the union directly, so that
+    // they can be used in constant expressions, e.g. in embedded programs.
     constexpr static Instruction make_abc(Opcode opcode, std::uint8_t a,
             std::uint8_t b, std::uint8_t c) {
-        Instruction instruction;
-        instruction.opcode_ = opcode;
-        instruction.a_ = a;
-        instruction.bc_.b_ = b;
-        instruction.bc_.c_ = c;
-        return instruction;
+        return Instruction(opcode, a, b, c);
     }
 
     constexpr static Instruction make_ad(Opcode opcode, std::uint8_t a,
             std::uint16_t d) {
-        Instruction instruction;
-        instruction.opcode_ = opcode;
-        instruction.a_ = a;
-        instruction.d_ = d;
-        return instruction;
+        return Instruction(opcode, a, static_cast<std::int16_t>(d));
+    }
+
+    // Checks whether the instruction may jump by the offset $d.
+    constexpr bool is_jump() const {
+        return opcode_ == JMP || opcode_ == JT || opcode_ == JF ||
+            opcode_ == FORPREP || opcode_ == FORLOOP;
+    }
+
+    // Checks whether the instruction calls a function.
+    constexpr bool is_call() const {
+        return opcode_ == CALL || opcode_ == CALLM;
     }
 
     // Prints the instruction.
     COLD void print(std::FILE* file) const;
 
 private:
+    constexpr Instruction(Opcode opcode, std::uint8_t a, std::uint8_t b,
+            std::uint8_t c)
+        : opcode_(opcode), a_(a), bc_({ b, c }) {}
+
+    constexpr Instruction(Opcode opcode, std::uint8_t a, std::int16_t d)
+        : opcode_(opcode), a_(a), d_(d) {}
+
     Opcode opcode_;
     std::uint8_t a_;
     union {
@@ -1,16 +1,133 @@
 #include "interpreter.hpp"
+#include <algorithm>
 #include <cinttypes>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <experimental/optional>
+#include <limits>
+#include <map>
 #include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "builtins.hpp"
 #include "config.hpp"
 #include "cxx_extensions.hpp"
 #include "instruction.hpp"
 
+// The number of entries of a single memoization cache, must be a power of two.
+#if !defined(INTERPRETER_MEMO_CACHE_SIZE)
+#   define INTERPRETER_MEMO_CACHE_SIZE 4096
+#endif
+
+// The number of consecutive entries where a key may be stored.
+#if !defined(INTERPRETER_MEMO_PROBES)
+#   define INTERPRETER_MEMO_PROBES 4
+#endif
+
 namespace {
 
+// Memoization caches of functions called by CALLM. Every cache is a bounded
+// open-addressing table, a key may be stored only in a few entries following
+// its hash. When all of them are occupied, one is evicted in round-robin
+// order. Caches are allocated on their first use.
+class MemoCaches final {
+public:
+    MemoCaches() : clock_(0) {}
+    MemoCaches(const MemoCaches&) = delete;
+    void operator=(const MemoCaches&) = delete;
+
+    // Looks up the call with the given arguments in the cache. On miss, the
+    // key is saved until the result is stored by the following STOREM.
+    bool lookup(std::size_t cache, std::size_t num_args,
+            const std::int64_t* args, std::int64_t* result);
+
+    // Stores the result of the last missed call.
+    void store(std::int64_t result);
+
+private:
+    struct Entry final {
+        std::int64_t key_[INTERPRETER_MEMO_MAX_ARGS];
+        std::int64_t value_;
+        bool used_;
+    };
+
+    struct Pending final {
+        std::int64_t key_[INTERPRETER_MEMO_MAX_ARGS];
+        std::size_t num_args_;
+        Entry* first_;
+    };
+
+    static_assert((INTERPRETER_MEMO_CACHE_SIZE &
+                (INTERPRETER_MEMO_CACHE_SIZE - 1)) == 0);
+    static_assert((INTERPRETER_MEMO_PROBES &
+                (INTERPRETER_MEMO_PROBES - 1)) == 0);
+    static_assert(INTERPRETER_MEMO_PROBES <= INTERPRETER_MEMO_CACHE_SIZE);
+
+    std::vector<std::vector<Entry>> caches_;
+    // Keys of calls in progress, innermost last.
+    std::vector<Pending> pending_;
+    std::size_t clock_;
+};
+
+bool MemoCaches::lookup(std::size_t cache, std::size_t num_args,
+        const std::int64_t* args, std::int64_t* result) {
+    if (UNLIKELY(cache >= caches_.size())) {
+        caches_.resize(cache + 1);
+    }
+    auto& entries = caches_[cache];
+    if (UNLIKELY(entries.empty())) {
+        entries.resize(INTERPRETER_MEMO_CACHE_SIZE);
+    }
+    std::uint64_t hash = num_args;
+    for (std::size_t i = 0; i < num_args; ++i) {
+        hash = (hash ^ static_cast<std::uint64_t>(args[i])) *
+            UINT64_C(0x9e3779b97f4a7c15);
+    }
+    hash ^= hash >> 32;
+    // The probed entries are aligned, so they never cross the end of the table.
+    std::size_t index = hash & (INTERPRETER_MEMO_CACHE_SIZE -
+            INTERPRETER_MEMO_PROBES);
+    Entry* first = &entries[index];
+    for (std::size_t i = 0; i < INTERPRETER_MEMO_PROBES; ++i) {
+        const Entry& entry = first[i];
+        if (entry.used_ && std::equal(args, args + num_args, entry.key_)) {
+            *result = entry.value_;
+            return true;
+        }
+    }
+    Pending pending;
+    std::copy(args, args + num_args, pending.key_);
+    pending.num_args_ = num_args;
+    pending.first_ = first;
+    pending_.push_back(pending);
+    return false;
+}
+
+void MemoCaches::store(std::int64_t result) {
+    const Pending& pending = pending_.back();
+    Entry* victim = nullptr;
+    for (std::size_t i = 0; i < INTERPRETER_MEMO_PROBES; ++i) {
+        Entry& entry = pending.first_[i];
+        if (!entry.used_ || std::equal(pending.key_,
+                    pending.key_ + pending.num_args_, entry.key_)) {
+            victim = &entry;
+            break;
+        }
+    }
+    if (victim == nullptr) {
+        victim = &pending.first_[clock_++ % INTERPRETER_MEMO_PROBES];
+    }
+    std::copy(pending.key_, pending.key_ + pending.num_args_, victim->key_);
+    victim->value_ = result;
+    victim->used_ = true;
+    pending_.pop_back();
+}
+
 // Const instruction.
 
+ALWAYS_INLINE
 void interpret_const(const Instruction*& ip, const std::int64_t* consts,
         std::int64_t* const& regs) {
     std::size_t index = static_cast<std::uint16_t>(ip->d());
@@ -20,142 +137,417 @@ void interpret_const(const Instruction*& ip, const std::int64_t* consts,
 
 // Commutative binary instructions.
 
+ALWAYS_INLINE
 void interpret_addrr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] + regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_mulrr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] * regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_eqrr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] == regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_nerr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] != regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
+void interpret_andrr(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = regs[ip->b()] & regs[ip->c()];
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_orrr(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = regs[ip->b()] | regs[ip->c()];
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_xorrr(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = regs[ip->b()] ^ regs[ip->c()];
+    ++ip;
+}
+
+ALWAYS_INLINE
 void interpret_addri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] + static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_mulri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] * static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_eqri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] == static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_neri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] != static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
+void interpret_andri(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = regs[ip->b()] & static_cast<std::int8_t>(ip->c());
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_orri(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = regs[ip->b()] | static_cast<std::int8_t>(ip->c());
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_xorri(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = regs[ip->b()] ^ static_cast<std::int8_t>(ip->c());
+    ++ip;
+}
+
 // Noncommutative binary instructions.
 
+// Shifts take the shift amount modulo 64.
+
+ALWAYS_INLINE
+std::int64_t shl(std::int64_t n, std::int64_t k) {
+    return static_cast<std::int64_t>(static_cast<std::uint64_t>(n) << (k & 63));
+}
+
+ALWAYS_INLINE
+std::int64_t sar(std::int64_t n, std::int64_t k) {
+    return n >> (k & 63);
+}
+
+ALWAYS_INLINE
+std::int64_t shr(std::int64_t n, std::int64_t k) {
+    return static_cast<std::int64_t>(static_cast<std::uint64_t>(n) >> (k & 63));
+}
+
+ALWAYS_INLINE
 void interpret_subrr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] - regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_divrr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] / regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_modrr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] % regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_ltrr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] < regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_lerr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] <= regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
+void interpret_shlrr(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = shl(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_sarrr(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = sar(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_shrrr(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = shr(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
 void interpret_subri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] - static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_divri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] / static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_modri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] % static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_ltri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] < static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_leri(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()] <= static_cast<std::int8_t>(ip->c());
     ++ip;
 }
 
+ALWAYS_INLINE
+void interpret_shlri(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = shl(regs[ip->b()], static_cast<std::int8_t>(ip->c()));
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_sarri(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = sar(regs[ip->b()], static_cast<std::int8_t>(ip->c()));
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_shrri(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = shr(regs[ip->b()], static_cast<std::int8_t>(ip->c()));
+    ++ip;
+}
+
+ALWAYS_INLINE
 void interpret_subir(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = static_cast<std::int8_t>(ip->b()) - regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_divir(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = static_cast<std::int8_t>(ip->b()) / regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_modir(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = static_cast<std::int8_t>(ip->b()) % regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_ltir(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = static_cast<std::int8_t>(ip->b()) < regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_leir(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = static_cast<std::int8_t>(ip->b()) <= regs[ip->c()];
     ++ip;
 }
 
+ALWAYS_INLINE
+void interpret_shlir(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = shl(static_cast<std::int8_t>(ip->b()), regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_sarir(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = sar(static_cast<std::int8_t>(ip->b()), regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_shrir(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = shr(static_cast<std::int8_t>(ip->b()), regs[ip->c()]);
+    ++ip;
+}
+
+// Division by constant instructions.
+
+// Divides by the constant using the magic multiplier and shift, see Hacker's
+// Delight, chapter 10-1.
+ALWAYS_INLINE
+std::int64_t divide_by_magic(std::int64_t n, const std::int64_t* magic) {
+    std::int64_t m = magic[0];
+    std::int64_t s = magic[1];
+    std::int64_t d = magic[2];
+    auto q = static_cast<std::int64_t>(
+            (static_cast<__int128>(m) * n) >> 64);
+    if (d > 0 && m < 0) {
+        q += n;
+    } else if (d < 0 && m > 0) {
+        q -= n;
+    }
+    q >>= s;
+    q += static_cast<std::uint64_t>(q) >> 63;
+    return q;
+}
+
+ALWAYS_INLINE
+void interpret_divmagic(const Instruction*& ip, const std::int64_t* consts,
+        std::int64_t* const& regs) {
+    regs[ip->a()] = divide_by_magic(regs[ip->b()], consts + ip->c());
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_modmagic(const Instruction*& ip, const std::int64_t* consts,
+        std::int64_t* const& regs) {
+    std::int64_t n = regs[ip->b()];
+    const std::int64_t* magic = consts + ip->c();
+    regs[ip->a()] = n - divide_by_magic(n, magic) * magic[2];
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_divpow2(const Instruction*& ip, std::int64_t* const& regs) {
+    std::int64_t n = regs[ip->b()];
+    std::uint8_t k = ip->c();
+    // Round towards zero, i.e. add 2^k - 1 to negative dividends.
+    auto bias = static_cast<std::int64_t>(
+            static_cast<std::uint64_t>(n >> 63) >> (64 - k));
+    regs[ip->a()] = (n + bias) >> k;
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_modpow2(const Instruction*& ip, std::int64_t* const& regs) {
+    std::int64_t n = regs[ip->b()];
+    std::uint8_t k = ip->c();
+    auto bias = static_cast<std::int64_t>(
+            static_cast<std::uint64_t>(n >> 63) >> (64 - k));
+    std::int64_t mask = (std::int64_t(1) << k) - 1;
+    regs[ip->a()] = ((n + bias) & mask) - bias;
+    ++ip;
+}
+
 // Unary instructions.
 
+ALWAYS_INLINE
 void interpret_neg(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = -regs[ip->b()];
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_not(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = !regs[ip->b()];
     ++ip;
 }
 
+ALWAYS_INLINE
+void interpret_bnot(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = ~regs[ip->b()];
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_tri(const Instruction*& ip, std::int64_t* const& regs) {
+    // Halve the even factor first, so the result is exact modulo 2^64.
+    auto n = static_cast<std::uint64_t>(regs[ip->b()]);
+    std::uint64_t m = n - 1;
+    if (n % 2 == 0) {
+        n /= 2;
+    } else {
+        m /= 2;
+    }
+    regs[ip->a()] = static_cast<std::int64_t>(n * m);
+    ++ip;
+}
+
+// Builtin function instructions.
+
+ALWAYS_INLINE
+void interpret_abs(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_abs(regs[ip->b()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_popcount(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_popcount(regs[ip->b()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_clz(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_clz(regs[ip->b()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_ctz(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_ctz(regs[ip->b()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_isqrt(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_isqrt(regs[ip->b()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_min(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_min(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_max(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_max(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_gcd(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_gcd(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_ipow(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_ipow(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_mulhi(const Instruction*& ip, std::int64_t* const& regs) {
+    regs[ip->a()] = builtin_mulhi(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
 // Move instructions.
 
+ALWAYS_INLINE
 void interpret_movi(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = ip->d();
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_movr(const Instruction*& ip, std::int64_t* const& regs) {
     regs[ip->a()] = regs[ip->b()];
     ++ip;
@@ -163,10 +555,12 @@ void interpret_movr(const Instruction*& ip, std::int64_t* const& regs) {
 
 // Jump instructions.
 
+ALWAYS_INLINE
 void interpret_jmp(const Instruction*& ip) {
     ip += ip->d() + 1;
 }
 
+ALWAYS_INLINE
 void interpret_jt(const Instruction*& ip, const std::int64_t* const& regs) {
     if (regs[ip->a()] != 0) {
         ip += ip->d() + 1;
@@ -175,6 +569,7 @@ void interpret_jt(const Instruction*& ip, const std::int64_t* const& regs) {
     }
 }
 
+ALWAYS_INLINE
 void interpret_jf(const Instruction*& ip, const std::int64_t* const& regs) {
     if (regs[ip->a()] == 0) {
         ip += ip->d() + 1;
@@ -183,8 +578,56 @@ void interpret_jf(const Instruction*& ip, const std::int64_t* const& regs) {
     }
 }
 
+// Moves to the selected jump of the table, negative indices select the last
+// one like the too large ones.
+ALWAYS_INLINE
+void interpret_jtab(const Instruction*& ip, const std::int64_t* const& regs) {
+    auto index = static_cast<std::uint64_t>(regs[ip->a()]);
+    std::uint64_t size = static_cast<std::uint16_t>(ip->d());
+    ip += 1 + (index < size ? index : size);
+}
+
+// Computes the count of the iterations after the first one, so that the
+// loop can't overflow the index. A zero step runs no iterations.
+ALWAYS_INLINE
+void interpret_forprep(const Instruction*& ip, std::int64_t* const& regs) {
+    std::int64_t* loop = regs + ip->a();
+    auto index = static_cast<std::uint64_t>(loop[0]);
+    auto limit = static_cast<std::uint64_t>(loop[1]);
+    auto step = static_cast<std::uint64_t>(loop[2]);
+    std::uint64_t count;
+    if (loop[2] > 0 && loop[0] < loop[1]) {
+        count = limit - index - 1;
+        if (step != 1) {
+            count /= step;
+        }
+    } else if (loop[2] < 0 && loop[0] > loop[1]) {
+        count = (index - limit - 1) / -step;
+    } else {
+        ip += ip->d() + 1;
+        return;
+    }
+    loop[1] = count;
+    loop[3] = loop[0];
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_forloop(const Instruction*& ip, std::int64_t* const& regs) {
+    std::int64_t* loop = regs + ip->a();
+    if (loop[1] != 0) {
+        --loop[1];
+        loop[0] += loop[2];
+        loop[3] = loop[0];
+        ip += ip->d() + 1;
+    } else {
+        ++ip;
+    }
+}
+
 // Call/ret instructions.
 
+ALWAYS_INLINE
 void interpret_call(const Instruction*& ip, std::int64_t*& regs) {
     std::int32_t a = ip->a();
     const auto* tmp = ip;
@@ -193,6 +636,42 @@ void interpret_call(const Instruction*& ip, std::int64_t*& regs) {
     regs += a + 1;
 }
 
+ALWAYS_INLINE
+void interpret_callm(const Instruction*& ip, std::int64_t*& regs,
+        MemoCaches& caches) {
+    std::int32_t a = ip->a();
+    if (caches.lookup(ip->c(), ip->b(), regs + a + 1, regs + a)) {
+        // Skip the STOREM.
+        ip += 2;
+    } else {
+        interpret_call(ip, regs);
+    }
+}
+
+ALWAYS_INLINE
+void interpret_storem(const Instruction*& ip, const std::int64_t* const& regs,
+        MemoCaches& caches) {
+    caches.store(regs[ip->a()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_calln(const Instruction*& ip, std::int64_t* const& regs,
+        const NativeFunction* natives) {
+    std::int32_t a = ip->a();
+    regs[a] = natives[ip->c()](regs + a + 1, ip->b());
+    ++ip;
+}
+
+ALWAYS_INLINE
+void interpret_lazy(const Instruction*& ip, const std::int64_t* const& regs,
+        LazyCompiler* compiler, const std::int64_t*& consts) {
+    // The stub is entered by the call stored in the return address.
+    ip = compiler->compile(ip,
+            reinterpret_cast<const Instruction*>(regs[-1]), &consts);
+}
+
+ALWAYS_INLINE
 void interpret_retr(const Instruction*& ip, std::int64_t*& regs) {
     std::int64_t ret = regs[ip->a()];
     ip = reinterpret_cast<Instruction*>(regs[-1]);
@@ -201,6 +680,7 @@ void interpret_retr(const Instruction*& ip, std::int64_t*& regs) {
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_reti(const Instruction*& ip, std::int64_t*& regs) {
     std::int64_t ret = ip->d();
     ip = reinterpret_cast<Instruction*>(regs[-1]);
@@ -211,35 +691,326 @@ void interpret_reti(const Instruction*& ip, std::int64_t*& regs) {
 
 // System instructions.
 
+ALWAYS_INLINE
 int interpret_exit(const Instruction* const& ip,
         const std::int64_t* const& regs) {
     return regs[ip->a()];
 }
 
+ALWAYS_INLINE
 void interpret_in(const Instruction*& ip, std::int64_t* const& regs) {
     // Suppress the unused result warning.
     if (std::scanf("%" PRId64, &regs[ip->a()])) {}
     ++ip;
 }
 
+ALWAYS_INLINE
 void interpret_out(const Instruction*& ip, const std::int64_t* const& regs) {
     std::printf("%" PRId64 "\n", regs[ip->a()]);
     ++ip;
 }
 
+// Checks whether the division doesn't trap.
+ALWAYS_INLINE
+bool is_valid_division(std::int64_t dividend, std::int64_t divisor) {
+    return divisor != 0 &&
+        (divisor != -1 || dividend != std::numeric_limits<std::int64_t>::min());
+}
+
+// The largest frame, CALL a, b uses the registers up to a + b.
+constexpr std::size_t MAX_FRAME_SIZE =
+    2 * std::numeric_limits<std::uint8_t>::max() + 1;
+
+// The frame size checked at calls of the unverified bytecode.
+constexpr std::uint16_t LARGEST_FRAME_SIZE[] = {MAX_FRAME_SIZE};
+
+// Checks the stack at calls, the callee's frame must fit. The unverified
+// bytecode has no frame sizes, its index is masked to the largest frame. A
+// single class rather than a template parameter keeps the interpreter
+// instantiated once.
+class CallStack final {
+public:
+    // Checks the unverified bytecode.
+    CallStack()
+        : bytecode_(0), frame_sizes_(LARGEST_FRAME_SIZE), mask_(0) {}
+
+    // Checks the verified bytecode with the given frame sizes.
+    CallStack(const Instruction* bytecode, const std::uint16_t* frame_sizes)
+        : bytecode_(reinterpret_cast<std::uintptr_t>(bytecode)),
+        frame_sizes_(frame_sizes), mask_(static_cast<std::size_t>(-1)) {}
+
+    ALWAYS_INLINE
+    bool fits(const Instruction* ip, const std::int64_t* regs,
+            const std::int64_t* regs_end) const {
+        std::int32_t a = ip->a();
+        auto callee = reinterpret_cast<std::uintptr_t>(ip + regs[a] + 1);
+        std::size_t index = (callee - bytecode_) / sizeof(Instruction) & mask_;
+        return regs + a + 1 + frame_sizes_[index] <= regs_end;
+    }
+
+private:
+    std::uintptr_t bytecode_;
+    const std::uint16_t* frame_sizes_;
+    std::size_t mask_;
+};
+
+COLD
+int stack_overflow() {
+    std::fputs("Error: stack overflow\n", stderr);
+    return EXIT_FAILURE;
+}
+
+// Memory reserved by mmap, its pages are committed and zeroed by the kernel
+// when they are touched first, so the unused part costs nothing. Overruns
+// fault on the guard pages around the memory.
+class ReservedMemory final {
+public:
+    // Reserves at least the given size in bytes rounded up to whole pages.
+    // Huge pages are only a hint.
+    ReservedMemory(std::size_t size, bool huge_pages);
+    ReservedMemory(const ReservedMemory&) = delete;
+    ReservedMemory& operator=(const ReservedMemory&) = delete;
+    ~ReservedMemory();
+
+    // Gets the first word, nullptr if the memory couldn't be reserved.
+    std::int64_t* begin() const {
+        return begin_;
+    }
+
+    const std::int64_t* end() const {
+        return end_;
+    }
+
+private:
+    void* mapping_;
+    std::size_t mapping_size_;
+    std::int64_t* begin_;
+    std::int64_t* end_;
+};
+
+ReservedMemory::ReservedMemory(std::size_t size, bool huge_pages)
+        : mapping_(MAP_FAILED), mapping_size_(0), begin_(nullptr),
+          end_(nullptr) {
+    auto page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    if (size > std::numeric_limits<std::size_t>::max() - 3 * page_size) {
+        return;
+    }
+    size = (size + page_size - 1) & ~(page_size - 1);
+    // The reservation isn't backed by swap, the touched pages are.
+    mapping_size_ = size + 2 * page_size;
+    mapping_ = ::mmap(nullptr, mapping_size_, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (UNLIKELY(mapping_ == MAP_FAILED)) {
+        return;
+    }
+    auto* memory = static_cast<char*>(mapping_) + page_size;
+    if (UNLIKELY(::mprotect(memory, size, PROT_READ | PROT_WRITE) != 0)) {
+        return;
+    }
+#if defined(MADV_HUGEPAGE)
+    if (huge_pages) {
+        ::madvise(memory, size, MADV_HUGEPAGE);
+    }
+#else
+    static_cast<void>(huge_pages);
+#endif
+    begin_ = reinterpret_cast<std::int64_t*>(memory);
+    end_ = reinterpret_cast<std::int64_t*>(memory + size);
+}
+
+ReservedMemory::~ReservedMemory() {
+    if (mapping_ != MAP_FAILED) {
+        ::munmap(mapping_, mapping_size_);
+    }
 }
 
-#if !defined(INTERPRETER_MEMORY_SIZE)
-#   define INTERPRETER_MEMORY_SIZE (1024 * 1024)
+// The registers of the frames, at least the largest frame fits.
+class RegisterStack final {
+public:
+    explicit RegisterStack(std::size_t size)
+        : memory_(std::max(size, MAX_FRAME_SIZE * sizeof(std::int64_t)),
+#if defined(INTERPRETER_STACK_HUGEPAGES)
+                true
+#else
+                false
 #endif
+                ) {}
+
+    // Gets the first register, nullptr if the stack couldn't be reserved.
+    std::int64_t* begin() const {
+        return memory_.begin();
+    }
+
+    const std::int64_t* end() const {
+        return memory_.end();
+    }
+
+private:
+    ReservedMemory memory_;
+};
+
+// The arrays of a run, allocated by bumping the top and released all at once
+// when the run ends. A handle of an array is the index of its first element,
+// its length is stored before it, so 0 is never a handle. The number of words
+// is a power of two, so the unchecked accesses, whose indices are proven to
+// be in range by the compiler, are masked to stay in the arena whatever the
+// handle is.
+class Arena final {
+public:
+    // Reserves at least the given size in bytes rounded up to a power of two.
+    explicit Arena(std::size_t size)
+        : memory_(round_size(size), false), words_(memory_.begin()),
+          mask_(round_size(size) / sizeof(std::int64_t) - 1), top_(0) {}
+
+    // Checks whether the arena is reserved.
+    bool is_valid() const {
+        return words_ != nullptr;
+    }
+
+    // Allocates a zeroed array, returns its handle, 0 if the length is
+    // negative or the array doesn't fit.
+    std::int64_t allocate(std::int64_t length) {
+        if (UNLIKELY(length < 0 ||
+                static_cast<std::uint64_t>(length) >= mask_ - top_)) {
+            return 0;
+        }
+        words_[top_] = length;
+        std::uint64_t handle = top_ + 1;
+        top_ = handle + length;
+        return handle;
+    }
+
+    // Finds the element of the array, nullptr if the handle or the index is
+    // out of range.
+    ALWAYS_INLINE
+    std::int64_t* find(std::int64_t handle, std::int64_t index) const {
+        auto h = static_cast<std::uint64_t>(handle);
+        auto i = static_cast<std::uint64_t>(index);
+        // A forged handle must not reach past the top either.
+        if (UNLIKELY(h - 1 >= top_ ||
+                i >= static_cast<std::uint64_t>(words_[h - 1]) ||
+                i >= top_ - h)) {
+            return nullptr;
+        }
+        return words_ + h + i;
+    }
+
+    ALWAYS_INLINE
+    std::int64_t* find_unchecked(std::int64_t handle,
+            std::int64_t index) const {
+        return words_ + ((static_cast<std::uint64_t>(handle) +
+                    static_cast<std::uint64_t>(index)) & mask_);
+    }
+
+private:
+    static std::size_t round_size(std::size_t size) {
+        std::size_t rounded = 4096;
+        while (rounded < size &&
+                rounded <= std::numeric_limits<std::size_t>::max() / 4) {
+            rounded *= 2;
+        }
+        return rounded;
+    }
+
+    ReservedMemory memory_;
+    std::int64_t* words_;
+    std::uint64_t mask_;
+    // The index of the first free word.
+    std::uint64_t top_;
+};
+
+// Array instructions, return false if the allocation fails or the access is
+// out of range.
+
+ALWAYS_INLINE
+bool interpret_anew(const Instruction*& ip, std::int64_t* const& regs,
+        Arena& arena) {
+    std::int64_t handle = arena.allocate(regs[ip->b()]);
+    if (UNLIKELY(handle == 0)) {
+        return false;
+    }
+    regs[ip->a()] = handle;
+    ++ip;
+    return true;
+}
+
+ALWAYS_INLINE
+bool interpret_aload(const Instruction*& ip, std::int64_t* const& regs,
+        const Arena& arena) {
+    const std::int64_t* element = arena.find(regs[ip->b()], regs[ip->c()]);
+    if (UNLIKELY(element == nullptr)) {
+        return false;
+    }
+    regs[ip->a()] = *element;
+    ++ip;
+    return true;
+}
+
+ALWAYS_INLINE
+void interpret_aloadu(const Instruction*& ip, std::int64_t* const& regs,
+        const Arena& arena) {
+    regs[ip->a()] = *arena.find_unchecked(regs[ip->b()], regs[ip->c()]);
+    ++ip;
+}
+
+ALWAYS_INLINE
+bool interpret_astore(const Instruction*& ip, const std::int64_t* const& regs,
+        const Arena& arena) {
+    std::int64_t* element = arena.find(regs[ip->a()], regs[ip->b()]);
+    if (UNLIKELY(element == nullptr)) {
+        return false;
+    }
+    *element = regs[ip->c()];
+    ++ip;
+    return true;
+}
+
+ALWAYS_INLINE
+void interpret_astoreu(const Instruction*& ip,
+        const std::int64_t* const& regs, const Arena& arena) {
+    *arena.find_unchecked(regs[ip->a()], regs[ip->b()]) = regs[ip->c()];
+    ++ip;
+}
+
+COLD
+int stack_unavailable() {
+    std::fputs("Error: couldn't reserve the stack\n", stderr);
+    return EXIT_FAILURE;
+}
+
+COLD
+int arena_unavailable() {
+    std::fputs("Error: couldn't reserve the arrays\n", stderr);
+    return EXIT_FAILURE;
+}
 
+COLD
+int array_unavailable(const Instruction* ip, const std::int64_t* regs) {
+    std::fprintf(stderr, "Error: couldn't allocate an array of length %"
+            PRId64 "\n", regs[ip->b()]);
+    return EXIT_FAILURE;
+}
+
+COLD
+int index_out_of_range(std::int64_t index) {
+    std::fprintf(stderr, "Error: array index %" PRId64 " out of range\n",
+            index);
+    return EXIT_FAILURE;
+}
+
+}
+
+// Set by the embedder, INTERPRETER_STACK_SIZE and INTERPRETER_ARENA_SIZE by
+// default.
+extern std::size_t stack_size;
+extern std::size_t arena_size;
 extern int trace_flag;
 
 #ifndef NDEBUG
-    #define TRACE if (trace_flag != 0) {                      \
-        std::fprintf(stderr, "%08zu ", ip - bytecode.data()); \
-        ip->print(stderr);                                    \
-        std::fputc('\n', stderr);                             \
+    #define TRACE if (trace_flag != 0) {                 \
+        std::fprintf(stderr, "%08zu ", ip - bytecode);   \
+        ip->print(stderr);                               \
+        std::fputc('\n', stderr);                        \
     }
 #else
     #define TRACE
@@ -257,38 +1028,95 @@ extern int trace_flag;
     case Instruction::MULRR: goto instruction_mulrr; \
     case Instruction::EQRR: goto instruction_eqrr;   \
     case Instruction::NERR: goto instruction_nerr;   \
+    case Instruction::ANDRR: goto instruction_andrr; \
+    case Instruction::ORRR: goto instruction_orrr;   \
+    case Instruction::XORRR: goto instruction_xorrr; \
     case Instruction::ADDRI: goto instruction_addri; \
     case Instruction::MULRI: goto instruction_mulri; \
     case Instruction::EQRI: goto instruction_eqri;   \
     case Instruction::NERI: goto instruction_neri;   \
+    case Instruction::ANDRI: goto instruction_andri; \
+    case Instruction::ORRI: goto instruction_orri;   \
+    case Instruction::XORRI: goto instruction_xorri; \
     /* Noncommutative binary instructions. */        \
     case Instruction::SUBRR: goto instruction_subrr; \
     case Instruction::DIVRR: goto instruction_divrr; \
     case Instruction::MODRR: goto instruction_modrr; \
     case Instruction::LTRR: goto instruction_ltrr;   \
     case Instruction::LERR: goto instruction_lerr;   \
+    case Instruction::SHLRR: goto instruction_shlrr; \
+    case Instruction::SARRR: goto instruction_sarrr; \
+    case Instruction::SHRRR: goto instruction_shrrr; \
     case Instruction::SUBRI: goto instruction_subri; \
     case Instruction::DIVRI: goto instruction_divri; \
     case Instruction::MODRI: goto instruction_modri; \
     case Instruction::LTRI: goto instruction_ltri;   \
     case Instruction::LERI: goto instruction_leri;   \
+    case Instruction::SHLRI: goto instruction_shlri; \
+    case Instruction::SARRI: goto instruction_sarri; \
+    case Instruction::SHRRI: goto instruction_shrri; \
     case Instruction::SUBIR: goto instruction_subir; \
     case Instruction::DIVIR: goto instruction_divir; \
     case Instruction::MODIR: goto instruction_modir; \
     case Instruction::LTIR: goto instruction_ltir;   \
     case Instruction::LEIR: goto instruction_leir;   \
+    case Instruction::SHLIR: goto instruction_shlir; \
+    case Instruction::SARIR: goto instruction_sarir; \
+    case Instruction::SHRIR: goto instruction_shrir; \
+    /* Division by constant instructions. */         \
+    case Instruction::DIVMAGIC:                      \
+        goto instruction_divmagic;                   \
+    case Instruction::MODMAGIC:                      \
+        goto instruction_modmagic;                   \
+    case Instruction::DIVPOW2:                       \
+        goto instruction_divpow2;                    \
+    case Instruction::MODPOW2:                       \
+        goto instruction_modpow2;                    \
     /* Unary instructions. */                        \
     case Instruction::NEG: goto instruction_neg;     \
     case Instruction::NOT: goto instruction_not;     \
+    case Instruction::BNOT: goto instruction_bnot;   \
+    case Instruction::TRI: goto instruction_tri;     \
+    /* Builtin function instructions. */             \
+    case Instruction::ABS: goto instruction_abs;     \
+    case Instruction::POPCOUNT:                      \
+        goto instruction_popcount;                   \
+    case Instruction::CLZ: goto instruction_clz;     \
+    case Instruction::CTZ: goto instruction_ctz;     \
+    case Instruction::ISQRT: goto instruction_isqrt; \
+    case Instruction::MIN: goto instruction_min;     \
+    case Instruction::MAX: goto instruction_max;     \
+    case Instruction::GCD: goto instruction_gcd;     \
+    case Instruction::IPOW: goto instruction_ipow;   \
+    case Instruction::MULHI: goto instruction_mulhi; \
     /* Move instructions. */                         \
     case Instruction::MOVI: goto instruction_movi;   \
     case Instruction::MOVR: goto instruction_movr;   \
+    /* Array instructions. */                        \
+    case Instruction::ANEW: goto instruction_anew;   \
+    case Instruction::ALOAD: goto instruction_aload; \
+    case Instruction::ALOADU:                        \
+        goto instruction_aloadu;                     \
+    case Instruction::ASTORE:                        \
+        goto instruction_astore;                     \
+    case Instruction::ASTOREU:                       \
+        goto instruction_astoreu;                    \
     /* Jump instructions. */                         \
     case Instruction::JMP: goto instruction_jmp;     \
     case Instruction::JT: goto instruction_jt;       \
     case Instruction::JF: goto instruction_jf;       \
+    case Instruction::JTAB: goto instruction_jtab;   \
+    case Instruction::FORPREP:                       \
+        goto instruction_forprep;                    \
+    case Instruction::FORLOOP:                       \
+        goto instruction_forloop;                    \
     /* Call/ret instructions. */                     \
     case Instruction::CALL: goto instruction_call;   \
+    case Instruction::CALLM: goto instruction_callm; \
+    case Instruction::STOREM:                        \
+        goto instruction_storem;                     \
+    case Instruction::CALLN: goto instruction_calln; \
+    case Instruction::LAZY: goto instruction_lazy;   \
     case Instruction::RETR: goto instruction_retr;   \
     case Instruction::RETI: goto instruction_reti;   \
     /* System instructions. */                       \
@@ -299,13 +1127,25 @@ extern int trace_flag;
     }                                                \
 } while (0)
 
-int interpret(const std::vector<Instruction>& bytecode,
-        const std::vector<std::int64_t>& constants) {
-    std::vector<std::int64_t> memory(
-            INTERPRETER_MEMORY_SIZE / sizeof(std::int64_t));
-    std::int64_t* regs = memory.data();
-    const auto* ip = bytecode.data();
-    const std::int64_t* consts = constants.data();
+namespace {
+
+int interpret_replicate(const Instruction* bytecode,
+        const std::int64_t* constants, const NativeFunctions& native_functions,
+        LazyCompiler* compiler, const CallStack& stack) {
+    RegisterStack memory(stack_size);
+    if (UNLIKELY(memory.begin() == nullptr)) {
+        return stack_unavailable();
+    }
+    Arena arena(arena_size);
+    if (UNLIKELY(!arena.is_valid())) {
+        return arena_unavailable();
+    }
+    std::int64_t* regs = memory.begin();
+    const std::int64_t* regs_end = memory.end();
+    const auto* ip = bytecode;
+    const std::int64_t* consts = constants;
+    const NativeFunction* natives = native_functions.functions();
+    MemoCaches caches;
     NEXT;
 // Const instruction.
 instruction_const:
@@ -324,6 +1164,15 @@ instruction_eqrr:
 instruction_nerr:
     interpret_nerr(ip, regs);
     NEXT;
+instruction_andrr:
+    interpret_andrr(ip, regs);
+    NEXT;
+instruction_orrr:
+    interpret_orrr(ip, regs);
+    NEXT;
+instruction_xorrr:
+    interpret_xorrr(ip, regs);
+    NEXT;
 instruction_addri:
     interpret_addri(ip, regs);
     NEXT;
@@ -336,6 +1185,15 @@ instruction_eqri:
 instruction_neri:
     interpret_neri(ip, regs);
     NEXT;
+instruction_andri:
+    interpret_andri(ip, regs);
+    NEXT;
+instruction_orri:
+    interpret_orri(ip, regs);
+    NEXT;
+instruction_xorri:
+    interpret_xorri(ip, regs);
+    NEXT;
 // Noncommutative binary instructions.
 instruction_subrr:
     interpret_subrr(ip, regs);
@@ -352,6 +1210,15 @@ instruction_ltrr:
 instruction_lerr:
     interpret_lerr(ip, regs);
     NEXT;
+instruction_shlrr:
+    interpret_shlrr(ip, regs);
+    NEXT;
+instruction_sarrr:
+    interpret_sarrr(ip, regs);
+    NEXT;
+instruction_shrrr:
+    interpret_shrrr(ip, regs);
+    NEXT;
 instruction_subri:
     interpret_subri(ip, regs);
     NEXT;
@@ -367,6 +1234,15 @@ instruction_ltri:
 instruction_leri:
     interpret_leri(ip, regs);
     NEXT;
+instruction_shlri:
+    interpret_shlri(ip, regs);
+    NEXT;
+instruction_sarri:
+    interpret_sarri(ip, regs);
+    NEXT;
+instruction_shrri:
+    interpret_shrri(ip, regs);
+    NEXT;
 instruction_subir:
     interpret_subir(ip, regs);
     NEXT;
@@ -382,6 +1258,28 @@ instruction_ltir:
 instruction_leir:
     interpret_leir(ip, regs);
     NEXT;
+instruction_shlir:
+    interpret_shlir(ip, regs);
+    NEXT;
+instruction_sarir:
+    interpret_sarir(ip, regs);
+    NEXT;
+instruction_shrir:
+    interpret_shrir(ip, regs);
+    NEXT;
+// Division by constant instructions.
+instruction_divmagic:
+    interpret_divmagic(ip, consts, regs);
+    NEXT;
+instruction_modmagic:
+    interpret_modmagic(ip, consts, regs);
+    NEXT;
+instruction_divpow2:
+    interpret_divpow2(ip, regs);
+    NEXT;
+instruction_modpow2:
+    interpret_modpow2(ip, regs);
+    NEXT;
 // Unary instructions.
 instruction_neg:
     interpret_neg(ip, regs);
@@ -389,6 +1287,43 @@ instruction_neg:
 instruction_not:
     interpret_not(ip, regs);
     NEXT;
+instruction_bnot:
+    interpret_bnot(ip, regs);
+    NEXT;
+instruction_tri:
+    interpret_tri(ip, regs);
+    NEXT;
+// Builtin function instructions.
+instruction_abs:
+    interpret_abs(ip, regs);
+    NEXT;
+instruction_popcount:
+    interpret_popcount(ip, regs);
+    NEXT;
+instruction_clz:
+    interpret_clz(ip, regs);
+    NEXT;
+instruction_ctz:
+    interpret_ctz(ip, regs);
+    NEXT;
+instruction_isqrt:
+    interpret_isqrt(ip, regs);
+    NEXT;
+instruction_min:
+    interpret_min(ip, regs);
+    NEXT;
+instruction_max:
+    interpret_max(ip, regs);
+    NEXT;
+instruction_gcd:
+    interpret_gcd(ip, regs);
+    NEXT;
+instruction_ipow:
+    interpret_ipow(ip, regs);
+    NEXT;
+instruction_mulhi:
+    interpret_mulhi(ip, regs);
+    NEXT;
 // Move instructions.
 instruction_movi:
     interpret_movi(ip, regs);
@@ -396,6 +1331,28 @@ instruction_movi:
 instruction_movr:
     interpret_movr(ip, regs);
     NEXT;
+// Array instructions.
+instruction_anew:
+    if (UNLIKELY(!interpret_anew(ip, regs, arena))) {
+        return array_unavailable(ip, regs);
+    }
+    NEXT;
+instruction_aload:
+    if (UNLIKELY(!interpret_aload(ip, regs, arena))) {
+        return index_out_of_range(regs[ip->c()]);
+    }
+    NEXT;
+instruction_aloadu:
+    interpret_aloadu(ip, regs, arena);
+    NEXT;
+instruction_astore:
+    if (UNLIKELY(!interpret_astore(ip, regs, arena))) {
+        return index_out_of_range(regs[ip->b()]);
+    }
+    NEXT;
+instruction_astoreu:
+    interpret_astoreu(ip, regs, arena);
+    NEXT;
 // Jump instructions.
 instruction_jmp:
     interpret_jmp(ip);
@@ -406,10 +1363,38 @@ instruction_jt:
 instruction_jf:
     interpret_jf(ip, regs);
     NEXT;
+instruction_jtab:
+    interpret_jtab(ip, regs);
+    interpret_jmp(ip);
+    NEXT;
+instruction_forprep:
+    interpret_forprep(ip, regs);
+    NEXT;
+instruction_forloop:
+    interpret_forloop(ip, regs);
+    NEXT;
 // Call/ret instructions.
 instruction_call:
+    if (UNLIKELY(!stack.fits(ip, regs, regs_end))) {
+        return stack_overflow();
+    }
     interpret_call(ip, regs);
     NEXT;
+instruction_callm:
+    if (UNLIKELY(!stack.fits(ip, regs, regs_end))) {
+        return stack_overflow();
+    }
+    interpret_callm(ip, regs, caches);
+    NEXT;
+instruction_storem:
+    interpret_storem(ip, regs, caches);
+    NEXT;
+instruction_calln:
+    interpret_calln(ip, regs, natives);
+    NEXT;
+instruction_lazy:
+    interpret_lazy(ip, regs, compiler, consts);
+    NEXT;
 instruction_retr:
     interpret_retr(ip, regs);
     NEXT;
@@ -430,17 +1415,62 @@ instruction_out:
     return 0;
 }
 
-#else // !INTERPRETER_REPLICATE_SWITCH
+}
 
-int interpret(const std::vector<Instruction>& bytecode,
-        const std::vector<std::int64_t>& constants) {
-    std::vector<std::int64_t> memory(
-            INTERPRETER_MEMORY_SIZE / sizeof(std::int64_t));
-    std::int64_t* regs = memory.data();
-    const auto* ip = bytecode.data();
-    const std::int64_t* consts = constants.data();
+#endif // INTERPRETER_REPLICATE_SWITCH
+
+namespace {
+
+// Doesn't observe the execution.
+struct NullProfiler final {
+    void execute(const Instruction*) {}
+    void jump(const Instruction*, const Instruction*) {}
+};
+
+// Counts executed instructions and taken jumps.
+class CountingProfiler final {
+public:
+    CountingProfiler(const Instruction* base, ExecutionCounts* counts)
+        : base_(base), counts_(counts) {}
+
+    void execute(const Instruction* ip) {
+        ++counts_->executed_[ip - base_];
+    }
+
+    void jump(const Instruction* jump, const Instruction* ip) {
+        if (ip != jump + 1) {
+            ++counts_->taken_[jump - base_];
+        }
+    }
+
+private:
+    const Instruction* base_;
+    ExecutionCounts* counts_;
+};
+
+
+template <typename Profiler>
+int interpret_switch(const Instruction* bytecode,
+        const std::int64_t* constants, const NativeFunctions& native_functions,
+        LazyCompiler* compiler, Profiler& profiler, const CallStack& stack) {
+    RegisterStack memory(stack_size);
+    if (UNLIKELY(memory.begin() == nullptr)) {
+        return stack_unavailable();
+    }
+    Arena arena(arena_size);
+    if (UNLIKELY(!arena.is_valid())) {
+        return arena_unavailable();
+    }
+    std::int64_t* regs = memory.begin();
+    const std::int64_t* regs_end = memory.end();
+    const auto* ip = bytecode;
+    const std::int64_t* consts = constants;
+    const NativeFunction* natives = native_functions.functions();
+    MemoCaches caches;
     for (;;) {
         TRACE;
+        profiler.execute(ip);
+        const auto* const current = ip;
         switch (ip->opcode()) {
         // Const instruction.
         case Instruction::CONST:
@@ -459,6 +1489,15 @@ int interpret(const std::vector<Instruction>& bytecode,
         case Instruction::NERR:
             interpret_nerr(ip, regs);
             break;
+        case Instruction::ANDRR:
+            interpret_andrr(ip, regs);
+            break;
+        case Instruction::ORRR:
+            interpret_orrr(ip, regs);
+            break;
+        case Instruction::XORRR:
+            interpret_xorrr(ip, regs);
+            break;
         case Instruction::ADDRI:
             interpret_addri(ip, regs);
             break;
@@ -471,6 +1510,15 @@ int interpret(const std::vector<Instruction>& bytecode,
         case Instruction::NERI:
             interpret_neri(ip, regs);
             break;
+        case Instruction::ANDRI:
+            interpret_andri(ip, regs);
+            break;
+        case Instruction::ORRI:
+            interpret_orri(ip, regs);
+            break;
+        case Instruction::XORRI:
+            interpret_xorri(ip, regs);
+            break;
         // Noncommutative binary instructions.
         case Instruction::SUBRR:
             interpret_subrr(ip, regs);
@@ -487,6 +1535,15 @@ int interpret(const std::vector<Instruction>& bytecode,
         case Instruction::LERR:
             interpret_lerr(ip, regs);
             break;
+        case Instruction::SHLRR:
+            interpret_shlrr(ip, regs);
+            break;
+        case Instruction::SARRR:
+            interpret_sarrr(ip, regs);
+            break;
+        case Instruction::SHRRR:
+            interpret_shrrr(ip, regs);
+            break;
         case Instruction::SUBRI:
             interpret_subri(ip, regs);
             break;
@@ -502,6 +1559,15 @@ int interpret(const std::vector<Instruction>& bytecode,
         case Instruction::LERI:
             interpret_leri(ip, regs);
             break;
+        case Instruction::SHLRI:
+            interpret_shlri(ip, regs);
+            break;
+        case Instruction::SARRI:
+            interpret_sarri(ip, regs);
+            break;
+        case Instruction::SHRRI:
+            interpret_shrri(ip, regs);
+            break;
         case Instruction::SUBIR:
             interpret_subir(ip, regs);
             break;
@@ -517,6 +1583,28 @@ int interpret(const std::vector<Instruction>& bytecode,
         case Instruction::LEIR:
             interpret_leir(ip, regs);
             break;
+        case Instruction::SHLIR:
+            interpret_shlir(ip, regs);
+            break;
+        case Instruction::SARIR:
+            interpret_sarir(ip, regs);
+            break;
+        case Instruction::SHRIR:
+            interpret_shrir(ip, regs);
+            break;
+        // Division by constant instructions.
+        case Instruction::DIVMAGIC:
+            interpret_divmagic(ip, consts, regs);
+            break;
+        case Instruction::MODMAGIC:
+            interpret_modmagic(ip, consts, regs);
+            break;
+        case Instruction::DIVPOW2:
+            interpret_divpow2(ip, regs);
+            break;
+        case Instruction::MODPOW2:
+            interpret_modpow2(ip, regs);
+            break;
         // Unary instructions.
         case Instruction::NEG:
             interpret_neg(ip, regs);
@@ -524,6 +1612,43 @@ int interpret(const std::vector<Instruction>& bytecode,
         case Instruction::NOT:
             interpret_not(ip, regs);
             break;
+        case Instruction::BNOT:
+            interpret_bnot(ip, regs);
+            break;
+        case Instruction::TRI:
+            interpret_tri(ip, regs);
+            break;
+        // Builtin function instructions.
+        case Instruction::ABS:
+            interpret_abs(ip, regs);
+            break;
+        case Instruction::POPCOUNT:
+            interpret_popcount(ip, regs);
+            break;
+        case Instruction::CLZ:
+            interpret_clz(ip, regs);
+            break;
+        case Instruction::CTZ:
+            interpret_ctz(ip, regs);
+            break;
+        case Instruction::ISQRT:
+            interpret_isqrt(ip, regs);
+            break;
+        case Instruction::MIN:
+            interpret_min(ip, regs);
+            break;
+        case Instruction::MAX:
+            interpret_max(ip, regs);
+            break;
+        case Instruction::GCD:
+            interpret_gcd(ip, regs);
+            break;
+        case Instruction::IPOW:
+            interpret_ipow(ip, regs);
+            break;
+        case Instruction::MULHI:
+            interpret_mulhi(ip, regs);
+            break;
         // Move instructions.
         case Instruction::MOVI:
             interpret_movi(ip, regs);
@@ -531,20 +1656,75 @@ int interpret(const std::vector<Instruction>& bytecode,
         case Instruction::MOVR:
             interpret_movr(ip, regs);
             break;
+        // Array instructions.
+        case Instruction::ANEW:
+            if (UNLIKELY(!interpret_anew(ip, regs, arena))) {
+                return array_unavailable(ip, regs);
+            }
+            break;
+        case Instruction::ALOAD:
+            if (UNLIKELY(!interpret_aload(ip, regs, arena))) {
+                return index_out_of_range(regs[ip->c()]);
+            }
+            break;
+        case Instruction::ALOADU:
+            interpret_aloadu(ip, regs, arena);
+            break;
+        case Instruction::ASTORE:
+            if (UNLIKELY(!interpret_astore(ip, regs, arena))) {
+                return index_out_of_range(regs[ip->b()]);
+            }
+            break;
+        case Instruction::ASTOREU:
+            interpret_astoreu(ip, regs, arena);
+            break;
         // Jump instructions.
         case Instruction::JMP:
             interpret_jmp(ip);
+            profiler.jump(current, ip);
             break;
         case Instruction::JT:
             interpret_jt(ip, regs);
+            profiler.jump(current, ip);
             break;
         case Instruction::JF:
             interpret_jf(ip, regs);
+            profiler.jump(current, ip);
+            break;
+        // The selected jump is executed on its own, so that it is profiled.
+        case Instruction::JTAB:
+            interpret_jtab(ip, regs);
+            break;
+        case Instruction::FORPREP:
+            interpret_forprep(ip, regs);
+            profiler.jump(current, ip);
+            break;
+        case Instruction::FORLOOP:
+            interpret_forloop(ip, regs);
+            profiler.jump(current, ip);
             break;
         // Call/ret instructions.
         case Instruction::CALL:
+            if (UNLIKELY(!stack.fits(ip, regs, regs_end))) {
+                return stack_overflow();
+            }
             interpret_call(ip, regs);
             break;
+        case Instruction::CALLM:
+            if (UNLIKELY(!stack.fits(ip, regs, regs_end))) {
+                return stack_overflow();
+            }
+            interpret_callm(ip, regs, caches);
+            break;
+        case Instruction::STOREM:
+            interpret_storem(ip, regs, caches);
+            break;
+        case Instruction::CALLN:
+            interpret_calln(ip, regs, natives);
+            break;
+        case Instruction::LAZY:
+            interpret_lazy(ip, regs, compiler, consts);
+            break;
         case Instruction::RETR:
             interpret_retr(ip, regs);
             break;
@@ -567,4 +1747,357 @@ int interpret(const std::vector<Instruction>& bytecode,
     UNREACHABLE();
 }
 
-#endif // INTERPRETER_REPLICATE_SWITCH
+}
+
+int interpret(const std::vector<Instruction>& bytecode,
+        const std::vector<std::int64_t>& constants,
+        const NativeFunctions& natives, LazyCompiler* compiler) {
+    CallStack stack;
+#if defined(INTERPRETER_REPLICATE_SWITCH)
+    return interpret_replicate(bytecode.data(), constants.data(), natives,
+            compiler, stack);
+#else
+    NullProfiler profiler;
+    return interpret_switch(bytecode.data(), constants.data(), natives,
+            compiler, profiler, stack);
+#endif
+}
+
+int interpret(const Instruction* bytecode, const std::int64_t* constants,
+        const NativeFunctions& natives, const std::uint16_t* frame_sizes) {
+    CallStack stack(bytecode, frame_sizes);
+#if defined(INTERPRETER_REPLICATE_SWITCH)
+    return interpret_replicate(bytecode, constants, natives, nullptr, stack);
+#else
+    NullProfiler profiler;
+    return interpret_switch(bytecode, constants, natives, nullptr, profiler,
+            stack);
+#endif
+}
+
+int interpret(const std::vector<Instruction>& bytecode,
+        const std::vector<std::int64_t>& constants,
+        const NativeFunctions& natives, ExecutionCounts* counts) {
+    counts->executed_.assign(bytecode.size(), 0);
+    counts->taken_.assign(bytecode.size(), 0);
+    CountingProfiler profiler(bytecode.data(), counts);
+    CallStack stack;
+    return interpret_switch(bytecode.data(), constants.data(), natives,
+            nullptr, profiler, stack);
+}
+
+// The evaluation doesn't depend on the stack size of the embedder.
+Evaluator::Evaluator()
+    : registers_(std::max(INTERPRETER_STACK_SIZE / sizeof(std::int64_t),
+                2 * MAX_FRAME_SIZE)) {}
+
+std::experimental::optional<std::int64_t> Evaluator::evaluate(
+        const std::vector<Instruction>& bytecode,
+        const std::vector<std::int64_t>& constants, std::size_t pos,
+        const std::int64_t* args, std::size_t num_args, std::size_t* fuel) {
+    std::int64_t* registers = registers_.data();
+    const std::int64_t* regs_end =
+        registers + registers_.size() - MAX_FRAME_SIZE;
+    // The evaluated function returns to this call instruction.
+    const auto call = Instruction::make_abc(Instruction::CALL, 0, num_args, 0);
+    registers[0] = reinterpret_cast<std::int64_t>(&call);
+    std::int64_t* regs = registers + 1;
+    std::copy(args, args + num_args, regs);
+    // The results of completed calls are reused, so recursive functions are
+    // evaluated like memoized ones.
+    std::vector<std::int64_t> key(args, args + num_args);
+    key.push_back(pos);
+    auto result = results_.find(key);
+    if (result != results_.end()) {
+        return result->second;
+    }
+    pending_.clear();
+    const auto* ip = bytecode.data() + pos;
+    const std::int64_t* consts = constants.data();
+    while (ip != &call + 1) {
+        if (UNLIKELY(*fuel == 0)) {
+            return std::experimental::nullopt;
+        }
+        --*fuel;
+        switch (ip->opcode()) {
+        // Const instruction.
+        case Instruction::CONST:
+            interpret_const(ip, consts, regs);
+            break;
+        // Commutative binary instructions.
+        case Instruction::ADDRR:
+            interpret_addrr(ip, regs);
+            break;
+        case Instruction::MULRR:
+            interpret_mulrr(ip, regs);
+            break;
+        case Instruction::EQRR:
+            interpret_eqrr(ip, regs);
+            break;
+        case Instruction::NERR:
+            interpret_nerr(ip, regs);
+            break;
+        case Instruction::ANDRR:
+            interpret_andrr(ip, regs);
+            break;
+        case Instruction::ORRR:
+            interpret_orrr(ip, regs);
+            break;
+        case Instruction::XORRR:
+            interpret_xorrr(ip, regs);
+            break;
+        case Instruction::ADDRI:
+            interpret_addri(ip, regs);
+            break;
+        case Instruction::MULRI:
+            interpret_mulri(ip, regs);
+            break;
+        case Instruction::EQRI:
+            interpret_eqri(ip, regs);
+            break;
+        case Instruction::NERI:
+            interpret_neri(ip, regs);
+            break;
+        case Instruction::ANDRI:
+            interpret_andri(ip, regs);
+            break;
+        case Instruction::ORRI:
+            interpret_orri(ip, regs);
+            break;
+        case Instruction::XORRI:
+            interpret_xorri(ip, regs);
+            break;
+        // Noncommutative binary instructions.
+        case Instruction::SUBRR:
+            interpret_subrr(ip, regs);
+            break;
+        case Instruction::DIVRR:
+        case Instruction::MODRR:
+            if (UNLIKELY(!is_valid_division(regs[ip->b()], regs[ip->c()]))) {
+                return std::experimental::nullopt;
+            }
+            if (ip->opcode() == Instruction::DIVRR) {
+                interpret_divrr(ip, regs);
+            } else {
+                interpret_modrr(ip, regs);
+            }
+            break;
+        case Instruction::LTRR:
+            interpret_ltrr(ip, regs);
+            break;
+        case Instruction::LERR:
+            interpret_lerr(ip, regs);
+            break;
+        case Instruction::SHLRR:
+            interpret_shlrr(ip, regs);
+            break;
+        case Instruction::SARRR:
+            interpret_sarrr(ip, regs);
+            break;
+        case Instruction::SHRRR:
+            interpret_shrrr(ip, regs);
+            break;
+        case Instruction::SUBRI:
+            interpret_subri(ip, regs);
+            break;
+        case Instruction::DIVRI:
+        case Instruction::MODRI:
+            if (UNLIKELY(!is_valid_division(regs[ip->b()],
+                            static_cast<std::int8_t>(ip->c())))) {
+                return std::experimental::nullopt;
+            }
+            if (ip->opcode() == Instruction::DIVRI) {
+                interpret_divri(ip, regs);
+            } else {
+                interpret_modri(ip, regs);
+            }
+            break;
+        case Instruction::LTRI:
+            interpret_ltri(ip, regs);
+            break;
+        case Instruction::LERI:
+            interpret_leri(ip, regs);
+            break;
+        case Instruction::SHLRI:
+            interpret_shlri(ip, regs);
+            break;
+        case Instruction::SARRI:
+            interpret_sarri(ip, regs);
+            break;
+        case Instruction::SHRRI:
+            interpret_shrri(ip, regs);
+            break;
+        case Instruction::SUBIR:
+            interpret_subir(ip, regs);
+            break;
+        case Instruction::DIVIR:
+        case Instruction::MODIR:
+            if (UNLIKELY(!is_valid_division(static_cast<std::int8_t>(ip->b()),
+                            regs[ip->c()]))) {
+                return std::experimental::nullopt;
+            }
+            if (ip->opcode() == Instruction::DIVIR) {
+                interpret_divir(ip, regs);
+            } else {
+                interpret_modir(ip, regs);
+            }
+            break;
+        case Instruction::LTIR:
+            interpret_ltir(ip, regs);
+            break;
+        case Instruction::LEIR:
+            interpret_leir(ip, regs);
+            break;
+        case Instruction::SHLIR:
+            interpret_shlir(ip, regs);
+            break;
+        case Instruction::SARIR:
+            interpret_sarir(ip, regs);
+            break;
+        case Instruction::SHRIR:
+            interpret_shrir(ip, regs);
+            break;
+        // Division by constant instructions.
+        case Instruction::DIVMAGIC:
+            interpret_divmagic(ip, consts, regs);
+            break;
+        case Instruction::MODMAGIC:
+            interpret_modmagic(ip, consts, regs);
+            break;
+        case Instruction::DIVPOW2:
+            interpret_divpow2(ip, regs);
+            break;
+        case Instruction::MODPOW2:
+            interpret_modpow2(ip, regs);
+            break;
+        // Unary instructions.
+        case Instruction::NEG:
+            interpret_neg(ip, regs);
+            break;
+        case Instruction::NOT:
+            interpret_not(ip, regs);
+            break;
+        case Instruction::BNOT:
+            interpret_bnot(ip, regs);
+            break;
+        case Instruction::TRI:
+            interpret_tri(ip, regs);
+            break;
+        // Builtin function instructions.
+        case Instruction::ABS:
+            interpret_abs(ip, regs);
+            break;
+        case Instruction::POPCOUNT:
+            interpret_popcount(ip, regs);
+            break;
+        case Instruction::CLZ:
+            interpret_clz(ip, regs);
+            break;
+        case Instruction::CTZ:
+            interpret_ctz(ip, regs);
+            break;
+        case Instruction::ISQRT:
+            interpret_isqrt(ip, regs);
+            break;
+        case Instruction::MIN:
+            interpret_min(ip, regs);
+            break;
+        case Instruction::MAX:
+            interpret_max(ip, regs);
+            break;
+        case Instruction::GCD:
+            interpret_gcd(ip, regs);
+            break;
+        case Instruction::IPOW:
+            interpret_ipow(ip, regs);
+            break;
+        case Instruction::MULHI:
+            interpret_mulhi(ip, regs);
+            break;
+        // Move instructions.
+        case Instruction::MOVI:
+            interpret_movi(ip, regs);
+            break;
+        case Instruction::MOVR:
+            interpret_movr(ip, regs);
+            break;
+        // Jump instructions.
+        case Instruction::JMP:
+            interpret_jmp(ip);
+            break;
+        case Instruction::JT:
+            interpret_jt(ip, regs);
+            break;
+        case Instruction::JF:
+            interpret_jf(ip, regs);
+            break;
+        case Instruction::JTAB:
+            interpret_jtab(ip, regs);
+            interpret_jmp(ip);
+            break;
+        case Instruction::FORPREP:
+            interpret_forprep(ip, regs);
+            break;
+        case Instruction::FORLOOP:
+            interpret_forloop(ip, regs);
+            break;
+        // Call/ret instructions.
+        // Memoized calls are evaluated as regular ones.
+        case Instruction::CALL:
+        case Instruction::CALLM: {
+            std::int64_t* frame = regs + ip->a() + 1;
+            if (UNLIKELY(frame > regs_end)) {
+                return std::experimental::nullopt;
+            }
+            std::vector<std::int64_t> key(frame, frame + ip->b());
+            key.push_back(ip + regs[ip->a()] + 1 - bytecode.data());
+            auto result = results_.find(key);
+            if (result != results_.end()) {
+                regs[ip->a()] = result->second;
+                ++ip;
+                break;
+            }
+            pending_.push_back(std::move(key));
+            interpret_call(ip, regs);
+            break;
+        }
+        case Instruction::STOREM:
+            ++ip;
+            break;
+        case Instruction::RETR:
+        case Instruction::RETI: {
+            std::int64_t result = ip->opcode() == Instruction::RETR ?
+                regs[ip->a()] : ip->d();
+            if (pending_.empty()) {
+                results_.emplace(key, result);
+            } else {
+                results_.emplace(std::move(pending_.back()), result);
+                pending_.pop_back();
+            }
+            if (ip->opcode() == Instruction::RETR) {
+                interpret_retr(ip, regs);
+            } else {
+                interpret_reti(ip, regs);
+            }
+            break;
+        }
+        // System instructions.
+        // Native functions may have side effects, the arrays are allocated
+        // from the arena of the run.
+        case Instruction::ANEW:
+        case Instruction::ALOAD:
+        case Instruction::ALOADU:
+        case Instruction::ASTORE:
+        case Instruction::ASTOREU:
+        case Instruction::CALLN:
+        case Instruction::LAZY:
+        case Instruction::EXIT:
+        case Instruction::IN:
+        case Instruction::OUT:
+            return std::experimental::nullopt;
+        default:
+            UNREACHABLE();
+        }
+    }
+    return registers[0];
+}
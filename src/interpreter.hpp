@@ -1,12 +1,94 @@
 #ifndef INTERPRETER_HPP
 #define INTERPRETER_HPP
 
+#include <cstddef>
 #include <cstdint>
+#include <experimental/optional>
+#include <map>
 #include <vector>
 #include "instruction.hpp"
+#include "native.hpp"
+
+// The maximal number of arguments of a function called by CALLM.
+#if !defined(INTERPRETER_MEMO_MAX_ARGS)
+#   define INTERPRETER_MEMO_MAX_ARGS 4
+#endif
+
+// The default size of the stack of the registers in bytes.
+#if !defined(INTERPRETER_STACK_SIZE)
+#   define INTERPRETER_STACK_SIZE (1024 * 1024)
+#endif
+
+// The default size of the arena of the arrays in bytes, it's only reserved.
+#if !defined(INTERPRETER_ARENA_SIZE)
+#   define INTERPRETER_ARENA_SIZE (std::size_t(1) << 30)
+#endif
+
+// Compiles functions on their first call, LAZY stubs call it.
+class LazyCompiler {
+public:
+    // Compiles the function of the stub, unless it already is, and patches
+    // the call instruction to call the compiled function directly. Returns
+    // the first instruction of the function and stores the constants, which
+    // may be moved, to 'constants'.
+    virtual const Instruction* compile(const Instruction* stub,
+            const Instruction* call, const std::int64_t** constants) = 0;
+
+protected:
+    ~LazyCompiler() = default;
+};
 
 // Interprets the bytecode, returns the exit code of the interpreted program.
+// CALLN calls the native functions, LAZY the compiler. The frame sizes of the
+// unverified bytecode are unknown, so calls fail with a stack overflow unless
+// the largest frame fits.
+int interpret(const std::vector<Instruction>& bytecode,
+        const std::vector<std::int64_t>& constants,
+        const NativeFunctions& natives, LazyCompiler* compiler = nullptr);
+
+// Interprets the verified bytecode like above, but in place, e.g. in a mapped
+// image. The frame sizes are computed by the verifier and checked at calls.
+int interpret(const Instruction* bytecode, const std::int64_t* constants,
+        const NativeFunctions& natives, const std::uint16_t* frame_sizes);
+
+// Numbers of executed instructions and taken jumps, indexed by positions in
+// the bytecode.
+struct ExecutionCounts final {
+    std::vector<std::uint64_t> executed_;
+    std::vector<std::uint64_t> taken_;
+};
+
+// Interprets the bytecode like above, but also counts the executions.
 int interpret(const std::vector<Instruction>& bytecode,
-        const std::vector<std::int64_t>& constants);
+        const std::vector<std::int64_t>& constants,
+        const NativeFunctions& natives, ExecutionCounts* counts);
+
+// Evaluates functions at compile time. The registers are allocated once and
+// reused by all evaluations, so are the results of the completed calls. The
+// bytecode must not change between the evaluations, except for calls
+// replaced by their results.
+class Evaluator final {
+public:
+    Evaluator();
+
+    // Evaluates the function at the given position in the bytecode with the
+    // given arguments, returns its result. At most 'fuel' instructions are
+    // executed and the executed ones are subtracted from it. Returns nullopt
+    // if the function runs out of fuel or memory, executes IN, OUT, EXIT,
+    // CALLN, LAZY or an array instruction, or divides by zero. The evaluation
+    // stops at the first such instruction.
+    std::experimental::optional<std::int64_t> evaluate(
+            const std::vector<Instruction>& bytecode,
+            const std::vector<std::int64_t>& constants, std::size_t pos,
+            const std::int64_t* args, std::size_t num_args, std::size_t* fuel);
+
+private:
+    std::vector<std::int64_t> registers_;
+    // Results of the completed calls by their arguments followed by the
+    // position of the function.
+    std::map<std::vector<std::int64_t>, std::int64_t> results_;
+    // Keys of the calls being evaluated, the innermost last.
+    std::vector<std::vector<std::int64_t>> pending_;
+};
 
 #endif // !INTERPRETER_HPP
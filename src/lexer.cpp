@@ -1,33 +1,281 @@
 #include "lexer.hpp"
-#include <cctype>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <experimental/string_view>
 #include "cxx_extensions.hpp"
 
-Lexer::Lexer(const char* source)
-    : next_symbol_id_(NUM_TOKENS + 1), current_line_number_(1),
-        current_(source + 1), last_(*source) {
-    // Insert keywords.
-    symbols_.emplace("else", ELSE);
-    symbols_.emplace("fn", FN);
-    symbols_.emplace("if", IF);
-    symbols_.emplace("in", IN);
-    symbols_.emplace("let", LET);
-    symbols_.emplace("out", OUT);
-    symbols_.emplace("return", RETURN);
-    symbols_.emplace("while", WHILE);
+// The initial number of slots of the identifier table, must be a power of two.
+#if !defined(LEXER_SYMBOL_TABLE_SIZE)
+#   define LEXER_SYMBOL_TABLE_SIZE 1024
+#endif
+
+// Whether to classify the characters of identifiers and whitespaces by SSE2
+// instructions, 16 at once.
+#if !defined(LEXER_SIMD)
+#   if defined(__SSE2__)
+#       define LEXER_SIMD 1
+#   else
+#       define LEXER_SIMD 0
+#   endif
+#endif
+
+#if LEXER_SIMD
+#   include <emmintrin.h>
+#endif
+
+namespace {
+
+// Classes of characters, independent of the locale.
+enum CharClass : std::uint8_t {
+    IDENTIFIER_START = 1 << 0,
+    IDENTIFIER_PART  = 1 << 1,
+    DIGIT            = 1 << 2,
+    WHITESPACE       = 1 << 3,
+};
+
+struct CharClassTable final {
+    std::uint8_t classes_[256];
+};
+
+constexpr CharClassTable make_char_class_table() {
+    CharClassTable table{};
+    for (int c = 0; c < 256; ++c) {
+        bool letter = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+            c == '_';
+        bool digit = c >= '0' && c <= '9';
+        bool whitespace = c == ' ' || (c >= '\t' && c <= '\r');
+        table.classes_[c] = (letter ? IDENTIFIER_START : 0) |
+            (letter || digit ? IDENTIFIER_PART : 0) | (digit ? DIGIT : 0) |
+            (whitespace ? WHITESPACE : 0);
+    }
+    return table;
+}
+
+constexpr CharClassTable char_classes = make_char_class_table();
+
+ALWAYS_INLINE
+bool has_class(char c, CharClass char_class) {
+    return (char_classes.classes_[static_cast<unsigned char>(c)] &
+            char_class) != 0;
+}
+
+// Most identifiers and runs of whitespaces are short, so their first
+// characters are classified one by one.
+const std::size_t SCALAR_PREFIX_SIZE = 8;
+
+#if LEXER_SIMD
+
+// Blocks are loaded aligned, so they never cross a page boundary and may be
+// read past the NUL sentinel.
+const std::size_t BLOCK_SIZE = sizeof(__m128i);
+
+ALWAYS_INLINE
+__m128i load_block(const char* block) {
+    return _mm_load_si128(reinterpret_cast<const __m128i*>(block));
+}
+
+// Checks c - first < size as unsigned bytes, SSE2 compares only signed ones.
+ALWAYS_INLINE
+__m128i in_range(__m128i chars, char first, int size) {
+    auto shifted = _mm_add_epi8(chars, _mm_set1_epi8(-128 - first));
+    return _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + size));
+}
+
+// Gets the mask of the characters of the block not continuing identifiers.
+ALWAYS_INLINE
+unsigned non_identifier_mask(const char* block) {
+    auto chars = load_block(block);
+    auto lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    auto identifier = _mm_or_si128(
+            _mm_or_si128(in_range(lower, 'a', 26), in_range(chars, '0', 10)),
+            _mm_cmpeq_epi8(chars, _mm_set1_epi8('_')));
+    return ~_mm_movemask_epi8(identifier) & 0xffff;
+}
+
+// Gets the masks of the non-whitespaces and the newlines of the block.
+ALWAYS_INLINE
+unsigned non_whitespace_mask(const char* block, unsigned* newlines) {
+    auto chars = load_block(block);
+    auto whitespace = _mm_or_si128(in_range(chars, '\t', 5),
+            _mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')));
+    *newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chars,
+                _mm_set1_epi8('\n')));
+    return ~_mm_movemask_epi8(whitespace) & 0xffff;
+}
+
+#endif // LEXER_SIMD
+
+// Finds the first character not continuing an identifier.
+const char* skip_identifier(const char* p) {
+    for (std::size_t i = 0; i < SCALAR_PREFIX_SIZE; ++i, ++p) {
+        if (!has_class(*p, IDENTIFIER_PART)) {
+            return p;
+        }
+    }
+#if LEXER_SIMD
+    std::size_t offset = reinterpret_cast<std::uintptr_t>(p) % BLOCK_SIZE;
+    const char* block = p - offset;
+    unsigned mask = non_identifier_mask(block) >> offset << offset;
+    while (mask == 0) {
+        block += BLOCK_SIZE;
+        mask = non_identifier_mask(block);
+    }
+    return block + __builtin_ctz(mask);
+#else
+    while (has_class(*p, IDENTIFIER_PART)) {
+        ++p;
+    }
+    return p;
+#endif
 }
 
+// Finds the first non-whitespace, adds the skipped newlines to the counter.
+const char* skip_whitespaces(const char* p, std::size_t* line_number) {
+    for (std::size_t i = 0; i < SCALAR_PREFIX_SIZE; ++i, ++p) {
+        if (!has_class(*p, WHITESPACE)) {
+            return p;
+        }
+        *line_number += *p == '\n';
+    }
+#if LEXER_SIMD
+    std::size_t offset = reinterpret_cast<std::uintptr_t>(p) % BLOCK_SIZE;
+    const char* block = p - offset;
+    unsigned newlines;
+    unsigned mask = non_whitespace_mask(block, &newlines) >> offset << offset;
+    newlines = newlines >> offset << offset;
+    while (mask == 0) {
+        *line_number += __builtin_popcount(newlines);
+        block += BLOCK_SIZE;
+        mask = non_whitespace_mask(block, &newlines);
+    }
+    // Count only the newlines before the first non-whitespace.
+    unsigned end = __builtin_ctz(mask);
+    *line_number += __builtin_popcount(newlines & ((1u << end) - 1));
+    return block + end;
+#else
+    while (has_class(*p, WHITESPACE)) {
+        *line_number += *p == '\n';
+        ++p;
+    }
+    return p;
+#endif
+}
+
+// A keyword, recognized by a perfect hash.
+struct Keyword final {
+    const char* name_;
+    std::size_t length_;
+    int token_;
+};
+
+template <std::size_t N>
+constexpr Keyword make_keyword(const char (&name)[N], int token) {
+    return Keyword{name, N - 1, token};
+}
+
+constexpr Keyword keywords[] = {
+    make_keyword("_", Lexer::WILDCARD),
+    make_keyword("else", Lexer::ELSE),
+    make_keyword("export", Lexer::EXPORT),
+    make_keyword("fn", Lexer::FN),
+    make_keyword("for", Lexer::FOR),
+    make_keyword("if", Lexer::IF),
+    make_keyword("import", Lexer::IMPORT),
+    make_keyword("in", Lexer::IN),
+    make_keyword("let", Lexer::LET),
+    make_keyword("match", Lexer::MATCH),
+    make_keyword("memo", Lexer::MEMO),
+    make_keyword("out", Lexer::OUT),
+    make_keyword("return", Lexer::RETURN),
+    make_keyword("step", Lexer::STEP),
+    make_keyword("while", Lexer::WHILE),
+};
+
+constexpr std::size_t NUM_KEYWORDS = sizeof(keywords) / sizeof(*keywords);
+
+constexpr std::size_t KEYWORD_TABLE_SIZE = 32;
+
+// Hashes the first and the last character and the length, the weights are
+// chosen so that no keywords collide.
+constexpr std::size_t keyword_hash(const char* name, std::size_t length) {
+    return (3 * static_cast<unsigned char>(name[0]) +
+            static_cast<unsigned char>(name[length - 1]) + length) %
+        KEYWORD_TABLE_SIZE;
+}
+
+// Indices of the keywords plus one by their hashes, 0 for empty slots.
+struct KeywordTable final {
+    std::uint8_t slots_[KEYWORD_TABLE_SIZE];
+    bool perfect_;
+};
+
+constexpr KeywordTable make_keyword_table() {
+    KeywordTable table{};
+    table.perfect_ = true;
+    for (std::size_t i = 0; i < NUM_KEYWORDS; ++i) {
+        auto& slot = table.slots_[keyword_hash(keywords[i].name_,
+                keywords[i].length_)];
+        table.perfect_ = table.perfect_ && slot == 0;
+        slot = i + 1;
+    }
+    return table;
+}
+
+constexpr KeywordTable keyword_table = make_keyword_table();
+static_assert(keyword_table.perfect_, "keywords collide in the hash");
+
+// Finds the keyword, returns nullptr if the name isn't one.
+ALWAYS_INLINE
+const Keyword* find_keyword(std::experimental::string_view name) {
+    if (name.empty()) {
+        return nullptr;
+    }
+    std::size_t slot = keyword_table.slots_[keyword_hash(name.data(),
+            name.size())];
+    if (slot == 0) {
+        return nullptr;
+    }
+    const Keyword* keyword = &keywords[slot - 1];
+    if (keyword->length_ != name.size() ||
+            std::memcmp(keyword->name_, name.data(), name.size()) != 0) {
+        return nullptr;
+    }
+    return keyword;
+}
+
+// Hashes the identifier by FNV-1a.
+ALWAYS_INLINE
+std::size_t symbol_hash(std::experimental::string_view name) {
+    std::uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (char c : name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) *
+            UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+}
+
+Lexer::Lexer(const char* source, std::size_t line_number)
+    : slots_(LEXER_SYMBOL_TABLE_SIZE), current_line_number_(line_number),
+        current_(source + 1), last_(*source) {}
+
 void Lexer::consume_token() {
     int if_single;
     int if_double;
     for (;;) {
-        if (std::isalpha(last_) || last_ == '_') {
+        if (has_class(last_, WHITESPACE)) {
+            current_ = skip_whitespaces(current_ - 1, &current_line_number_);
+            last_ = *current_++;
+            continue;
+        }
+        if (has_class(last_, IDENTIFIER_START)) {
             const char* lexeme = current_ - 1;
-            do {
-                last_ = *current_++;
-            } while (std::isalnum(last_) || last_ == '_');
+            current_ = skip_identifier(current_);
+            last_ = *current_++;
             const std::experimental::string_view symbol_name(lexeme,
                     current_ - lexeme - 1);
             std::size_t symbol_id = find_or_insert_symbol(symbol_name);
@@ -39,7 +287,7 @@ void Lexer::consume_token() {
             token_ = IDENTIFIER;
             return;
         }
-        if (std::isdigit(last_)) {
+        if (has_class(last_, DIGIT)) {
             char* end;
             token_attribute_.i64 = std::strtoll(current_ - 1, &end, 0);
             current_ = end;
@@ -48,30 +296,90 @@ void Lexer::consume_token() {
             return;
         }
         switch (last_) {
-        // Skip whitespaces.
-        case '\n':
-            ++current_line_number_;
-            // fallthrough
-        case '\t':
-        case '\v':
-        case '\f':
-        case '\r':
-        case ' ':
+        case '"': {
+            const char* lexeme = current_;
+            while (*current_ != '"' && *current_ != '\n' &&
+                    *current_ != '\0') {
+                ++current_;
+            }
+            if (UNLIKELY(*current_ != '"')) {
+                std::fprintf(stderr, "Error in line %zu: unterminated string "
+                        "literal\n", current_line_number_);
+                std::exit(EXIT_FAILURE);
+            }
+            token_attribute_.sz = find_or_insert_symbol(
+                    std::experimental::string_view(lexeme,
+                        current_ - lexeme));
+            ++current_;
             last_ = *current_++;
-            continue;
+            token_ = STRING_LITERAL;
+            return;
+        }
         case '=':
+            if (*current_ == '>') {
+                ++current_;
+                last_ = *current_++;
+                token_ = ARROW;
+                return;
+            }
             if_single = '=';
             if_double = EQ;
             goto relational_operators;
+        case '&':
+            if (*current_ == '&') {
+                ++current_;
+                last_ = *current_++;
+                token_ = AND;
+                return;
+            }
+            token_ = last_;
+            last_ = *current_++;
+            return;
+        case '|':
+            if (*current_ == '|') {
+                ++current_;
+                last_ = *current_++;
+                token_ = OR;
+                return;
+            }
+            token_ = last_;
+            last_ = *current_++;
+            return;
+        case '.':
+            if (*current_ == '.') {
+                ++current_;
+                last_ = *current_++;
+                token_ = RANGE;
+                return;
+            }
+            token_ = last_;
+            last_ = *current_++;
+            return;
         case '!':
             if_single = '!';
             if_double = NE;
             goto relational_operators;
         case '<':
+            if (*current_ == '<') {
+                ++current_;
+                last_ = *current_++;
+                token_ = SHL;
+                return;
+            }
             if_single = '<';
             if_double = LE;
             goto relational_operators;
         case '>':
+            if (*current_ == '>') {
+                ++current_;
+                last_ = *current_++;
+                token_ = SAR;
+                if (last_ == '>') {
+                    last_ = *current_++;
+                    token_ = SHR;
+                }
+                return;
+            }
             if_single = '>';
             if_double = GE;
             goto relational_operators;
@@ -107,14 +415,100 @@ void Lexer::check_and_consume_token(int token) {
     consume_token();
 }
 
+void Lexer::reset(const char* source) {
+    current_line_number_ = 1;
+    current_ = source + 1;
+    last_ = *source;
+}
+
+void Lexer::skip_block() {
+    if (UNLIKELY(token_ != '{')) {
+        // Report the error.
+        check_and_consume_token('{');
+    }
+    std::size_t depth = 1;
+    const char* current = current_ - 1;
+    for (; *current != '\0'; ++current) {
+        if (*current == '\n') {
+            ++current_line_number_;
+        } else if (*current == '{') {
+            ++depth;
+        } else if (*current == '}' && --depth == 0) {
+            break;
+        }
+    }
+    // Lex the '}', or the end of the source if it's missing.
+    current_ = current + 1;
+    last_ = *current;
+    consume_token();
+    check_and_consume_token('}');
+}
+
 std::size_t Lexer::find_or_insert_symbol(
         std::experimental::string_view symbol_name) {
-    auto it = symbols_.find(symbol_name);
-    if (it != symbols_.end()) {
-        return it->second;
+    if (const Keyword* keyword = find_keyword(symbol_name)) {
+        return keyword->token_;
+    }
+    std::size_t hash = symbol_hash(symbol_name);
+    std::size_t mask = slots_.size() - 1;
+    for (std::size_t i = hash & mask; slots_[i].symbol_id_ != 0;
+            i = (i + 1) & mask) {
+        const auto& slot = slots_[i];
+        if (slot.hash_ == hash &&
+                symbol_names_[slot.symbol_id_ - FIRST_SYMBOL_ID] ==
+                symbol_name) {
+            return slot.symbol_id_;
+        }
     }
-    symbols_.emplace(symbol_name, next_symbol_id_);
-    return next_symbol_id_++;
+    std::size_t symbol_id = FIRST_SYMBOL_ID + symbol_names_.size();
+    symbol_names_.push_back(symbol_name);
+    if (2 * symbol_names_.size() > slots_.size()) {
+        std::vector<Lexer::Slot> slots(2 * slots_.size());
+        slots.swap(slots_);
+        for (const auto& slot : slots) {
+            if (slot.symbol_id_ != 0) {
+                insert_slot(slot.hash_, slot.symbol_id_);
+            }
+        }
+    }
+    insert_slot(hash, symbol_id);
+    return symbol_id;
+}
+
+std::size_t Lexer::num_symbols() const {
+    return symbol_names_.size();
+}
+
+const char* Lexer::position() const {
+    return current_ - 1;
+}
+
+void Lexer::insert_slot(std::size_t hash, std::size_t symbol_id) {
+    std::size_t mask = slots_.size() - 1;
+    std::size_t i = hash & mask;
+    while (slots_[i].symbol_id_ != 0) {
+        i = (i + 1) & mask;
+    }
+    slots_[i].hash_ = hash;
+    slots_[i].symbol_id_ = symbol_id;
+}
+
+Lexer::Checkpoint Lexer::checkpoint() const {
+    Lexer::Checkpoint checkpoint;
+    checkpoint.current_ = current_;
+    checkpoint.current_line_number_ = current_line_number_;
+    checkpoint.token_attribute_ = token_attribute_;
+    checkpoint.token_ = token_;
+    checkpoint.last_ = last_;
+    return checkpoint;
+}
+
+void Lexer::restore(const Lexer::Checkpoint& checkpoint) {
+    current_ = checkpoint.current_;
+    current_line_number_ = checkpoint.current_line_number_;
+    token_attribute_ = checkpoint.token_attribute_;
+    token_ = checkpoint.token_;
+    last_ = checkpoint.last_;
 }
 
 std::size_t Lexer::current_line_number() const {
@@ -129,27 +523,48 @@ int Lexer::token() const {
     return token_;
 }
 
-void Lexer::print_symbol_name(std::size_t symbol_id, std::FILE* file) const {
-    for (const auto& symbol : symbols_) {
-        if (symbol.second == symbol_id) {
-            std::fwrite(symbol.first.data(), 1, symbol.first.size(), file);
-            return;
+std::experimental::string_view Lexer::symbol_name(std::size_t symbol_id) const {
+    if (symbol_id >= FIRST_SYMBOL_ID &&
+            symbol_id - FIRST_SYMBOL_ID < symbol_names_.size()) {
+        return symbol_names_[symbol_id - FIRST_SYMBOL_ID];
+    }
+    for (const auto& keyword : keywords) {
+        if (static_cast<std::size_t>(keyword.token_) == symbol_id) {
+            return std::experimental::string_view(keyword.name_,
+                    keyword.length_);
         }
     }
-    std::fputs("<unknown>", file);
+    return "<unknown>";
+}
+
+void Lexer::print_symbol_name(std::size_t symbol_id, std::FILE* file) const {
+    auto name = symbol_name(symbol_id);
+    std::fwrite(name.data(), 1, name.size(), file);
 }
 
 void Lexer::print_token_name(int token, std::FILE* file) {
     switch (token) {
+    case AND:
+        std::fputs("&&", file);
+        break;
+    case ARROW:
+        std::fputs("=>", file);
+        break;
     case ELSE:
         std::fputs("else", file);
         break;
     case EQ:
         std::fputs("==", file);
         break;
+    case EXPORT:
+        std::fputs("export", file);
+        break;
     case FN:
         std::fputs("fn", file);
         break;
+    case FOR:
+        std::fputs("for", file);
+        break;
     case GE:
         std::fputs(">=", file);
         break;
@@ -159,6 +574,9 @@ void Lexer::print_token_name(int token, std::FILE* file) {
     case IF:
         std::fputs("if", file);
         break;
+    case IMPORT:
+        std::fputs("import", file);
+        break;
     case IN:
         std::fputs("in", file);
         break;
@@ -171,18 +589,48 @@ void Lexer::print_token_name(int token, std::FILE* file) {
     case LET:
         std::fputs("let", file);
         break;
+    case MATCH:
+        std::fputs("match", file);
+        break;
+    case MEMO:
+        std::fputs("memo", file);
+        break;
     case NE:
         std::fputs("!=", file);
         break;
+    case OR:
+        std::fputs("||", file);
+        break;
     case OUT:
         std::fputs("out", file);
         break;
+    case RANGE:
+        std::fputs("..", file);
+        break;
     case RETURN:
         std::fputs("return", file);
         break;
+    case SAR:
+        std::fputs(">>", file);
+        break;
+    case SHL:
+        std::fputs("<<", file);
+        break;
+    case SHR:
+        std::fputs(">>>", file);
+        break;
+    case STEP:
+        std::fputs("step", file);
+        break;
+    case STRING_LITERAL:
+        std::fputs("string_literal", file);
+        break;
     case WHILE:
         std::fputs("while", file);
         break;
+    case WILDCARD:
+        std::fputs("_", file);
+        break;
     default:
         std::fputc(token, file);
         break;
@@ -4,26 +4,41 @@
 #include <cstdint>
 #include <cstdio>
 #include <experimental/string_view>
-#include <unordered_map>
+#include <vector>
 #include "cxx_extensions.hpp"
 
 class Lexer final {
 public:
     enum Token {
-        ELSE = 256,
+        AND = 256,
+        ARROW,
+        ELSE,
         EQ,
+        EXPORT,
         FN,
+        FOR,
         GE,
         IDENTIFIER,
         IF,
+        IMPORT,
         IN,
         INTEGER_LITERAL,
         LE,
         LET,
+        MATCH,
+        MEMO,
         NE,
+        OR,
         OUT,
+        RANGE,
         RETURN,
+        SAR,
+        SHL,
+        SHR,
+        STEP,
+        STRING_LITERAL,
         WHILE,
+        WILDCARD,
         NUM_TOKENS,
     };
 
@@ -32,26 +47,65 @@ public:
         std::int64_t i64;
     };
 
-    explicit Lexer(const char* source);
+    // A saved state of the lexer, the lexing can be restarted from it.
+    struct Checkpoint final {
+        const char* current_;
+        std::size_t current_line_number_;
+        TokenAttribute token_attribute_;
+        int token_;
+        char last_;
+    };
+
+    // The symbol id of the first identifier.
+    static constexpr std::size_t FIRST_SYMBOL_ID = NUM_TOKENS + 1;
+
+    // Lexes the source, which may start in the middle of a file at the line
+    // with the given number.
+    explicit Lexer(const char* source, std::size_t line_number = 1);
     Lexer(const Lexer&) = default;
     Lexer& operator=(const Lexer&) = default;
     Lexer(Lexer&&) = default;
     Lexer& operator=(Lexer&&) = default;
 
-    // Consumes the next token.
+    // Consumes the next token. String literals are interned like the
+    // identifiers, their attribute is the symbol id of their contents.
     void consume_token();
 
     // Checks the current token and consumes the next one.
     void check_and_consume_token(int token);
 
+    // Restarts the lexing at the start of another source, the symbols are
+    // kept.
+    void reset(const char* source);
+
+    // Checks the current '{' token and skips the source up to the matching
+    // '}' without lexing it, consumes the token following the '}'.
+    void skip_block();
+
     // Finds or inserts the symbol, returns the symbol id.
     std::size_t find_or_insert_symbol(
             std::experimental::string_view symbol_name);
 
+    // Gets the number of the identifiers, their symbol ids are consecutive
+    // from FIRST_SYMBOL_ID.
+    std::size_t num_symbols() const;
+
+    // Gets the position of the next character to be lexed.
+    const char* position() const;
+
+    // Saves the current state.
+    Checkpoint checkpoint() const;
+
+    // Restores the saved state.
+    void restore(const Checkpoint& checkpoint);
+
     std::size_t current_line_number() const;
     TokenAttribute token_attribute() const;
     int token() const;
 
+    // Gets the symbol name for the given symbol id.
+    std::experimental::string_view symbol_name(std::size_t symbol_id) const;
+
     // Prints the symbol name for the given symbol id. This function is used
     // only to print errors.
     COLD void print_symbol_name(std::size_t symbol_id,
@@ -61,10 +115,23 @@ public:
     COLD static void print_token_name(int token, std::FILE* file);
 
 private:
+    // A slot of the identifier table, empty if the symbol id is 0.
+    struct Slot final {
+        std::size_t hash_;
+        std::size_t symbol_id_;
+    };
+
     void next_char();
 
-    std::unordered_map<std::experimental::string_view, std::size_t> symbols_;
-    std::size_t next_symbol_id_;
+    // Stores the symbol id in the first empty slot probed for the hash.
+    void insert_slot(std::size_t hash, std::size_t symbol_id);
+
+    // Open-addressing table of the identifiers with linear probing. Its size
+    // is a power of two and at most a half of it is used, it is grown by
+    // reinserting the stored hashes.
+    std::vector<Slot> slots_;
+    // Names of the identifiers indexed by their symbol ids minus the first.
+    std::vector<std::experimental::string_view> symbol_names_;
     std::size_t current_line_number_;
     const char* current_;
     TokenAttribute token_attribute_;
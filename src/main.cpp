@@ -1,26 +1,79 @@
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <experimental/optional>
+#include <limits>
 #include <vector>
 #include <getopt.h>
+#include "config.hpp"
 #include "cxx_extensions.hpp"
+#include "embed.hpp"
+#include "image.hpp"
 #include "instruction.hpp"
 #include "interpreter.hpp"
 #include "lexer.hpp"
+#include "module.hpp"
+#include "native.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
 #include "utilities.hpp"
+#include "verifier.hpp"
 
 // Needed by the interpreter.
 int trace_flag;
+std::size_t stack_size = INTERPRETER_STACK_SIZE;
+std::size_t arena_size = INTERPRETER_ARENA_SIZE;
 
 namespace {
 
 int help_flag;
+int compile_flag;
 int dump_flag;
+int lazy_flag;
+int lex_flag;
+int memoize_flag;
+int stats_flag;
+
+const char* cache_directory;
+const char* embed_filename;
+const char* output_filename;
+const char* profile_generate_filename;
+const char* profile_use_filename;
+
+std::size_t num_jobs = 1;
+
+enum {
+    ARENA_SIZE = 256,
+    CACHE,
+    EMBED,
+    JOBS,
+    PROFILE_GENERATE,
+    PROFILE_USE,
+    STACK_SIZE,
+};
 
 const option options[] = {
-    {"help",  no_argument, &help_flag,  1},
-    {"dump",  no_argument, &dump_flag,  1},
-    {"trace", no_argument, &trace_flag, 1},
+    {"help",             no_argument,       &help_flag,    1},
+    {"arena-size",       required_argument, nullptr,       ARENA_SIZE},
+    {"cache",            required_argument, nullptr,       CACHE},
+    {"compile",          no_argument,       &compile_flag, 1},
+    {"dump",             no_argument,       &dump_flag,    1},
+    {"embed",            required_argument, nullptr,       EMBED},
+    {"jobs",             required_argument, nullptr,       JOBS},
+    {"lazy",             no_argument,       &lazy_flag,    1},
+    {"lex",              no_argument,       &lex_flag,     1},
+    {"memoize",          no_argument,       &memoize_flag, 1},
+    {"output",           required_argument, nullptr,       'o'},
+    {"profile-generate", required_argument, nullptr,       PROFILE_GENERATE},
+    {"profile-use",      required_argument, nullptr,       PROFILE_USE},
+    {"stack-size",       required_argument, nullptr,       STACK_SIZE},
+    {"stats",            no_argument,       &stats_flag,   1},
+    {"trace",            no_argument,       &trace_flag,   1},
+    {nullptr,            0,                 nullptr,       0},
 };
 
 COLD void usage(const char* program_name) {
@@ -29,19 +82,145 @@ COLD void usage(const char* program_name) {
             "\n"
             "Options:\n"
             "  --help     Print this menu\n"
+            "  --arena-size=SIZE\n"
+            "             Reserve SIZE bytes for the arrays, rounded up to a\n"
+            "             power of two, with the suffixes of --stack-size\n"
+            "  --cache=DIR\n"
+            "             Cache the compiled imported modules in DIR\n"
+            "  --compile  Only compile the file and print the compile time\n"
             "  --dump     Dump generated bytecode\n"
+            "  --embed=FILE\n"
+            "             Write the compiled program to the FILE C++ header\n"
+            "             without running it\n"
+            "  --jobs=N   Compile the functions by N worker processes, an\n"
+            "             experiment that needs a build with\n"
+            "             PARSER_WORKER_PROCESSES\n"
+            "  --lazy     Compile the functions on their first call\n"
+            "  --lex      Only tokenize the file and print the throughput\n"
+            "  --memoize  Memoize pure recursive functions\n"
+            "  -o, --output=FILE\n"
+            "             Write the compiled program to the FILE image without\n"
+            "             running it, images with the .amc extension are\n"
+            "             executed directly\n"
+            "  --profile-generate=FILE\n"
+            "             Record a profile of the execution to FILE\n"
+            "  --profile-use=FILE\n"
+            "             Optimize with the profile recorded in FILE\n"
+            "  --stack-size=SIZE\n"
+            "             Reserve SIZE bytes for the stack, the K, M and G\n"
+            "             suffixes multiply it by 1024, 1024^2 and 1024^3\n"
+            "  --stats    Print optimization statistics\n"
             "  --trace    Trace the execution (debug build only)\n",
             program_name);
 }
 
-COLD void dump(const std::vector<Instruction>& bytecode) {
-    for (std::size_t i = 0; i < bytecode.size(); ++i) {
+// Parses the size with an optional K, M or G suffix, returns false if it's
+// malformed or zero.
+bool parse_size(const char* string, std::size_t* size) {
+    if (!std::isdigit(static_cast<unsigned char>(*string))) {
+        return false;
+    }
+    char* end;
+    unsigned long long value = std::strtoull(string, &end, 10);
+    unsigned shift = 0;
+    switch (*end) {
+    case 'K':
+        shift = 10;
+        ++end;
+        break;
+    case 'M':
+        shift = 20;
+        ++end;
+        break;
+    case 'G':
+        shift = 30;
+        ++end;
+        break;
+    }
+    if (*end != '\0' || value == 0 ||
+            value > (std::numeric_limits<std::size_t>::max() >> shift)) {
+        return false;
+    }
+    *size = static_cast<std::size_t>(value) << shift;
+    return true;
+}
+
+COLD void dump(const Instruction* bytecode, std::size_t size) {
+    for (std::size_t i = 0; i < size; ++i) {
         std::printf("%08zu ", i);
         bytecode[i].print(stdout);
         std::putchar('\n');
     }
 }
 
+COLD void lex(const SourceFile& source) {
+    auto start = std::chrono::steady_clock::now();
+    Lexer lexer(source.data());
+    std::size_t num_tokens = 0;
+    do {
+        lexer.consume_token();
+        ++num_tokens;
+    } while (lexer.token() != '\0');
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::fprintf(stderr, "%zu tokens, %zu lines, %zu bytes in %.3fs, "
+            "%.1f MB/s\n", num_tokens, lexer.current_line_number(),
+            source.size(), elapsed.count(),
+            source.size() / elapsed.count() / 1e6);
+}
+
+// Checks whether the file is an image by its extension.
+bool is_image(const char* filename) {
+    std::size_t length = std::strlen(filename);
+    return length >= 4 && std::strcmp(filename + length - 4, ".amc") == 0;
+}
+
+// Verifies the bytecode, reports the error if it's invalid.
+Verification verify_or_report(const Instruction* bytecode, std::size_t size,
+        const std::int64_t* constants, std::size_t num_constants,
+        const NativeFunctions& natives) {
+    auto verification = verify(bytecode, size, constants, num_constants,
+            natives.size());
+    if (UNLIKELY(!verification.valid_)) {
+        std::fprintf(stderr, "Error: invalid bytecode at %zu: %s\n",
+                verification.error_pos_, verification.error_);
+    }
+    return verification;
+}
+
+// Verifies the bytecode and executes it.
+int run_verified(const Instruction* bytecode, std::size_t size,
+        const std::int64_t* constants, std::size_t num_constants,
+        const NativeFunctions& natives) {
+    auto verification = verify_or_report(bytecode, size, constants,
+            num_constants, natives);
+    if (UNLIKELY(!verification.valid_)) {
+        return EXIT_FAILURE;
+    }
+    return interpret(bytecode, constants, natives,
+            verification.frame_sizes_.data());
+}
+
+// Executes the image.
+int run_image(const char* filename, const NativeFunctions& natives) {
+    auto image = Image::open(filename);
+    if (UNLIKELY(!image)) {
+        std::fprintf(stderr, "Couldn't load the '%s' image\n", filename);
+        return EXIT_FAILURE;
+    }
+    if (UNLIKELY(!image->links(natives))) {
+        std::fprintf(stderr, "The native functions of the '%s' image aren't "
+                "registered\n", filename);
+        return EXIT_FAILURE;
+    }
+    if (dump_flag != 0) {
+        dump(image->bytecode(), image->bytecode_size());
+        return EXIT_SUCCESS;
+    }
+    return run_verified(image->bytecode(), image->bytecode_size(),
+            image->constants(), image->num_constants(), natives);
+}
+
 }
 
 int main(int argc, char** argv) {
@@ -49,11 +228,54 @@ int main(int argc, char** argv) {
     // Parse options.
     int opt;
     int opt_index;
-    while ((opt = getopt_long_only(argc, argv, "", options, &opt_index))
+    while ((opt = getopt_long_only(argc, argv, "o:", options, &opt_index))
             != -1) {
         switch (opt) {
         case 0:
             break;
+        case ARENA_SIZE:
+            if (!parse_size(optarg, &arena_size)) {
+                usage(program_name);
+                return EXIT_FAILURE;
+            }
+            break;
+        case CACHE:
+            cache_directory = optarg;
+            break;
+        case EMBED:
+            embed_filename = optarg;
+            break;
+        case JOBS: {
+            char* end;
+            num_jobs = std::strtoul(optarg, &end, 10);
+            if (*end != '\0' || num_jobs == 0) {
+                usage(program_name);
+                return EXIT_FAILURE;
+            }
+#if !defined(PARSER_WORKER_PROCESSES)
+            if (num_jobs > 1) {
+                std::fputs("Error: built without the worker processes\n",
+                        stderr);
+                return EXIT_FAILURE;
+            }
+#endif
+            break;
+        }
+        case 'o':
+            output_filename = optarg;
+            break;
+        case PROFILE_GENERATE:
+            profile_generate_filename = optarg;
+            break;
+        case PROFILE_USE:
+            profile_use_filename = optarg;
+            break;
+        case STACK_SIZE:
+            if (!parse_size(optarg, &stack_size)) {
+                usage(program_name);
+                return EXIT_FAILURE;
+            }
+            break;
         default:
             usage(program_name);
             return EXIT_FAILURE;
@@ -69,27 +291,140 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 #endif
+    if (profile_generate_filename != nullptr &&
+            profile_use_filename != nullptr) {
+        std::fputs("Profiles can't be generated and used at once\n", stderr);
+        return EXIT_FAILURE;
+    }
+    if (lazy_flag != 0 && (profile_generate_filename != nullptr ||
+                profile_use_filename != nullptr)) {
+        std::fputs("Profiles can't be used with the lazy compilation\n",
+                stderr);
+        return EXIT_FAILURE;
+    }
+    if (lazy_flag != 0 && memoize_flag != 0) {
+        std::fputs("Functions can't be memoized with the lazy compilation\n",
+                stderr);
+        return EXIT_FAILURE;
+    }
+    if ((output_filename != nullptr || embed_filename != nullptr) &&
+            (lazy_flag != 0 || profile_generate_filename != nullptr)) {
+        std::fputs("Images and headers can't be written with the lazy "
+                "compilation or the profile generation\n", stderr);
+        return EXIT_FAILURE;
+    }
     argc -= optind;
     argv += optind;
     if (UNLIKELY(argc != 1)) {
         usage(program_name);
         return EXIT_FAILURE;
     }
-    // Open the source file.
     const char* const filename = argv[0];
-    auto content = file_contents(filename);
-    if (UNLIKELY(!content)) {
+    NativeFunctions natives;
+    if (is_image(filename)) {
+        if (UNLIKELY(compile_flag != 0 || lazy_flag != 0 || lex_flag != 0 ||
+                    output_filename != nullptr || embed_filename != nullptr ||
+                    profile_generate_filename != nullptr ||
+                    profile_use_filename != nullptr)) {
+            std::fputs("Images can only be executed or dumped\n", stderr);
+            return EXIT_FAILURE;
+        }
+        return run_image(filename, natives);
+    }
+    // Open the source file.
+    auto source = SourceFile::open(filename);
+    if (UNLIKELY(!source)) {
         std::fprintf(stderr, "Couldn't open the '%s' file\n", filename);
         return EXIT_FAILURE;
     }
+    if (lex_flag != 0) {
+        lex(*source);
+        return EXIT_SUCCESS;
+    }
+    // Read the profile.
+    std::experimental::optional<Profile> profile;
+    if (profile_use_filename != nullptr) {
+        profile = Profile::read(profile_use_filename);
+        if (UNLIKELY(!profile)) {
+            std::fprintf(stderr, "Couldn't read the '%s' profile\n",
+                    profile_use_filename);
+            return EXIT_FAILURE;
+        }
+    }
     // Parse.
-    Lexer lexer(content->c_str());
-    Parser parser(std::move(lexer));
+    Lexer lexer(source->data());
+    std::experimental::optional<ModuleCache> module_cache;
+    if (cache_directory != nullptr) {
+        module_cache.emplace(cache_directory);
+    }
+    Parser::Options parser_options;
+    parser_options.memoize_ = memoize_flag != 0;
+    parser_options.profile_generate_ = profile_generate_filename != nullptr;
+    parser_options.profile_ = profile ? &*profile : nullptr;
+    parser_options.native_functions_ = &natives;
+    parser_options.num_jobs_ = num_jobs;
+    parser_options.lazy_ = lazy_flag != 0;
+    parser_options.filename_ = filename;
+    parser_options.module_cache_ = module_cache ? &*module_cache : nullptr;
+    auto start = std::chrono::steady_clock::now();
+    Parser parser(std::move(lexer), parser_options);
     parser.parse();
+    if (compile_flag != 0) {
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::fprintf(stderr, "%zu bytes, %zu instructions in %.6fs\n",
+                source->size(), parser.bytecode().size(), elapsed.count());
+    }
+    if (output_filename != nullptr && UNLIKELY(!Image::write(output_filename,
+                    parser.bytecode(), parser.constants(), parser.functions(),
+                    natives))) {
+        std::fprintf(stderr, "Couldn't write the '%s' image\n",
+                output_filename);
+        return EXIT_FAILURE;
+    }
+    if (embed_filename != nullptr) {
+        // Embedded programs are interpreted without verifying them again.
+        auto verification = verify_or_report(parser.bytecode().data(),
+                parser.bytecode().size(), parser.constants().data(),
+                parser.constants().size(), natives);
+        if (UNLIKELY(!verification.valid_)) {
+            return EXIT_FAILURE;
+        }
+        if (UNLIKELY(!write_header(embed_filename, parser.bytecode(),
+                        parser.constants(), verification.frame_sizes_))) {
+            std::fprintf(stderr, "Couldn't write the '%s' header\n",
+                    embed_filename);
+            return EXIT_FAILURE;
+        }
+    }
+    if (stats_flag != 0) {
+        parser.print_statistics(stderr);
+    }
     if (dump_flag != 0) {
-        dump(parser.bytecode());
+        dump(parser.bytecode().data(), parser.bytecode().size());
+        return EXIT_SUCCESS;
+    }
+    if (compile_flag != 0 || output_filename != nullptr ||
+            embed_filename != nullptr) {
         return EXIT_SUCCESS;
     }
     // Execute.
-    return interpret(parser.bytecode(), parser.constants());
+    if (profile_generate_filename != nullptr) {
+        ExecutionCounts counts;
+        int exit_code = interpret(parser.bytecode(), parser.constants(),
+                natives, &counts);
+        if (UNLIKELY(!parser.make_profile(counts).write(
+                        profile_generate_filename))) {
+            std::fprintf(stderr, "Couldn't write the '%s' profile\n",
+                    profile_generate_filename);
+            return EXIT_FAILURE;
+        }
+        return exit_code;
+    }
+    if (lazy_flag != 0) {
+        return interpret(parser.bytecode(), parser.constants(), natives,
+                &parser);
+    }
+    return run_verified(parser.bytecode().data(), parser.bytecode().size(),
+            parser.constants().data(), parser.constants().size(), natives);
 }
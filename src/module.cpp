@@ -0,0 +1,200 @@
+#include "module.hpp"
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <experimental/optional>
+#include <experimental/string_view>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cxx_extensions.hpp"
+#include "instruction.hpp"
+#include "utilities.hpp"
+
+namespace {
+
+// A cached module starts with the header followed by the contents.
+struct Header final {
+    char magic_[8];
+    std::uint32_t version_;
+    std::uint32_t reserved_;
+    std::uint64_t key_;
+    std::uint64_t size_;
+    // The FNV-1a hash of the contents.
+    std::uint64_t checksum_;
+};
+
+const char magic[8] = {'a', 'm', '-', 'c', 'a', 'c', 'h', 'e'};
+
+// Bumped whenever the compilation of the modules or their layout changes.
+constexpr std::uint32_t VERSION = 4;
+
+class Hash final {
+public:
+    Hash() : hash_(UINT64_C(0xcbf29ce484222325)) {}
+
+    void add(const void* data, std::size_t size) {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        for (std::size_t i = 0; i < size; ++i) {
+            hash_ = (hash_ ^ bytes[i]) * UINT64_C(0x100000001b3);
+        }
+    }
+
+    // Adds the data by words, faster but weaker than by bytes. Meant for large
+    // data like the executable.
+    void add_words(const void* data, std::size_t size) {
+        const auto* bytes = static_cast<const char*>(data);
+        std::size_t num_words = size / sizeof(std::uint64_t);
+        for (std::size_t i = 0; i < num_words; ++i) {
+            std::uint64_t word;
+            std::memcpy(&word, bytes + i * sizeof(word), sizeof(word));
+            hash_ = (hash_ ^ word) * UINT64_C(0x100000001b3);
+        }
+        std::size_t rest = num_words * sizeof(std::uint64_t);
+        add(bytes + rest, size - rest);
+    }
+
+    // Adds the size of the string too, so that concatenations differ.
+    void add(std::experimental::string_view string) {
+        std::uint64_t size = string.size();
+        add(&size, sizeof(size));
+        add(string.data(), string.size());
+    }
+
+    std::uint64_t get() const {
+        return hash_;
+    }
+
+private:
+    std::uint64_t hash_;
+};
+
+}
+
+ModuleCache::ModuleCache(std::string directory)
+        : directory_(std::move(directory)) {
+    // Failures are reported by writing the modules.
+    ::mkdir(directory_.c_str(), 0777);
+    // Modules compiled by other builds are never linked, even if VERSION
+    // wasn't bumped.
+    if (auto executable = SourceFile::open("/proc/self/exe")) {
+        Hash hash;
+        hash.add_words(executable->data(), executable->size());
+        build_ = hash.get();
+    }
+}
+
+std::uint64_t ModuleCache::key(std::experimental::string_view path,
+        std::experimental::string_view source,
+        const NativeFunctions* natives) const {
+    Hash hash;
+    const std::uint32_t version[] = {
+        VERSION,
+        Instruction::OUT + 1,
+        static_cast<std::uint32_t>(sizeof(std::size_t)),
+    };
+    hash.add(version, sizeof(version));
+    if (build_) {
+        hash.add(&*build_, sizeof(*build_));
+    }
+    hash.add(path);
+    hash.add(source);
+    // Calls of the natives are compiled to their indices.
+    std::size_t num_natives = natives != nullptr ? natives->size() : 0;
+    for (std::size_t i = 0; i < num_natives; ++i) {
+        hash.add(natives->name(i));
+    }
+    return hash.get();
+}
+
+std::experimental::optional<std::vector<char>> ModuleCache::read(
+        std::uint64_t key) const {
+    if (!build_) {
+        return std::experimental::nullopt;
+    }
+    std::FILE* file = std::fopen(filename(key).c_str(), "rb");
+    if (file == nullptr) {
+        return std::experimental::nullopt;
+    }
+    Header header;
+    bool valid = std::fread(&header, sizeof(header), 1, file) == 1 &&
+        std::memcmp(header.magic_, magic, sizeof(magic)) == 0 &&
+        header.version_ == VERSION && header.key_ == key;
+    // Check the size before allocating the contents.
+    long size = -1;
+    if (valid && std::fseek(file, 0, SEEK_END) == 0) {
+        size = std::ftell(file);
+    }
+    valid = valid && size >= 0 &&
+        static_cast<std::uint64_t>(size) - sizeof(header) == header.size_ &&
+        std::fseek(file, sizeof(header), SEEK_SET) == 0;
+    std::vector<char> module;
+    if (valid) {
+        module.resize(header.size_);
+        valid = std::fread(module.data(), 1, module.size(), file) ==
+            module.size();
+    }
+    std::fclose(file);
+    if (valid) {
+        Hash hash;
+        hash.add(module.data(), module.size());
+        valid = hash.get() == header.checksum_;
+    }
+    if (!valid) {
+        return std::experimental::nullopt;
+    }
+    return std::experimental::optional<std::vector<char>>(std::move(module));
+}
+
+bool ModuleCache::write(std::uint64_t key,
+        const std::vector<char>& module) const {
+    if (UNLIKELY(!build_)) {
+        return false;
+    }
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic_, magic, sizeof(magic));
+    header.version_ = VERSION;
+    header.key_ = key;
+    header.size_ = module.size();
+    Hash hash;
+    hash.add(module.data(), module.size());
+    header.checksum_ = hash.get();
+    // Write a temporary file and rename it over the module.
+    std::string name = filename(key);
+    std::string temporary = name + "." + std::to_string(::getpid());
+    std::FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (UNLIKELY(file == nullptr)) {
+        return false;
+    }
+    bool success = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+        std::fwrite(module.data(), 1, module.size(), file) == module.size();
+    success = std::fclose(file) == 0 && success &&
+        std::rename(temporary.c_str(), name.c_str()) == 0;
+    if (UNLIKELY(!success)) {
+        std::remove(temporary.c_str());
+    }
+    return success;
+}
+
+std::string ModuleCache::filename(std::uint64_t key) const {
+    char name[sizeof("/0123456789abcdef.amm")];
+    std::snprintf(name, sizeof(name), "/%016" PRIx64 ".amm", key);
+    return directory_ + name;
+}
+
+std::string resolve_import(std::experimental::string_view importer,
+        std::experimental::string_view path) {
+    auto slash = importer.rfind('/');
+    if ((!path.empty() && path[0] == '/') ||
+            slash == std::experimental::string_view::npos) {
+        return std::string(path);
+    }
+    std::string resolved(importer.substr(0, slash + 1));
+    resolved.append(path.data(), path.size());
+    return resolved;
+}
@@ -0,0 +1,54 @@
+#ifndef MODULE_HPP
+#define MODULE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <experimental/optional>
+#include <experimental/string_view>
+#include <string>
+#include <vector>
+#include "native.hpp"
+
+// Compiled modules stored on disk under the hashes of their paths, sources,
+// the build of the compiler and the native functions, so that a module is
+// only recompiled when any of them changes. The contents of the modules are
+// opaque, they are made and linked by the parser.
+class ModuleCache final {
+public:
+    // Caches the modules in the directory, which is created if missing. The
+    // build is identified by the hash of the running executable, nothing is
+    // cached if it can't be read.
+    explicit ModuleCache(std::string directory);
+    ModuleCache(const ModuleCache&) = default;
+    ModuleCache& operator=(const ModuleCache&) = default;
+    ModuleCache(ModuleCache&&) = default;
+    ModuleCache& operator=(ModuleCache&&) = default;
+
+    // Computes the key of the module with the given canonical path and
+    // source. The natives may be nullptr.
+    std::uint64_t key(std::experimental::string_view path,
+            std::experimental::string_view source,
+            const NativeFunctions* natives) const;
+
+    // Reads the module, returns nullopt if it isn't cached or is corrupted.
+    std::experimental::optional<std::vector<char>> read(
+            std::uint64_t key) const;
+
+    // Writes the module, returns false on failure. The file is replaced
+    // atomically, so concurrent runs never read a partial module.
+    bool write(std::uint64_t key, const std::vector<char>& module) const;
+
+private:
+    // Gets the name of the file of the module.
+    std::string filename(std::uint64_t key) const;
+
+    std::string directory_;
+    // The hash of the executable, nullopt if it can't be read.
+    std::experimental::optional<std::uint64_t> build_;
+};
+
+// Resolves the path imported by the given file relative to its directory.
+std::string resolve_import(std::experimental::string_view importer,
+        std::experimental::string_view path);
+
+#endif // !MODULE_HPP
@@ -0,0 +1,30 @@
+#include "native.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <experimental/string_view>
+#include <string>
+#include "assert.hpp"
+
+bool NativeFunctions::add(std::experimental::string_view name,
+        NativeFunction function) {
+    ASSERT(function != nullptr);
+    if (functions_.size() == MAX_FUNCTIONS ||
+            std::find(names_.begin(), names_.end(), name) != names_.end()) {
+        return false;
+    }
+    names_.emplace_back(name.data(), name.size());
+    functions_.push_back(function);
+    return true;
+}
+
+std::size_t NativeFunctions::size() const {
+    return functions_.size();
+}
+
+std::experimental::string_view NativeFunctions::name(std::size_t index) const {
+    return names_.at(index);
+}
+
+const NativeFunction* NativeFunctions::functions() const {
+    return functions_.data();
+}
@@ -0,0 +1,48 @@
+#ifndef NATIVE_HPP
+#define NATIVE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <experimental/string_view>
+#include <string>
+#include <vector>
+
+// A host function callable by programs. The arguments are passed in place in
+// the registers of the callee.
+using NativeFunction = std::int64_t (*)(const std::int64_t* args,
+        std::size_t num_args);
+
+// Host functions exposed by the embedder under their names. They must be
+// registered before the parsing and outlive the parser and the interpreter.
+class NativeFunctions final {
+public:
+    // The maximal number of functions, CALLN indexes them by a byte.
+    static constexpr std::size_t MAX_FUNCTIONS = 256;
+
+    NativeFunctions() = default;
+    NativeFunctions(const NativeFunctions&) = default;
+    NativeFunctions& operator=(const NativeFunctions&) = default;
+    NativeFunctions(NativeFunctions&&) = default;
+    NativeFunctions& operator=(NativeFunctions&&) = default;
+
+    // Registers the function under the name, returns false if the name is
+    // already taken or there are too many functions.
+    bool add(std::experimental::string_view name, NativeFunction function);
+
+    // Gets the number of the registered functions.
+    std::size_t size() const;
+
+    // Gets the name of the function with the given index.
+    std::experimental::string_view name(std::size_t index) const;
+
+    // Gets the functions indexed by CALLN.
+    const NativeFunction* functions() const;
+
+private:
+    // The names are referenced by the lexer, so they must not be moved.
+    std::deque<std::string> names_;
+    std::vector<NativeFunction> functions_;
+};
+
+#endif // !NATIVE_HPP
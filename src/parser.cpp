@@ -1,15 +1,312 @@
 #include "parser.hpp"
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cinttypes>
+#include <cerrno>
 #include <cstdlib>
+#include <deque>
 #include <experimental/string_view>
+#include <limits>
+#include <string>
 #include <utility>
 #include <vector>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "assert.hpp"
+#include "builtins.hpp"
+#include "config.hpp"
+#include "image.hpp"
 #include "instruction.hpp"
+#include "interpreter.hpp"
 #include "lexer.hpp"
+#include "module.hpp"
+#include "utilities.hpp"
 
-Parser::Parser(Lexer lexer) : lexer_(std::move(lexer)) {}
+// The maximal number of instructions executed to fold a single call.
+#if !defined(PARSER_EVALUATION_FUEL)
+#   define PARSER_EVALUATION_FUEL (1 << 20)
+#endif
+
+// The maximal number of instructions executed to fold all calls.
+#if !defined(PARSER_EVALUATION_BUDGET)
+#   define PARSER_EVALUATION_BUDGET (1 << 23)
+#endif
+
+// How many times calls in a loop are assumed to be executed more often than
+// calls outside of it.
+#if !defined(PARSER_LOOP_CALL_WEIGHT)
+#   define PARSER_LOOP_CALL_WEIGHT 8
+#endif
+
+// Code after a conditional jump is cold if it is entered by at most one in
+// this many executions of the jump.
+#if !defined(PARSER_COLD_BLOCK_RATIO)
+#   define PARSER_COLD_BLOCK_RATIO 16
+#endif
+
+// The minimal number of cases of a match dispatched by a jump table, fewer
+// cases are compared one by one.
+#if !defined(PARSER_JUMP_TABLE_MIN_CASES)
+#   define PARSER_JUMP_TABLE_MIN_CASES 4
+#endif
+
+// The maximal number of entries of a jump table, at least a half of them must
+// be cases.
+#if !defined(PARSER_JUMP_TABLE_MAX_SIZE)
+#   define PARSER_JUMP_TABLE_MAX_SIZE 1024
+#endif
+
+// The maximal number of specializations of all functions.
+#if !defined(PARSER_MAX_SPECIALIZATIONS)
+#   define PARSER_MAX_SPECIALIZATIONS 64
+#endif
+
+// The maximal number of specializations of a single function.
+#if !defined(PARSER_MAX_SPECIALIZATIONS_PER_FUNCTION)
+#   define PARSER_MAX_SPECIALIZATIONS_PER_FUNCTION 8
+#endif
+
+// The minimal size of the source compiled by a worker process, smaller
+// sources aren't worth forking for.
+#if !defined(PARSER_MIN_JOB_SIZE)
+#   define PARSER_MIN_JOB_SIZE (256 * 1024)
+#endif
+
+namespace {
+
+// A builtin function, its arguments are combined from left to right by the
+// instructions, so clamp(x, lo, hi) is min(max(x, lo), hi). The array one
+// allocates an array of the given length.
+struct Builtin final {
+    const char* name_;
+    std::size_t num_args_;
+    Instruction::Opcode opcodes_[2];
+};
+
+const Builtin builtins[] = {
+    {"abs", 1, {Instruction::ABS}},
+    {"array", 1, {Instruction::ANEW}},
+    {"clamp", 3, {Instruction::MAX, Instruction::MIN}},
+    {"clz", 1, {Instruction::CLZ}},
+    {"ctz", 1, {Instruction::CTZ}},
+    {"gcd", 2, {Instruction::GCD}},
+    {"ipow", 2, {Instruction::IPOW}},
+    {"isqrt", 1, {Instruction::ISQRT}},
+    {"max", 2, {Instruction::MAX}},
+    {"min", 2, {Instruction::MIN}},
+    {"mulhi", 2, {Instruction::MULHI}},
+    {"popcount", 1, {Instruction::POPCOUNT}},
+};
+
+#if defined(PARSER_WORKER_PROCESSES)
+// The end of a function in the source, past its closing brace.
+struct FunctionEnd final {
+    const char* position_;
+    std::size_t line_number_;
+};
+
+// Finds the closing braces of the top-level blocks, i.e. the ends of the
+// functions of a well-formed source. Other sources are split anyhow.
+std::vector<FunctionEnd> find_function_ends(const char* source,
+        std::size_t line_number) {
+    std::vector<FunctionEnd> ends;
+    std::size_t depth = 0;
+    for (const char* current = source; *current != '\0'; ++current) {
+        switch (*current) {
+        case '\n':
+            ++line_number;
+            break;
+        case '{':
+            ++depth;
+            break;
+        case '}':
+            if (depth != 0 && --depth == 0) {
+                FunctionEnd end;
+                end.position_ = current + 1;
+                end.line_number_ = line_number;
+                ends.push_back(end);
+            }
+            break;
+        }
+    }
+    return ends;
+}
+#endif
+
+// Gets the offset of the target instruction from the given one, they may be
+// in different bytecodes.
+std::int64_t distance(const Instruction* from, const Instruction* to) {
+    return (reinterpret_cast<std::intptr_t>(to) -
+            reinterpret_cast<std::intptr_t>(from)) /
+        static_cast<std::intptr_t>(sizeof(Instruction));
+}
+
+// Appends the bytes of the value to the chunk sent by a worker.
+template <typename T>
+void put(std::vector<char>* chunk, const T& value) {
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    chunk->insert(chunk->end(), bytes, bytes + sizeof(T));
+}
+
+// Appends the size and the characters of the string to the chunk.
+void put_string(std::vector<char>* chunk,
+        std::experimental::string_view string) {
+    put(chunk, string.size());
+    chunk->insert(chunk->end(), string.begin(), string.end());
+}
+
+// Appends the size and the bytes of the values to the chunk.
+template <typename T>
+void put_vector(std::vector<char>* chunk, const std::vector<T>& values) {
+    put(chunk, values.size());
+    const char* bytes = reinterpret_cast<const char*>(values.data());
+    chunk->insert(chunk->end(), bytes, bytes + values.size() * sizeof(T));
+}
+
+// Reads the values of a chunk in the order they were put.
+class ChunkReader final {
+public:
+    explicit ChunkReader(const std::vector<char>& chunk)
+        : current_(chunk.data()), end_(chunk.data() + chunk.size()) {}
+    explicit ChunkReader(std::experimental::string_view chunk)
+        : current_(chunk.data()), end_(chunk.data() + chunk.size()) {}
+
+    template <typename T>
+    T get() {
+        T value;
+        ASSERT_LE(sizeof(T), static_cast<std::size_t>(end_ - current_));
+        std::copy(current_, current_ + sizeof(T),
+                reinterpret_cast<char*>(&value));
+        current_ += sizeof(T);
+        return value;
+    }
+
+    // Gets the string, which points to the chunk.
+    std::experimental::string_view get_string() {
+        std::size_t size = get<std::size_t>();
+        ASSERT_LE(size, static_cast<std::size_t>(end_ - current_));
+        std::experimental::string_view string(current_, size);
+        current_ += size;
+        return string;
+    }
+
+    template <typename T>
+    std::vector<T> get_vector() {
+        std::vector<T> values(get<std::size_t>());
+        std::size_t size = values.size() * sizeof(T);
+        ASSERT_LE(size, static_cast<std::size_t>(end_ - current_));
+        std::copy(current_, current_ + size,
+                reinterpret_cast<char*>(values.data()));
+        current_ += size;
+        return values;
+    }
+
+    // Gets the values which weren't read yet.
+    std::experimental::string_view rest() const {
+        return std::experimental::string_view(current_, end_ - current_);
+    }
+
+private:
+    const char* current_;
+    const char* end_;
+};
+
+// Writes the whole buffer to the file descriptor.
+bool write_all(int fd, const char* data, std::size_t size) {
+    while (size != 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+#if defined(PARSER_WORKER_PROCESSES)
+// Reads the file descriptor until its end.
+bool read_all(int fd, std::vector<char>* data) {
+    char buffer[64 * 1024];
+    for (;;) {
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (size == 0) {
+            return true;
+        }
+        data->insert(data->end(), buffer, buffer + size);
+    }
+}
+#endif
+
+}
+
+Parser::Parser(Lexer lexer, const Parser::Options& options)
+        : last_allocation_(static_cast<std::size_t>(-1)),
+          file_(options.filename_ != nullptr ? options.filename_ : ""),
+          lexer_(std::move(lexer)), max_division_query_(0),
+          options_(options) {
+    Parser::File program;
+    program.name_ = file_;
+    program.begin_ = 0;
+    program.exports_ = false;
+    files_.push_back(std::move(program));
+    for (std::size_t i = 0; i < sizeof(builtins) / sizeof(*builtins); ++i) {
+        builtins_.emplace(lexer_.find_or_insert_symbol(builtins[i].name_), i);
+    }
+    if (options_.native_functions_ == nullptr) {
+        return;
+    }
+    const auto& natives = *options_.native_functions_;
+    for (std::size_t i = 0; i < natives.size(); ++i) {
+        std::size_t symbol_id = lexer_.find_or_insert_symbol(natives.name(i));
+        if (UNLIKELY(symbol_id < Lexer::NUM_TOKENS ||
+                    builtins_.count(symbol_id) != 0)) {
+            std::fputs("Error: native function '", stderr);
+            std::fwrite(natives.name(i).data(), 1, natives.name(i).size(),
+                    stderr);
+            std::fputs("' is a keyword or a builtin\n", stderr);
+            std::exit(EXIT_FAILURE);
+        }
+        natives_.emplace(symbol_id, i);
+    }
+}
+
+Profile Parser::make_profile(const ExecutionCounts& counts) const {
+    ASSERT(options_.profile_generate_);
+    Profile profile;
+    for (const auto& it : function_sources_) {
+        std::size_t begin = functions_.at(it.first).first;
+        Profile::Function function;
+        function.checksum_ = it.second.checksum_;
+        for (std::size_t pos = begin; pos < it.second.end_; ++pos) {
+            if (counts.executed_[pos] == 0 || (pos != begin &&
+                        !bytecode_[pos].is_jump() &&
+                        !bytecode_[pos].is_call())) {
+                continue;
+            }
+            Profile::Counter counter;
+            counter.offset_ = pos - begin;
+            counter.executed_ = counts.executed_[pos];
+            counter.taken_ = counts.taken_[pos];
+            function.counters_.push_back(counter);
+        }
+        profile.add_function(lexer_.symbol_name(it.first), std::move(function));
+    }
+    return profile;
+}
 
 const std::vector<Instruction>& Parser::bytecode() const {
     return bytecode_;
@@ -19,14 +316,83 @@ const std::vector<std::int64_t>& Parser::constants() const {
     return constants_;
 }
 
-std::size_t Parser::find_variable_reg(std::size_t symbol_id) const {
+std::vector<Image::Function> Parser::functions() const {
+    std::vector<Image::Function> functions;
+    functions.reserve(functions_.size());
+    for (const auto& it : functions_) {
+        Image::Function function;
+        function.pos_ = it.second.first;
+        function.num_args_ = it.second.second;
+        function.name_ = lexer_.symbol_name(it.first);
+        functions.push_back(function);
+    }
+    std::sort(functions.begin(), functions.end(),
+            [](const Image::Function& lhs, const Image::Function& rhs) {
+                return lhs.pos_ < rhs.pos_;
+            });
+    return functions;
+}
+
+void Parser::print_statistics(std::FILE* file) const {
+    std::fprintf(file, "closed-form loops: %zu\n",
+            statistics_.num_closed_form_loops_);
+    std::fprintf(file, "folded calls: %zu\n", statistics_.num_folded_calls_);
+    std::fprintf(file, "memoized functions: %zu\n",
+            statistics_.num_memoized_functions_);
+    std::fprintf(file, "specializations: %zu\n",
+            statistics_.num_specializations_);
+    std::fprintf(file, "dead functions: %zu\n",
+            statistics_.num_dead_functions_);
+    std::fprintf(file, "cold blocks: %zu\n", statistics_.num_cold_blocks_);
+    std::fprintf(file, "jump tables: %zu\n", statistics_.num_jump_tables_);
+    std::fprintf(file, "unchecked array accesses: %zu\n",
+            statistics_.num_unchecked_accesses_);
+    std::fprintf(file, "modules: %zu compiled, %zu cached\n",
+            statistics_.num_compiled_modules_,
+            statistics_.num_cached_modules_);
+}
+
+std::size_t Parser::find_variable_reg(std::size_t symbol_id) {
+    const auto none = std::numeric_limits<std::size_t>::max();
+    if (symbol_id >= recent_regs_.size() || recent_regs_[symbol_id] == none) {
+        return none;
+    }
+    // The recent register is valid unless its scope has ended, then an
+    // outer variable may be visible.
+    std::size_t reg = recent_regs_[symbol_id];
+    if (LIKELY(reg < current_scope_->num_variables_ &&
+                variable_regs_[reg] == symbol_id)) {
+        return reg;
+    }
     std::size_t i = current_scope_->num_variables_;
-    while (LIKELY(i-- != 0)) {
+    while (i-- != 0) {
         if (variable_regs_[i] == symbol_id) {
+            recent_regs_[symbol_id] = i;
             return i;
         }
     }
-    return std::numeric_limits<std::size_t>::max();
+    recent_regs_[symbol_id] = none;
+    return none;
+}
+
+void Parser::add_variable(std::size_t symbol_id) {
+    std::size_t reg = current_scope_->num_variables_;
+    if (UNLIKELY(reg == sizeof(variable_regs_) / sizeof(*variable_regs_))) {
+        std::fprintf(stderr, "Error in line %zu: too many variables\n",
+                lexer_.current_line_number());
+        std::exit(EXIT_FAILURE);
+    }
+    variable_regs_[reg] = symbol_id;
+    variable_facts_[reg].kind_ = Parser::VariableFact::UNKNOWN;
+    ++current_scope_->num_variables_;
+    if (symbol_id == std::numeric_limits<std::size_t>::max()) {
+        return;
+    }
+    if (symbol_id >= recent_regs_.size()) {
+        recent_regs_.resize(symbol_id + 1,
+                std::numeric_limits<std::size_t>::max());
+    }
+    recent_regs_[symbol_id] = reg;
 }
 
 Parser::Expression Parser::expr_to_reg(Parser::Expression expr,
@@ -34,11 +400,8 @@ Parser::Expression Parser::expr_to_reg(Parser::Expression expr,
     if (!expr.has_reg()) {
         if (UNLIKELY(expr.value() < std::numeric_limits<std::int16_t>::min() ||
                     expr.value() > std::numeric_limits<std::int16_t>::max())) {
-            std::size_t index = constants_.size();
-            ASSERT_LE(index, std::numeric_limits<std::uint16_t>::max());
-            constants_.push_back(expr.value());
             bytecode_.push_back(Instruction::make_ad(Instruction::CONST,
-                        reg, index));
+                        reg, add_constant(expr.value())));
         } else {
             bytecode_.push_back(Instruction::make_ad(Instruction::MOVI,
                         reg, expr.value()));
@@ -50,6 +413,16 @@ Parser::Expression Parser::expr_to_reg(Parser::Expression expr,
     return Parser::Expression::make_reg(reg);
 }
 
+std::size_t Parser::add_constant(std::int64_t value) {
+    std::size_t index = constants_.size();
+    if (UNLIKELY(index > std::numeric_limits<std::uint16_t>::max())) {
+        std::fputs("Error: too many constants\n", stderr);
+        std::exit(EXIT_FAILURE);
+    }
+    constants_.push_back(value);
+    return index;
+}
+
 Parser::Expression Parser::expr_to_next_reg(Parser::Expression expr) {
     std::uint8_t reg = current_scope_->first_free_reg_++;
     return expr_to_reg(expr, reg);
@@ -77,39 +450,45 @@ std::size_t Parser::next_jump(std::size_t pos) const {
     return pos + 1 + delta;
 }
 
-void Parser::append_jump(std::size_t* list, std::size_t pos) {
-    if (*list == static_cast<std::size_t>(-1)) {
-        *list = pos;
+void Parser::append_jump(Parser::JumpList* list, Parser::JumpList other) {
+    if (other.empty()) {
         return;
     }
-    std::size_t cur = *list;
-    std::size_t next;
-    while ((next = next_jump(cur)) != static_cast<std::size_t>(-1)) {
-        cur = next;
+    if (list->empty()) {
+        *list = other;
+        return;
     }
-    patch_single_jump(cur, pos);
+    patch_single_jump(list->tail_, other.head_);
+    list->tail_ = other.tail_;
 }
 
 void Parser::patch_single_jump(std::size_t pos, std::size_t target) {
-    std::int16_t offset = target - (pos + 1);
+    auto offset = static_cast<std::int64_t>(target - (pos + 1));
+    if (UNLIKELY(offset < std::numeric_limits<std::int16_t>::min() ||
+                offset > std::numeric_limits<std::int16_t>::max())) {
+        std::fprintf(stderr, "Error in line %zu: function too large\n",
+                lexer_.current_line_number());
+        std::exit(EXIT_FAILURE);
+    }
     bytecode_[pos].set_d(offset);
 }
 
-void Parser::patch_jump_list(std::size_t list, std::size_t target) {
-    while (list != static_cast<std::size_t>(-1)) {
-        std::size_t next = next_jump(list);
-        patch_single_jump(list, target);
-        list = next;
+void Parser::patch_jump_list(Parser::JumpList list, std::size_t target) {
+    std::size_t pos = list.head_;
+    while (pos != static_cast<std::size_t>(-1)) {
+        std::size_t next = next_jump(pos);
+        patch_single_jump(pos, target);
+        pos = next;
     }
 }
 
-void Parser::patch_jump_list_to_here(std::size_t list) {
+void Parser::patch_jump_list_to_here(Parser::JumpList list) {
     patch_jump_list(list, bytecode_.size());
 }
 
 Parser::Expression Parser::fold_unary_op(int op, Parser::Expression expr) {
     ASSERT_GE(op, Parser::NEG);
-    ASSERT_LE(op, Parser::NOT);
+    ASSERT_LE(op, Parser::BNOT);
     ASSERT_EQ(expr.has_reg(), false);
     std::int64_t value;
     switch (op) {
@@ -119,6 +498,9 @@ Parser::Expression Parser::fold_unary_op(int op, Parser::Expression expr) {
     case Parser::NOT:
         value = !expr.value();
         break;
+    case Parser::BNOT:
+        value = ~expr.value();
+        break;
     default:
         UNREACHABLE();
     }
@@ -154,6 +536,27 @@ Parser::Expression Parser::fold_binary_op(int op, Parser::Expression lhs,
     case Parser::NE:
         value = lhs.value() != rhs.value();
         break;
+    case Parser::AND:
+        value = lhs.value() & rhs.value();
+        break;
+    case Parser::OR:
+        value = lhs.value() | rhs.value();
+        break;
+    case Parser::XOR:
+        value = lhs.value() ^ rhs.value();
+        break;
+    // Shifts take the shift amount modulo 64, like the instructions.
+    case Parser::SHL:
+        value = static_cast<std::int64_t>(
+                static_cast<std::uint64_t>(lhs.value()) << (rhs.value() & 63));
+        break;
+    case Parser::SAR:
+        value = lhs.value() >> (rhs.value() & 63);
+        break;
+    case Parser::SHR:
+        value = static_cast<std::int64_t>(
+                static_cast<std::uint64_t>(lhs.value()) >> (rhs.value() & 63));
+        break;
     case Parser::LT:
         value = lhs.value() < rhs.value();
         break;
@@ -174,7 +577,7 @@ Parser::Expression Parser::fold_binary_op(int op, Parser::Expression lhs,
 
 Parser::Expression Parser::emit_unary_op(int op, Parser::Expression expr) {
     ASSERT_GE(op, Parser::NEG);
-    ASSERT_LE(op, Parser::NOT);
+    ASSERT_LE(op, Parser::BNOT);
     if (!expr.has_reg()) {
         return fold_unary_op(op, expr);
     }
@@ -187,10 +590,82 @@ Parser::Expression Parser::emit_unary_op(int op, Parser::Expression expr) {
     return Parser::Expression::make_reg(reg);
 }
 
+Parser::Expression Parser::fold_builtin(Instruction::Opcode opcode,
+        Parser::Expression lhs, Parser::Expression rhs) {
+    ASSERT_EQ(lhs.has_reg(), false);
+    ASSERT_EQ(rhs.has_reg(), false);
+    std::int64_t value;
+    switch (opcode) {
+    case Instruction::ABS:
+        value = builtin_abs(lhs.value());
+        break;
+    case Instruction::POPCOUNT:
+        value = builtin_popcount(lhs.value());
+        break;
+    case Instruction::CLZ:
+        value = builtin_clz(lhs.value());
+        break;
+    case Instruction::CTZ:
+        value = builtin_ctz(lhs.value());
+        break;
+    case Instruction::ISQRT:
+        value = builtin_isqrt(lhs.value());
+        break;
+    case Instruction::MIN:
+        value = builtin_min(lhs.value(), rhs.value());
+        break;
+    case Instruction::MAX:
+        value = builtin_max(lhs.value(), rhs.value());
+        break;
+    case Instruction::GCD:
+        value = builtin_gcd(lhs.value(), rhs.value());
+        break;
+    case Instruction::IPOW:
+        value = builtin_ipow(lhs.value(), rhs.value());
+        break;
+    case Instruction::MULHI:
+        value = builtin_mulhi(lhs.value(), rhs.value());
+        break;
+    default:
+        UNREACHABLE();
+    }
+    return Parser::Expression::make_value(value);
+}
+
+Parser::Expression Parser::emit_unary_builtin(Instruction::Opcode opcode,
+        Parser::Expression expr) {
+    ASSERT_GE(opcode, Instruction::ABS);
+    ASSERT_LE(opcode, Instruction::ISQRT);
+    if (!expr.has_reg()) {
+        return fold_builtin(opcode, expr, Parser::Expression::make_value(0));
+    }
+    free_expr_reg(expr);
+    std::uint8_t reg = current_scope_->first_free_reg_++;
+    bytecode_.push_back(Instruction::make_abc(opcode, reg, expr.reg(), 0));
+    return Parser::Expression::make_reg(reg);
+}
+
+Parser::Expression Parser::emit_binary_builtin(Instruction::Opcode opcode,
+        Parser::Expression lhs, Parser::Expression rhs) {
+    ASSERT_GE(opcode, Instruction::MIN);
+    ASSERT_LE(opcode, Instruction::MULHI);
+    if (!lhs.has_reg() && !rhs.has_reg()) {
+        return fold_builtin(opcode, lhs, rhs);
+    }
+    rhs = expr_to_any_reg(rhs);
+    lhs = expr_to_any_reg(lhs);
+    free_expr_reg(lhs);
+    free_expr_reg(rhs);
+    std::uint8_t reg = current_scope_->first_free_reg_++;
+    bytecode_.push_back(
+            Instruction::make_abc(opcode, reg, lhs.reg(), rhs.reg()));
+    return Parser::Expression::make_reg(reg);
+}
+
 Parser::Expression Parser::emit_commutative_op(int op, Parser::Expression lhs,
         Parser::Expression rhs) {
     ASSERT_GE(op, Parser::ADD);
-    ASSERT_LE(op, Parser::NE);
+    ASSERT_LE(op, Parser::XOR);
     bool use_imm_instruction = false;
     if (!rhs.has_reg() &&
             rhs.value() >= std::numeric_limits<std::int8_t>::min() &&
@@ -227,7 +702,11 @@ Parser::Expression Parser::emit_commutative_op(int op, Parser::Expression lhs,
 Parser::Expression Parser::emit_noncommutative_op(int op,
         Parser::Expression lhs, Parser::Expression rhs) {
     ASSERT_GE(op, Parser::SUB);
-    ASSERT_LE(op, Parser::LE);
+    ASSERT_LE(op, Parser::SHR);
+    if ((op == Parser::DIV || op == Parser::MOD) && !rhs.has_reg() &&
+            can_emit_division_by_constant(rhs.value())) {
+        return emit_division_by_constant(op, lhs, rhs.value());
+    }
     Instruction::Opcode opcode;
     std::uint8_t b;
     std::uint8_t c;
@@ -264,12 +743,76 @@ Parser::Expression Parser::emit_noncommutative_op(int op,
     return Expression::make_reg(reg);
 }
 
+bool Parser::can_emit_division_by_constant(std::int64_t divisor) {
+    if (divisor == 0 || divisor == std::numeric_limits<std::int64_t>::min()) {
+        return false;
+    }
+    if (divisor == 1 || divisor == -1 ||
+            (divisor > 0 && (divisor & (divisor - 1)) == 0)) {
+        return true;
+    }
+    // The magic numbers must be addressable by the 'c' operand.
+    if (division_magics_.count(divisor) != 0) {
+        return true;
+    }
+    max_division_query_ = std::max(max_division_query_, constants_.size() + 3);
+    return constants_.size() + 3 <=
+        std::numeric_limits<std::uint8_t>::max() + 1;
+}
+
+Parser::Expression Parser::emit_division_by_constant(int op,
+        Parser::Expression lhs, std::int64_t divisor) {
+    ASSERT(op == Parser::DIV || op == Parser::MOD);
+    ASSERT(can_emit_division_by_constant(divisor));
+    lhs = expr_to_any_reg(lhs);
+    // x / 1 = x, x / -1 = -x, x % 1 = x % -1 = 0.
+    if (divisor == 1 || divisor == -1) {
+        if (op == Parser::MOD) {
+            free_expr_reg(lhs);
+            return Parser::Expression::make_value(0);
+        }
+        if (divisor == 1) {
+            return lhs;
+        }
+        return emit_unary_op(Parser::NEG, lhs);
+    }
+    free_expr_reg(lhs);
+    Instruction::Opcode opcode;
+    std::uint8_t c;
+    if (divisor > 0 && (divisor & (divisor - 1)) == 0) {
+        opcode = op == Parser::DIV ? Instruction::DIVPOW2
+            : Instruction::MODPOW2;
+        c = __builtin_ctzll(divisor);
+    } else {
+        auto it = division_magics_.find(divisor);
+        if (it == division_magics_.end()) {
+            auto magic = division_magic(divisor);
+            it = division_magics_.emplace(divisor, constants_.size()).first;
+            constants_.push_back(magic.multiplier_);
+            constants_.push_back(magic.shift_);
+            constants_.push_back(divisor);
+        }
+        opcode = op == Parser::DIV ? Instruction::DIVMAGIC
+            : Instruction::MODMAGIC;
+        c = it->second;
+    }
+    std::uint8_t reg = current_scope_->first_free_reg_++;
+    bytecode_.push_back(Instruction::make_abc(opcode, reg, lhs.reg(), c));
+    return Expression::make_reg(reg);
+}
+
 Parser::Expression Parser::emit_binary_op(int op, Parser::Expression lhs,
         Parser::Expression rhs) {
     ASSERT_GE(op, Parser::ADD);
     ASSERT_LE(op, Parser::GE);
     if (!lhs.has_reg() && !rhs.has_reg()) {
-        return fold_binary_op(op, lhs, rhs);
+        // Divisions that would trap are left to trap at run time.
+        if ((op != Parser::DIV && op != Parser::MOD) ||
+                (rhs.value() != 0 && (rhs.value() != -1 ||
+                    lhs.value() != std::numeric_limits<std::int64_t>::min()))) {
+            return fold_binary_op(op, lhs, rhs);
+        }
+        lhs = expr_to_any_reg(lhs);
     }
     // Change '>', '>=' to '<', '<='.
     if (op >= Parser::GT) {
@@ -306,11 +849,44 @@ Parser::Expression Parser::emit_call(std::size_t symbol_id, std::uint8_t reg,
     }
     auto expr = Parser::Expression::make_value(symbol_id);
     expr = expr_to_reg(expr, reg);
+    // Record the call if any argument is a constant.
+    ASSERT_GE(pending_args_.size(), num_args);
+    auto first = pending_args_.end() - num_args;
+    if (std::any_of(first, pending_args_.end(),
+                [](const Parser::CallArgument& arg) {
+                    return arg.load_ != static_cast<std::size_t>(-1);
+                })) {
+        Parser::CallSite site;
+        site.call_ = bytecode_.size();
+        site.first_arg_ = call_args_.size();
+        site.num_args_ = num_args;
+        call_sites_.push_back(site);
+        call_args_.insert(call_args_.end(), first, pending_args_.end());
+    }
+    pending_args_.erase(first, pending_args_.end());
     bytecode_.push_back(Instruction::make_abc(Instruction::CALL, reg, num_args,
                 0));
     return expr;
 }
 
+Parser::Expression Parser::emit_native_call(std::size_t index,
+        std::uint8_t reg, std::size_t num_args) {
+    ASSERT_LT(index, NativeFunctions::MAX_FUNCTIONS);
+    if (UNLIKELY(num_args > std::numeric_limits<std::uint8_t>::max())) {
+        std::fputs("Error: too many arguments passed to the '", stderr);
+        auto name = options_.native_functions_->name(index);
+        std::fwrite(name.data(), 1, name.size(), stderr);
+        std::fputs("' function\n", stderr);
+        std::exit(EXIT_FAILURE);
+    }
+    // The arguments are passed in place, they are never specialized.
+    ASSERT_GE(pending_args_.size(), num_args);
+    pending_args_.erase(pending_args_.end() - num_args, pending_args_.end());
+    bytecode_.push_back(Instruction::make_abc(Instruction::CALLN, reg,
+                num_args, index));
+    return Parser::Expression::make_reg(reg);
+}
+
 void Parser::emit_return(Parser::Expression expr) {
     if (!expr.has_reg() &&
             expr.value() >= std::numeric_limits<std::int16_t>::min() &&
@@ -325,6 +901,107 @@ void Parser::emit_return(Parser::Expression expr) {
     }
 }
 
+Parser::Expression Parser::emit_array_new(Parser::Expression length) {
+    bool is_known = length.has_reg()
+        ? length.reg() < current_scope_->num_variables_ : length.value() >= 0;
+    last_allocation_length_ = length;
+    length = expr_to_any_reg(length);
+    free_expr_reg(length);
+    std::uint8_t reg = current_scope_->first_free_reg_++;
+    last_allocation_ = is_known ? bytecode_.size()
+        : static_cast<std::size_t>(-1);
+    bytecode_.push_back(Instruction::make_abc(Instruction::ANEW, reg,
+                length.reg(), 0));
+    return Parser::Expression::make_reg(reg);
+}
+
+Parser::Expression Parser::emit_array_load(Parser::Expression array,
+        Parser::Expression index) {
+    auto index_reg = expr_to_any_reg(index);
+    auto array_reg = expr_to_any_reg(array);
+    free_expr_reg(array_reg);
+    free_expr_reg(index_reg);
+    std::uint8_t reg = current_scope_->first_free_reg_++;
+    bytecode_.push_back(Instruction::make_abc(Instruction::ALOAD, reg,
+                array_reg.reg(), index_reg.reg()));
+    add_array_access(array, index);
+    return Parser::Expression::make_reg(reg);
+}
+
+void Parser::emit_array_store(Parser::Expression array,
+        Parser::Expression index, Parser::Expression value) {
+    auto value_reg = expr_to_any_reg(value);
+    auto index_reg = expr_to_any_reg(index);
+    auto array_reg = expr_to_any_reg(array);
+    free_expr_reg(array_reg);
+    free_expr_reg(index_reg);
+    free_expr_reg(value_reg);
+    bytecode_.push_back(Instruction::make_abc(Instruction::ASTORE,
+                array_reg.reg(), index_reg.reg(), value_reg.reg()));
+    add_array_access(array, index);
+}
+
+void Parser::add_array_access(Parser::Expression array,
+        Parser::Expression index) {
+    std::size_t num_variables = current_scope_->num_variables_;
+    if (!array.has_reg() || array.reg() >= num_variables ||
+            variable_facts_[array.reg()].kind_ !=
+            Parser::VariableFact::ARRAY) {
+        return;
+    }
+    auto length = variable_facts_[array.reg()].bound_;
+    Parser::ArrayAccess access;
+    access.pos_ = bytecode_.size() - 1;
+    access.regs_[0] = array.reg();
+    access.num_regs_ = 1;
+    if (!index.has_reg()) {
+        // A constant index of an array of a constant length.
+        if (length.has_reg() || index.value() < 0 ||
+                index.value() >= length.value()) {
+            return;
+        }
+    } else {
+        // A loop variable whose limit is at most the length.
+        if (index.reg() >= num_variables ||
+                variable_facts_[index.reg()].kind_ !=
+                Parser::VariableFact::INDEX) {
+            return;
+        }
+        auto bound = variable_facts_[index.reg()].bound_;
+        if (bound.has_reg() != length.has_reg() ||
+                (bound.has_reg() ? bound.reg() != length.reg()
+                 : bound.value() > length.value())) {
+            return;
+        }
+        access.regs_[access.num_regs_++] = index.reg();
+    }
+    if (length.has_reg()) {
+        access.regs_[access.num_regs_++] = length.reg();
+    }
+    array_accesses_.push_back(access);
+}
+
+void Parser::remove_array_checks() {
+    for (const auto& access : array_accesses_) {
+        bool is_proven = true;
+        for (std::size_t i = 0; i < access.num_regs_; ++i) {
+            if (assigned_regs_[access.regs_[i]]) {
+                is_proven = false;
+            }
+        }
+        if (!is_proven) {
+            continue;
+        }
+        auto& instruction = bytecode_[access.pos_];
+        ASSERT(instruction.opcode() == Instruction::ALOAD ||
+                instruction.opcode() == Instruction::ASTORE);
+        instruction.set_opcode(instruction.opcode() == Instruction::ALOAD
+                ? Instruction::ALOADU : Instruction::ASTOREU);
+        ++statistics_.num_unchecked_accesses_;
+    }
+    array_accesses_.clear();
+}
+
 void Parser::emit_io(Instruction::Opcode opcode, std::uint8_t reg) {
     ASSERT(opcode == Instruction::IN || opcode == Instruction::OUT);
     bytecode_.push_back(Instruction::make_abc(opcode, reg, 0, 0));
@@ -339,6 +1016,11 @@ std::size_t Parser::parse_parameters() {
     for (;;) {
         auto expr = parse_expr();
         free_expr_reg(expr);
+        Parser::CallArgument arg;
+        arg.load_ = expr.has_reg() ? static_cast<std::size_t>(-1)
+            : bytecode_.size();
+        arg.value_ = expr.has_reg() ? 0 : expr.value();
+        pending_args_.push_back(arg);
         expr_to_next_reg(expr);
         ++num_params;
         if (lexer_.token() == ')') {
@@ -359,24 +1041,67 @@ std::size_t Parser::parse_parameters() {
     return num_params;
 }
 
+Parser::Expression Parser::parse_call(std::size_t symbol_id) {
+    auto builtin = builtins_.find(symbol_id);
+    if (builtin != builtins_.end()) {
+        // A builtin, compiled to instructions.
+        return parse_builtin(builtin->second);
+    }
+    std::uint8_t reg = current_scope_->first_free_reg_++;
+    lexer_.check_and_consume_token('(');
+    std::size_t num_params = parse_parameters();
+    ASSERT_EQ(lexer_.token(), ')');
+    lexer_.consume_token();
+    auto native = natives_.find(symbol_id);
+    if (native != natives_.end()) {
+        return emit_native_call(native->second, reg, num_params);
+    }
+    return emit_call(symbol_id, reg, num_params);
+}
+
 Parser::Expression Parser::parse_identifier_expr() {
     ASSERT_EQ(lexer_.token(), Lexer::IDENTIFIER);
     std::size_t symbol_id = lexer_.token_attribute().sz;
     lexer_.consume_token();
-    // Is it a variable or a function?
+    // Is it a variable or a call?
     std::size_t reg = find_variable_reg(symbol_id);
-    if (reg != std::numeric_limits<std::size_t>::max()) {
-        // A variable.
-        return Parser::Expression::make_reg(reg);
-    } else {
-        // A function.
-        std::uint8_t reg = current_scope_->first_free_reg_++;
-        lexer_.check_and_consume_token('(');
-        std::size_t num_params = parse_parameters();
-        ASSERT_EQ(lexer_.token(), ')');
-        lexer_.consume_token();
-        return emit_call(symbol_id, reg, num_params);
+    if (reg == std::numeric_limits<std::size_t>::max()) {
+        return parse_call(symbol_id);
+    }
+    // A variable, arguments of specializations may be constants.
+    auto expr = Parser::Expression::make_reg(reg);
+    if (reg < constant_args_.size() && constant_args_[reg]) {
+        expr = Parser::Expression::make_value(*constant_args_[reg]);
+    }
+    if (lexer_.token() != '[') {
+        return expr;
+    }
+    // An element of the array.
+    lexer_.consume_token();
+    auto index = parse_expr();
+    lexer_.check_and_consume_token(']');
+    return emit_array_load(expr, index);
+}
+
+Parser::Expression Parser::parse_builtin(std::size_t index) {
+    const Builtin& builtin = builtins[index];
+    lexer_.check_and_consume_token('(');
+    auto expr = parse_expr();
+    if (builtin.opcodes_[0] == Instruction::ANEW) {
+        // Every allocation is a new array, so it's never folded.
+        expr = emit_array_new(expr);
+    } else if (builtin.num_args_ == 1) {
+        expr = emit_unary_builtin(builtin.opcodes_[0], expr);
+    }
+    // Combine each further argument as soon as it is parsed, like operands of
+    // binary operators, so no temporary register outlives its instruction.
+    for (std::size_t i = 1; i < builtin.num_args_; ++i) {
+        lexer_.check_and_consume_token(',');
+        auto arg = parse_expr();
+        expr = emit_binary_builtin(builtin.opcodes_[i - 1], expr, arg);
     }
+    lexer_.check_and_consume_token(')');
+    return expr;
 }
 
 Parser::Expression Parser::parse_integer_literal_expr() {
@@ -424,6 +1149,9 @@ Parser::Expression Parser::parse_unary_expr() {
     case '-':
         op = Parser::NEG;
         break;
+    case '~':
+        op = Parser::BNOT;
+        break;
     default:
         return parse_primary_expr();
     }
@@ -437,6 +1165,8 @@ int Parser::token_to_binary_op(int token) {
     switch (token) {
     case '%':
         return Parser::MOD;
+    case '&':
+        return Parser::AND;
     case '*':
         return Parser::MUL;
     case '+':
@@ -449,6 +1179,10 @@ int Parser::token_to_binary_op(int token) {
         return Parser::LT;
     case '>':
         return Parser::GT;
+    case '^':
+        return Parser::XOR;
+    case '|':
+        return Parser::OR;
     case Lexer::EQ:
         return Parser::EQ;
     case Lexer::NE:
@@ -457,6 +1191,12 @@ int Parser::token_to_binary_op(int token) {
         return Parser::LE;
     case Lexer::GE:
         return Parser::GE;
+    case Lexer::SAR:
+        return Parser::SAR;
+    case Lexer::SHL:
+        return Parser::SHL;
+    case Lexer::SHR:
+        return Parser::SHR;
     default:
         return -1;
     }
@@ -464,16 +1204,23 @@ int Parser::token_to_binary_op(int token) {
 }
 
 Parser::Expression Parser::parse_binary_expr(std::size_t limit) {
+    // Bitwise operators bind tighter than comparisons, unlike in C.
     static const std::size_t operator_precedence[] = {
-        /* ADD */ 2,
-        /* MUL */ 3,
+        /* ADD */ 6,
+        /* MUL */ 7,
         /* EQ */  1,
         /* NE */  1,
-        /* SUB */ 2,
-        /* DIV */ 3,
-        /* MOD */ 3,
+        /* AND */ 4,
+        /* OR */  2,
+        /* XOR */ 3,
+        /* SUB */ 6,
+        /* DIV */ 7,
+        /* MOD */ 7,
         /* LT */  1,
         /* LE */  1,
+        /* SHL */ 5,
+        /* SAR */ 5,
+        /* SHR */ 5,
         /* GT */  1,
         /* GE */  1,
     };
@@ -492,9 +1239,58 @@ Parser::Expression Parser::parse_binary_expr(std::size_t limit) {
     return lhs;
 }
 
+Parser::Expression Parser::parse_logical_expr(Parser::Expression lhs,
+        Parser::JumpList* true_list, Parser::JumpList* false_list) {
+    // Jumps of the '&&' operands to the next '||' operand.
+    Parser::JumpList and_list;
+    for (;;) {
+        if (lexer_.token() == Lexer::AND) {
+            append_jump(&and_list, emit_condition(lhs, false));
+        } else if (lexer_.token() == Lexer::OR) {
+            append_jump(true_list, emit_condition(lhs, true));
+            patch_jump_list_to_here(and_list);
+            and_list = Parser::JumpList();
+        } else {
+            break;
+        }
+        lexer_.consume_token();
+        // Set limit to 0, i.e. accept all binary operators.
+        lhs = parse_binary_expr(0);
+    }
+    append_jump(false_list, and_list);
+    return lhs;
+}
+
 Parser::Expression Parser::parse_expr() {
     // Set limit to 0, i.e. accept all operators.
-    return parse_binary_expr(0);
+    auto expr = parse_binary_expr(0);
+    if (lexer_.token() != Lexer::AND && lexer_.token() != Lexer::OR) {
+        return expr;
+    }
+    Parser::JumpList true_list;
+    Parser::JumpList false_list;
+    expr = parse_logical_expr(expr, &true_list, &false_list);
+    append_jump(&false_list, emit_condition(expr, false));
+    std::uint8_t reg = current_scope_->first_free_reg_++;
+    patch_jump_list_to_here(true_list);
+    expr_to_reg(Parser::Expression::make_value(1), reg);
+    if (!false_list.empty()) {
+        std::size_t end = emit_unconditional_jump();
+        patch_jump_list_to_here(false_list);
+        expr_to_reg(Parser::Expression::make_value(0), reg);
+        patch_single_jump(end, bytecode_.size());
+    }
+    return Parser::Expression::make_reg(reg);
+}
+
+Parser::JumpList Parser::parse_condition() {
+    Parser::JumpList true_list;
+    Parser::JumpList false_list;
+    auto expr = parse_logical_expr(parse_binary_expr(0), &true_list,
+            &false_list);
+    append_jump(&false_list, emit_condition(expr, false));
+    patch_jump_list_to_here(true_list);
+    return false_list;
 }
 
 void Parser::parse_block() {
@@ -510,31 +1306,40 @@ void Parser::parse_block() {
     current_scope_ = old_scope;
 }
 
-std::size_t Parser::parse_cond_block() {
-    auto expr = parse_expr();
-    expr = expr_to_any_reg(expr);
+Parser::JumpList Parser::emit_condition(Parser::Expression expr,
+        bool condition) {
+    if (!expr.has_reg()) {
+        return (expr.value() != 0) != condition ? Parser::JumpList()
+            : Parser::JumpList(emit_unconditional_jump());
+    }
     free_expr_reg(expr);
-    std::size_t pos = emit_conditional_jump(expr.reg(), false);
+    return Parser::JumpList(emit_conditional_jump(expr.reg(), condition));
+}
+
+Parser::JumpList Parser::parse_cond_block() {
+    auto list = parse_condition();
     parse_block();
-    return pos;
+    return list;
 }
 
 void Parser::parse_if() {
     ASSERT_EQ(lexer_.token(), Lexer::IF);
     lexer_.consume_token();
-    std::size_t escape_list = static_cast<std::size_t>(-1);
-    std::size_t cond_jump = parse_cond_block();
+    Parser::JumpList escape_list;
+    auto cond_jump = parse_cond_block();
     // Parse 'else if'.
     bool was_else;
     while ((was_else = lexer_.token() == Lexer::ELSE) &&
             (lexer_.consume_token(), lexer_.token() == Lexer::IF)) {
-        append_jump(&escape_list, emit_unconditional_jump());
+        append_jump(&escape_list,
+                Parser::JumpList(emit_unconditional_jump()));
         patch_jump_list_to_here(cond_jump);
         lexer_.consume_token();
         cond_jump = parse_cond_block();
     }
     if (was_else) {
-        append_jump(&escape_list, emit_unconditional_jump());
+        append_jump(&escape_list,
+                Parser::JumpList(emit_unconditional_jump()));
         patch_jump_list_to_here(cond_jump);
         parse_block();
     } else {
@@ -543,35 +1348,220 @@ void Parser::parse_if() {
     patch_jump_list_to_here(escape_list);
 }
 
-void Parser::parse_in() {
-    ASSERT_EQ(lexer_.token(), Lexer::IN);
-    lexer_.consume_token();
-    std::size_t symbol_id = lexer_.token_attribute().sz;
-    lexer_.check_and_consume_token(Lexer::IDENTIFIER);
-    std::size_t reg = find_variable_reg(symbol_id);
-    if (UNLIKELY(reg == std::numeric_limits<std::size_t>::max())) {
-        std::fprintf(stderr,
-                "Error in line %zu: the symbol '",
-                lexer_.current_line_number());
-        lexer_.print_symbol_name(symbol_id, stderr);
-        std::fputs("' doesn't exist in the current scope\n", stderr);
-        std::exit(EXIT_FAILURE);
+void Parser::emit_op_with_constant(Instruction::Opcode rr,
+        Instruction::Opcode ri, std::uint8_t tmp, std::uint8_t reg,
+        std::int64_t value) {
+    if (value >= std::numeric_limits<std::int8_t>::min() &&
+            value <= std::numeric_limits<std::int8_t>::max()) {
+        bytecode_.push_back(Instruction::make_abc(ri, tmp, reg,
+                    static_cast<std::int8_t>(value)));
+    } else {
+        expr_to_reg(Parser::Expression::make_value(value), tmp);
+        bytecode_.push_back(Instruction::make_abc(rr, tmp, reg, tmp));
     }
-    emit_io(Instruction::IN, reg);
-    lexer_.check_and_consume_token(';');
 }
 
-void Parser::parse_let() {
-    ASSERT_EQ(lexer_.token(), Lexer::LET);
-    lexer_.consume_token();
-    std::size_t symbol_id = lexer_.token_attribute().sz;
-    lexer_.check_and_consume_token(Lexer::IDENTIFIER);
-    lexer_.check_and_consume_token('=');
-    auto expr = parse_expr();
-    free_expr_reg(expr);
-    expr = expr_to_next_reg(expr);
-    // Add variable.
-    variable_regs_[current_scope_->num_variables_++] = symbol_id;
+void Parser::emit_match_dispatch(std::uint8_t reg, std::uint8_t tmp,
+        const std::vector<Parser::MatchCase>& cases, std::size_t first,
+        std::size_t last, std::size_t default_arm,
+        std::vector<Parser::JumpList>* arms) {
+    std::size_t num_cases = last - first;
+    if (num_cases < PARSER_JUMP_TABLE_MIN_CASES) {
+        // Compare with the few cases one by one.
+        for (std::size_t i = first; i < last; ++i) {
+            emit_op_with_constant(Instruction::EQRR, Instruction::EQRI, tmp,
+                    reg, cases[i].value_);
+            append_jump(&(*arms)[cases[i].arm_],
+                    Parser::JumpList(emit_conditional_jump(tmp, true)));
+        }
+        append_jump(&(*arms)[default_arm],
+                Parser::JumpList(emit_unconditional_jump()));
+        return;
+    }
+    auto min = static_cast<std::uint64_t>(cases[first].value_);
+    auto span = static_cast<std::uint64_t>(cases[last - 1].value_) - min;
+    if (span < PARSER_JUMP_TABLE_MAX_SIZE && span < 2 * num_cases) {
+        // Index the table by the offset from the smallest case, the holes and
+        // the values out of the range jump to the default arm.
+        std::uint8_t index = reg;
+        if (min != 0) {
+            emit_op_with_constant(Instruction::SUBRR, Instruction::SUBRI, tmp,
+                    reg, cases[first].value_);
+            index = tmp;
+        }
+        bytecode_.push_back(Instruction::make_ad(Instruction::JTAB, index,
+                    span + 1));
+        std::size_t next = first;
+        for (std::uint64_t offset = 0; offset <= span; ++offset) {
+            std::size_t arm = default_arm;
+            if (static_cast<std::uint64_t>(cases[next].value_) - min ==
+                    offset) {
+                arm = cases[next++].arm_;
+            }
+            append_jump(&(*arms)[arm],
+                    Parser::JumpList(emit_unconditional_jump()));
+        }
+        append_jump(&(*arms)[default_arm],
+                Parser::JumpList(emit_unconditional_jump()));
+        ++statistics_.num_jump_tables_;
+        return;
+    }
+    // Split the sparse cases in halves, each may be dense.
+    std::size_t middle = first + num_cases / 2;
+    emit_op_with_constant(Instruction::LTRR, Instruction::LTRI, tmp, reg,
+            cases[middle].value_);
+    Parser::JumpList lower(emit_conditional_jump(tmp, true));
+    emit_match_dispatch(reg, tmp, cases, middle, last, default_arm, arms);
+    patch_jump_list_to_here(lower);
+    emit_match_dispatch(reg, tmp, cases, first, middle, default_arm, arms);
+}
+
+std::int64_t Parser::parse_match_pattern() {
+    bool negative = lexer_.token() == '-';
+    if (negative) {
+        lexer_.consume_token();
+    }
+    auto value = static_cast<std::uint64_t>(lexer_.token_attribute().i64);
+    lexer_.check_and_consume_token(Lexer::INTEGER_LITERAL);
+    return static_cast<std::int64_t>(negative ? -value : value);
+}
+
+void Parser::parse_match() {
+    ASSERT_EQ(lexer_.token(), Lexer::MATCH);
+    lexer_.consume_token();
+    auto expr = parse_expr();
+    lexer_.check_and_consume_token('{');
+    // Scan the patterns, the arms are parsed after emitting the dispatch.
+    auto checkpoint = lexer_.checkpoint();
+    std::vector<Parser::MatchCase> cases;
+    std::size_t num_arms = 0;
+    std::size_t default_arm = static_cast<std::size_t>(-1);
+    while (lexer_.token() != '}') {
+        if (lexer_.token() == Lexer::WILDCARD) {
+            if (UNLIKELY(default_arm != static_cast<std::size_t>(-1))) {
+                std::fprintf(stderr,
+                        "Error in line %zu: the match has more than one '_' "
+                        "arm\n", lexer_.current_line_number());
+                std::exit(EXIT_FAILURE);
+            }
+            lexer_.consume_token();
+            default_arm = num_arms;
+        } else {
+            Parser::MatchCase match_case;
+            match_case.value_ = parse_match_pattern();
+            match_case.arm_ = num_arms;
+            cases.push_back(match_case);
+        }
+        lexer_.check_and_consume_token(Lexer::ARROW);
+        lexer_.skip_block();
+        ++num_arms;
+        if (lexer_.token() == ',') {
+            lexer_.consume_token();
+        }
+    }
+    lexer_.check_and_consume_token('}');
+    lexer_.restore(checkpoint);
+    std::sort(cases.begin(), cases.end(),
+            [](const Parser::MatchCase& lhs, const Parser::MatchCase& rhs) {
+                return lhs.value_ < rhs.value_;
+            });
+    for (std::size_t i = 1; i < cases.size(); ++i) {
+        if (UNLIKELY(cases[i - 1].value_ == cases[i].value_)) {
+            std::fprintf(stderr,
+                    "Error in line %zu: the match has more than one arm for "
+                    "%" PRId64 "\n", lexer_.current_line_number(),
+                    cases[i].value_);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    // Values without an arm jump past the match, like to an empty arm.
+    if (default_arm == static_cast<std::size_t>(-1)) {
+        default_arm = num_arms;
+    }
+    std::vector<Parser::JumpList> arms(num_arms + 1);
+    if (!expr.has_reg()) {
+        auto it = std::lower_bound(cases.begin(), cases.end(), expr.value(),
+                [](const Parser::MatchCase& match_case, std::int64_t value) {
+                    return match_case.value_ < value;
+                });
+        std::size_t arm = it != cases.end() && it->value_ == expr.value() ?
+            it->arm_ : default_arm;
+        append_jump(&arms[arm], Parser::JumpList(emit_unconditional_jump()));
+    } else {
+        std::uint8_t tmp = current_scope_->first_free_reg_++;
+        emit_match_dispatch(expr.reg(), tmp, cases, 0, cases.size(),
+                default_arm, &arms);
+        --current_scope_->first_free_reg_;
+        free_expr_reg(expr);
+    }
+    // Parse the arms, each but the last one jumps past the match.
+    Parser::JumpList escape_list;
+    for (std::size_t arm = 0; arm < num_arms; ++arm) {
+        if (lexer_.token() == Lexer::WILDCARD) {
+            lexer_.consume_token();
+        } else {
+            parse_match_pattern();
+        }
+        lexer_.check_and_consume_token(Lexer::ARROW);
+        patch_jump_list_to_here(arms[arm]);
+        parse_block();
+        if (arm + 1 < num_arms) {
+            append_jump(&escape_list,
+                    Parser::JumpList(emit_unconditional_jump()));
+        }
+        if (lexer_.token() == ',') {
+            lexer_.consume_token();
+        }
+    }
+    lexer_.check_and_consume_token('}');
+    append_jump(&escape_list, arms[num_arms]);
+    patch_jump_list_to_here(escape_list);
+}
+
+void Parser::parse_in() {
+    ASSERT_EQ(lexer_.token(), Lexer::IN);
+    lexer_.consume_token();
+    std::size_t symbol_id = lexer_.token_attribute().sz;
+    lexer_.check_and_consume_token(Lexer::IDENTIFIER);
+    std::size_t reg = find_variable_reg(symbol_id);
+    if (UNLIKELY(reg == std::numeric_limits<std::size_t>::max())) {
+        std::fprintf(stderr,
+                "Error in line %zu: the symbol '",
+                lexer_.current_line_number());
+        lexer_.print_symbol_name(symbol_id, stderr);
+        std::fputs("' doesn't exist in the current scope\n", stderr);
+        std::exit(EXIT_FAILURE);
+    }
+    if (reg < assigned_args_.size()) {
+        assigned_args_[reg] = true;
+    }
+    assigned_regs_[reg] = true;
+    emit_io(Instruction::IN, reg);
+    lexer_.check_and_consume_token(';');
+}
+
+void Parser::parse_let() {
+    ASSERT_EQ(lexer_.token(), Lexer::LET);
+    lexer_.consume_token();
+    std::size_t symbol_id = lexer_.token_attribute().sz;
+    lexer_.check_and_consume_token(Lexer::IDENTIFIER);
+    lexer_.check_and_consume_token('=');
+    auto expr = parse_expr();
+    // Is it an array of a known length?
+    bool is_array = expr.has_reg() &&
+        last_allocation_ != static_cast<std::size_t>(-1) &&
+        last_allocation_ + 1 == bytecode_.size() &&
+        bytecode_[last_allocation_].opcode() == Instruction::ANEW &&
+        bytecode_[last_allocation_].a() == expr.reg();
+    free_expr_reg(expr);
+    expr = expr_to_next_reg(expr);
+    // Add variable.
+    add_variable(symbol_id);
+    if (is_array) {
+        auto& fact = variable_facts_[expr.reg()];
+        fact.kind_ = Parser::VariableFact::ARRAY;
+        fact.bound_ = last_allocation_length_;
+    }
     ASSERT_EQ(current_scope_->first_free_reg_, current_scope_->num_variables_);
     lexer_.check_and_consume_token(';');
 }
@@ -594,41 +1584,315 @@ void Parser::parse_return() {
     lexer_.check_and_consume_token(';');
 }
 
+bool Parser::emit_closed_form_loop(std::size_t start, std::size_t exit) {
+    // An update 'var = var +/- source' in the loop body.
+    struct Update final {
+        enum Kind {
+            CONSTANT,
+            INVARIANT,
+            INDUCTION,
+        };
+
+        Kind kind_;
+        std::uint8_t var_;
+        std::uint8_t reg_;
+        // The constant for CONSTANT, the offset of the induction variable
+        // (the number of preceding increments) for INDUCTION.
+        std::int64_t value_;
+        bool subtract_;
+    };
+    std::size_t num_variables = current_scope_->num_variables_;
+    std::size_t end = bytecode_.size();
+    ASSERT_EQ(bytecode_[exit].opcode(), Instruction::JF);
+    ASSERT_EQ(bytecode_[end - 1].opcode(), Instruction::JMP);
+    // Match the condition, 'ltrr t, i, n', 'ltri t, i, $n' or
+    // 'movi/const b, $n; ltrr t, i, b'.
+    if (exit == start || exit - start > 2) {
+        return false;
+    }
+    const auto& cmp = bytecode_[exit - 1];
+    if (cmp.a() != bytecode_[exit].a() || cmp.a() < num_variables) {
+        return false;
+    }
+    std::uint8_t induction = cmp.b();
+    if (induction >= num_variables) {
+        return false;
+    }
+    bool bound_has_reg = false;
+    std::uint8_t bound_reg = 0;
+    std::int64_t bound_value = 0;
+    if (cmp.opcode() == Instruction::LTRI && exit - start == 1) {
+        bound_value = static_cast<std::int8_t>(cmp.c());
+    } else if (cmp.opcode() == Instruction::LTRR && exit - start == 1) {
+        bound_has_reg = true;
+        bound_reg = cmp.c();
+        if (bound_reg >= num_variables || bound_reg == induction) {
+            return false;
+        }
+    } else if (cmp.opcode() == Instruction::LTRR) {
+        const auto& load = bytecode_[start];
+        if (load.a() != cmp.c()) {
+            return false;
+        }
+        if (load.opcode() == Instruction::MOVI) {
+            bound_value = load.d();
+        } else if (load.opcode() == Instruction::CONST) {
+            bound_value = constants_[static_cast<std::uint16_t>(load.d())];
+        } else {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    // Match the body, every statement is 'op t, ...; movr var, t'.
+    bool written[std::numeric_limits<std::uint8_t>::max() + 1] = {};
+    std::size_t num_increments = 0;
+    std::vector<Update> updates;
+    std::size_t pos = exit + 1;
+    for (; pos + 2 <= end - 1; pos += 2) {
+        const auto& op = bytecode_[pos];
+        const auto& move = bytecode_[pos + 1];
+        if (move.opcode() != Instruction::MOVR || move.b() != op.a() ||
+                op.a() < num_variables || move.a() >= num_variables) {
+            return false;
+        }
+        std::uint8_t var = move.a();
+        if (var == induction) {
+            // Only 'i = i + 1' can modify the induction variable.
+            if (op.opcode() != Instruction::ADDRI || op.b() != induction ||
+                    static_cast<std::int8_t>(op.c()) != 1) {
+                return false;
+            }
+            ++num_increments;
+            continue;
+        }
+        Update update;
+        update.var_ = var;
+        update.subtract_ = false;
+        std::uint8_t source;
+        switch (op.opcode()) {
+        case Instruction::ADDRI:
+        case Instruction::SUBRI:
+            if (op.b() != var) {
+                return false;
+            }
+            update.kind_ = Update::CONSTANT;
+            update.value_ = static_cast<std::int8_t>(op.c());
+            update.subtract_ = op.opcode() == Instruction::SUBRI;
+            updates.push_back(update);
+            written[var] = true;
+            continue;
+        case Instruction::ADDRR:
+            if (op.b() == var) {
+                source = op.c();
+            } else if (op.c() == var) {
+                source = op.b();
+            } else {
+                return false;
+            }
+            break;
+        case Instruction::SUBRR:
+            if (op.b() != var) {
+                return false;
+            }
+            source = op.c();
+            update.subtract_ = true;
+            break;
+        default:
+            return false;
+        }
+        if (source == var || source >= num_variables) {
+            return false;
+        }
+        if (source == induction) {
+            update.kind_ = Update::INDUCTION;
+            update.value_ = num_increments;
+        } else {
+            update.kind_ = Update::INVARIANT;
+            update.reg_ = source;
+        }
+        updates.push_back(update);
+        written[var] = true;
+    }
+    if (pos != end - 1 || num_increments != 1) {
+        return false;
+    }
+    // The bound and the sources must be loop invariant.
+    if (bound_has_reg && written[bound_reg]) {
+        return false;
+    }
+    for (const auto& update : updates) {
+        if (update.kind_ == Update::INVARIANT && written[update.reg_]) {
+            return false;
+        }
+    }
+    std::size_t base = current_scope_->first_free_reg_;
+    if (base + 4 > std::numeric_limits<std::uint8_t>::max() + 1u) {
+        return false;
+    }
+    // The loop runs n - i times if i < n and leaves i = n. Adding i in the
+    // k-th iteration gives (i + k), so the total is n' * i + n' * (n' - 1) / 2
+    // for n' iterations, modulo 2^64 like the loop itself.
+    bytecode_.resize(start);
+    std::uint8_t bound = bound_has_reg ? bound_reg : base;
+    std::uint8_t cond = base + 1;
+    std::uint8_t count = base + 2;
+    std::uint8_t tmp = base + 3;
+    if (!bound_has_reg) {
+        expr_to_reg(Parser::Expression::make_value(bound_value), bound);
+    }
+    bytecode_.push_back(Instruction::make_abc(Instruction::LTRR, cond,
+                induction, bound));
+    Parser::JumpList skip(emit_conditional_jump(cond, false));
+    bytecode_.push_back(Instruction::make_abc(Instruction::SUBRR, count, bound,
+                induction));
+    for (const auto& update : updates) {
+        auto add = update.subtract_ ? Instruction::SUBRR : Instruction::ADDRR;
+        switch (update.kind_) {
+        case Update::CONSTANT:
+            bytecode_.push_back(Instruction::make_abc(Instruction::MULRI, tmp,
+                        count, static_cast<std::int8_t>(update.value_)));
+            break;
+        case Update::INVARIANT:
+            bytecode_.push_back(Instruction::make_abc(Instruction::MULRR, tmp,
+                        count, update.reg_));
+            break;
+        case Update::INDUCTION: {
+            std::uint8_t first = induction;
+            if (update.value_ != 0) {
+                bytecode_.push_back(Instruction::make_abc(Instruction::ADDRI,
+                            tmp, induction, update.value_));
+                first = tmp;
+            }
+            bytecode_.push_back(Instruction::make_abc(Instruction::MULRR, tmp,
+                        count, first));
+            bytecode_.push_back(Instruction::make_abc(add, update.var_,
+                        update.var_, tmp));
+            bytecode_.push_back(Instruction::make_abc(Instruction::TRI, tmp,
+                        count, 0));
+            break;
+        }
+        default:
+            UNREACHABLE();
+        }
+        bytecode_.push_back(Instruction::make_abc(add, update.var_,
+                    update.var_, tmp));
+    }
+    bytecode_.push_back(Instruction::make_abc(Instruction::MOVR, induction,
+                bound, 0));
+    patch_jump_list_to_here(skip);
+    ++statistics_.num_closed_form_loops_;
+    return true;
+}
+
 void Parser::parse_while() {
     ASSERT_EQ(lexer_.token(), Lexer::WHILE);
     lexer_.consume_token();
     // Save the program counter of the beginning of the conditional expression.
     std::size_t start = bytecode_.size();
     // Parse expression and emit skip jump.
-    auto expr = parse_expr();
-    expr = expr_to_any_reg(expr);
-    free_expr_reg(expr);
-    std::size_t exit = emit_conditional_jump(expr.reg(), false);
+    auto exit = parse_condition();
     // Parse the loop block.
     parse_block();
     // Jump to the start of the loop.
     patch_single_jump(emit_unconditional_jump(), start);
+    // Replace counting loops by their closed forms.
+    if (!exit.empty() && exit.head_ == exit.tail_ &&
+            bytecode_[exit.head_].opcode() == Instruction::JF &&
+            emit_closed_form_loop(start, exit.head_)) {
+        return;
+    }
     // Patch the exit jump.
     patch_jump_list_to_here(exit);
 }
 
+void Parser::parse_for() {
+    ASSERT_EQ(lexer_.token(), Lexer::FOR);
+    lexer_.consume_token();
+    std::size_t symbol_id = lexer_.token_attribute().sz;
+    lexer_.check_and_consume_token(Lexer::IDENTIFIER);
+    lexer_.check_and_consume_token(Lexer::IN);
+    // Begin the scope of the loop variables.
+    auto* old_scope = current_scope_;
+    Parser::Scope loop_scope(*old_scope);
+    current_scope_ = &loop_scope;
+    // Evaluate the index, the limit and the step to consecutive registers.
+    std::uint8_t base = current_scope_->first_free_reg_;
+    auto expr = parse_expr();
+    free_expr_reg(expr);
+    expr_to_next_reg(expr);
+    bool is_index = !expr.has_reg() && expr.value() >= 0;
+    lexer_.check_and_consume_token(Lexer::RANGE);
+    expr = parse_expr();
+    auto limit = expr;
+    is_index = is_index && (!limit.has_reg() ||
+            limit.reg() < current_scope_->num_variables_);
+    free_expr_reg(expr);
+    expr_to_next_reg(expr);
+    expr = Parser::Expression::make_value(1);
+    if (lexer_.token() == Lexer::STEP) {
+        lexer_.consume_token();
+        expr = parse_expr();
+        free_expr_reg(expr);
+    }
+    is_index = is_index && !expr.has_reg() && expr.value() > 0;
+    expr_to_next_reg(expr);
+    // Add the hidden variables and the loop variable.
+    for (std::size_t i = 0; i < 3; ++i) {
+        add_variable(std::numeric_limits<std::size_t>::max());
+    }
+    add_variable(symbol_id);
+    // A nonnegative index increasing up to the limit.
+    if (is_index) {
+        auto& fact = variable_facts_[base + 3];
+        fact.kind_ = Parser::VariableFact::INDEX;
+        fact.bound_ = limit;
+    }
+    ++current_scope_->first_free_reg_;
+    ASSERT_EQ(current_scope_->first_free_reg_, current_scope_->num_variables_);
+    // Skip the loop if there are no iterations.
+    std::size_t prep = bytecode_.size();
+    bytecode_.push_back(Instruction::make_ad(Instruction::FORPREP, base, -1));
+    parse_block();
+    std::size_t loop = bytecode_.size();
+    bytecode_.push_back(Instruction::make_ad(Instruction::FORLOOP, base, -1));
+    patch_single_jump(loop, prep + 1);
+    patch_single_jump(prep, bytecode_.size());
+    // End the scope.
+    current_scope_ = old_scope;
+}
+
 void Parser::parse_assignment_or_call() {
     // Is it an assignment or a function call?
     std::size_t symbol_id = lexer_.token_attribute().sz;
     lexer_.check_and_consume_token(Lexer::IDENTIFIER);
     std::size_t reg = find_variable_reg(symbol_id);
-    if (reg != std::numeric_limits<std::size_t>::max()) {
+    if (reg != std::numeric_limits<std::size_t>::max() &&
+            lexer_.token() == '[') {
+        // An assignment of an element, the array variable isn't assigned.
+        auto array = Parser::Expression::make_reg(reg);
+        if (reg < constant_args_.size() && constant_args_[reg]) {
+            array = Parser::Expression::make_value(*constant_args_[reg]);
+        }
+        lexer_.consume_token();
+        auto index = parse_expr();
+        lexer_.check_and_consume_token(']');
+        lexer_.check_and_consume_token('=');
+        auto expr = parse_expr();
+        emit_array_store(array, index, expr);
+    } else if (reg != std::numeric_limits<std::size_t>::max()) {
         // An assignment.
+        if (reg < assigned_args_.size()) {
+            assigned_args_[reg] = true;
+        }
+        assigned_regs_[reg] = true;
         lexer_.check_and_consume_token('=');
         auto expr = parse_expr();
         free_expr_reg(expr);
         expr_to_reg(expr, reg);
     } else {
-        // A function call.
-        std::uint8_t reg = current_scope_->first_free_reg_++;
-        std::size_t num_params = parse_parameters();
-        emit_call(symbol_id, reg, num_params);
-        --current_scope_->first_free_reg_;
+        // A call.
+        free_expr_reg(parse_call(symbol_id));
     }
     ASSERT_EQ(current_scope_->first_free_reg_, current_scope_->num_variables_);
     lexer_.check_and_consume_token(';');
@@ -639,6 +1903,9 @@ int Parser::parse_statement() {
     case '{':
         parse_block();
         return 0;
+    case Lexer::FOR:
+        parse_for();
+        return 0;
     case Lexer::IF:
         parse_if();
         return 0;
@@ -648,6 +1915,9 @@ int Parser::parse_statement() {
     case Lexer::LET:
         parse_let();
         return 0;
+    case Lexer::MATCH:
+        parse_match();
+        return 0;
     case Lexer::OUT:
         parse_out();
         return 0;
@@ -675,7 +1945,7 @@ std::size_t Parser::parse_arguments() {
         std::size_t symbol_id = lexer_.token_attribute().sz;
         lexer_.check_and_consume_token(Lexer::IDENTIFIER);
         // Add the variable.
-        variable_regs_[current_scope_->num_variables_++] = symbol_id;
+        add_variable(symbol_id);
         ++num_args;
         // Check whether there are another parameters.
         if (lexer_.token() == ')') {
@@ -697,20 +1967,7 @@ std::size_t Parser::parse_arguments() {
     return num_args;
 }
 
-void Parser::parse_fn() {
-    lexer_.check_and_consume_token(Lexer::FN);
-    // Begin a new scope.
-    Parser::Scope new_scope;
-    current_scope_ = &new_scope;
-    // Parse function name.
-    std::size_t symbol_id = lexer_.token_attribute().sz;
-    lexer_.check_and_consume_token(Lexer::IDENTIFIER);
-    // Parse arguments.
-    lexer_.check_and_consume_token('(');
-    std::size_t num_args = parse_arguments();
-    ASSERT_EQ(lexer_.token(), ')');
-    lexer_.consume_token();
-    // Register the function.
+void Parser::define_function(std::size_t symbol_id, std::size_t num_args) {
     auto pos_num_args_pair = std::make_pair(bytecode_.size(), num_args);
     bool inserted = functions_.emplace(symbol_id, pos_num_args_pair).second;
     if (UNLIKELY(!inserted)) {
@@ -720,8 +1977,41 @@ void Parser::parse_fn() {
         std::fputs("' redefined\n", stderr);
         std::exit(EXIT_FAILURE);
     }
+    if (UNLIKELY(builtins_.count(symbol_id) != 0)) {
+        std::fprintf(stderr, "Error in line %zu: function '",
+                lexer_.current_line_number());
+        lexer_.print_symbol_name(symbol_id, stderr);
+        std::fputs("' is a builtin\n", stderr);
+        std::exit(EXIT_FAILURE);
+    }
+    if (UNLIKELY(natives_.count(symbol_id) != 0)) {
+        std::fprintf(stderr, "Error in line %zu: function '",
+                lexer_.current_line_number());
+        lexer_.print_symbol_name(symbol_id, stderr);
+        std::fputs("' is a native\n", stderr);
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+void Parser::parse_function(std::size_t symbol_id) {
+    // Begin a new scope.
+    Parser::Scope new_scope;
+    current_scope_ = &new_scope;
+    // Parse arguments.
+    lexer_.check_and_consume_token('(');
+    std::size_t num_args = parse_arguments();
+    ASSERT_EQ(lexer_.token(), ')');
+    lexer_.consume_token();
+    assigned_args_.assign(num_args, false);
+    assigned_regs_.assign(std::numeric_limits<std::uint8_t>::max() + 1,
+            false);
+    last_allocation_ = static_cast<std::size_t>(-1);
+    if (!options_.lazy_) {
+        define_function(symbol_id, num_args);
+    }
     // Parse the body.
     parse_block();
+    remove_array_checks();
     // Generate return for void functions and for jump list.
     // FIXME: GCC 6.1.1 bug in complete_ctor_at_level_p
     // auto expr = Parser::Expression::make_reg(0);
@@ -731,48 +2021,1391 @@ void Parser::parse_fn() {
     current_scope_ = nullptr;
 }
 
+void Parser::parse_fn() {
+    bool exported = lexer_.token() == Lexer::EXPORT;
+    if (exported) {
+        lexer_.consume_token();
+    }
+    bool memo = lexer_.token() == Lexer::MEMO;
+    if (memo) {
+        lexer_.consume_token();
+    }
+    lexer_.check_and_consume_token(Lexer::FN);
+    // Parse function name.
+    std::size_t symbol_id = lexer_.token_attribute().sz;
+    lexer_.check_and_consume_token(Lexer::IDENTIFIER);
+    if (memo) {
+        memo_functions_.insert(symbol_id);
+    }
+    if (exported) {
+        exports_.insert(symbol_id);
+        files_.back().exports_ = true;
+    }
+    auto checkpoint = lexer_.checkpoint();
+    parse_function(symbol_id);
+    // Save the source for specializations and profiles.
+    Parser::FunctionSource source;
+    source.checkpoint_ = checkpoint;
+    source.end_ = bytecode_.size();
+    source.checksum_ = checksum(functions_[symbol_id].first, source.end_);
+    source.assigned_args_ = std::move(assigned_args_);
+    source.num_specializations_ = 0;
+    function_sources_.emplace(symbol_id, std::move(source));
+    assigned_args_.clear();
+}
+
+void Parser::parse_import() {
+    ASSERT_EQ(lexer_.token(), Lexer::IMPORT);
+    lexer_.consume_token();
+    std::size_t symbol_id = lexer_.token_attribute().sz;
+    lexer_.check_and_consume_token(Lexer::STRING_LITERAL);
+    imports_.push_back(resolve_import(file_, lexer_.symbol_name(symbol_id)));
+    lexer_.check_and_consume_token(';');
+}
+
+void Parser::parse_declaration() {
+    if (lexer_.token() == Lexer::IMPORT) {
+        parse_import();
+    } else {
+        parse_fn();
+    }
+}
+
+std::size_t Parser::parse_specialization(std::size_t symbol_id,
+        const Parser::ConstantArguments& args) {
+    // Name the specialization after the function and the constants, e.g.
+    // 'f(1,_)'.
+    std::string name(lexer_.symbol_name(symbol_id));
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        name += i == 0 ? '(' : ',';
+        name += args[i] ? std::to_string(*args[i]) : "_";
+    }
+    name += ')';
+    specialization_names_.push_back(std::move(name));
+    const auto& stored_name = specialization_names_.back();
+    std::size_t specialization_id = lexer_.find_or_insert_symbol(
+            std::experimental::string_view(stored_name.data(),
+                stored_name.size()));
+    if (memo_functions_.count(symbol_id) != 0) {
+        memo_functions_.insert(specialization_id);
+    }
+    // Parse the function again.
+    auto checkpoint = lexer_.checkpoint();
+    lexer_.restore(function_sources_[symbol_id].checkpoint_);
+    constant_args_ = args;
+    parse_function(specialization_id);
+    constant_args_.clear();
+    assigned_args_.clear();
+    lexer_.restore(checkpoint);
+    return specialization_id;
+}
+
+void Parser::specialize_calls(std::vector<bool>* dead) {
+    const auto none = static_cast<std::size_t>(-1);
+    std::size_t num_specializations = 0;
+    // With a profile, the hottest calls are specialized first and calls that
+    // were never executed aren't specialized.
+    if (options_.profile_ != nullptr) {
+        std::stable_sort(call_sites_.begin(), call_sites_.end(),
+                [this](const Parser::CallSite& lhs,
+                    const Parser::CallSite& rhs) {
+                    auto lhs_count = profile_count(lhs.call_);
+                    auto rhs_count = profile_count(rhs.call_);
+                    return (lhs_count ? lhs_count->executed_ : 0) >
+                        (rhs_count ? rhs_count->executed_ : 0);
+                });
+    }
+    // Specializations append their calls, so they are specialized as well.
+    for (std::size_t i = 0; i < call_sites_.size(); ++i) {
+        const auto site = call_sites_[i];
+        auto count = profile_count(site.call_);
+        if (count && count->executed_ == 0) {
+            continue;
+        }
+        std::size_t symbol_id = call_operand(site.call_);
+        auto source = function_sources_.find(symbol_id);
+        // Undefined functions and wrong numbers of arguments are reported by
+        // the second pass.
+        if (source == function_sources_.end() ||
+                source->second.assigned_args_.size() != site.num_args_) {
+            continue;
+        }
+        // Only arguments that are never assigned can be replaced.
+        const auto& assigned_args = source->second.assigned_args_;
+        Parser::ConstantArguments args(site.num_args_);
+        // Calls with only constant arguments are rather folded. The ones
+        // that can't be are mostly recursive computations varying in the
+        // last argument, so it isn't replaced to share the specialization.
+        bool all_constant = std::all_of(call_args_.begin() + site.first_arg_,
+                call_args_.begin() + site.first_arg_ + site.num_args_,
+                [](const Parser::CallArgument& arg) {
+                    return arg.load_ != static_cast<std::size_t>(-1);
+                });
+        std::size_t num_candidates = all_constant ? site.num_args_ - 1
+            : site.num_args_;
+        bool constant = false;
+        for (std::size_t k = 0; k < num_candidates; ++k) {
+            const auto& arg = call_args_[site.first_arg_ + k];
+            if (arg.load_ != none && !assigned_args[k]) {
+                args[k] = arg.value_;
+                constant = true;
+            }
+        }
+        if (!constant) {
+            continue;
+        }
+        auto key = std::make_pair(symbol_id, std::move(args));
+        auto it = specializations_.find(key);
+        if (it == specializations_.end()) {
+            if (num_specializations == PARSER_MAX_SPECIALIZATIONS ||
+                    source->second.num_specializations_ ==
+                        PARSER_MAX_SPECIALIZATIONS_PER_FUNCTION) {
+                continue;
+            }
+            ++source->second.num_specializations_;
+            ++num_specializations;
+            std::size_t specialization_id = parse_specialization(symbol_id,
+                    key.second);
+            it = specializations_.emplace(std::move(key),
+                    specialization_id).first;
+        }
+        set_call_operand(site.call_, it->second);
+        // Calls with only constant arguments keep their loads, so that they
+        // can be still folded.
+        if (all_constant) {
+            continue;
+        }
+        dead->resize(bytecode_.size());
+        const auto& constant_args = it->first.second;
+        for (std::size_t k = 0; k < site.num_args_; ++k) {
+            if (constant_args[k]) {
+                (*dead)[call_args_[site.first_arg_ + k].load_] = true;
+            }
+        }
+    }
+    statistics_.num_specializations_ += num_specializations;
+}
+
+void Parser::write_unit(const char* source, std::vector<char>* unit) const {
+    put(unit, lexer_.num_symbols());
+    for (std::size_t i = 0; i < lexer_.num_symbols(); ++i) {
+        put_string(unit, lexer_.symbol_name(Lexer::FIRST_SYMBOL_ID + i));
+    }
+    put_vector(unit, bytecode_);
+    put_vector(unit, constants_);
+    std::vector<std::size_t> magics;
+    for (const auto& it : division_magics_) {
+        magics.push_back(it.second);
+    }
+    std::sort(magics.begin(), magics.end());
+    put_vector(unit, magics);
+    put(unit, max_division_query_);
+    // The functions are put in the order of the source, their positions in
+    // the source are stored as offsets.
+    std::vector<std::pair<std::size_t, std::size_t>> functions;
+    for (const auto& it : functions_) {
+        functions.emplace_back(it.second.first, it.first);
+    }
+    std::sort(functions.begin(), functions.end());
+    put(unit, functions.size());
+    for (const auto& function : functions) {
+        std::size_t symbol_id = function.second;
+        const auto& checkpoint = function_sources_.at(symbol_id).checkpoint_;
+        put(unit, symbol_id);
+        put(unit, function.first);
+        put(unit, functions_.at(symbol_id).second);
+        put(unit, memo_functions_.count(symbol_id) != 0);
+        put(unit, checkpoint.current_ - source);
+        put(unit, checkpoint.current_line_number_);
+        put(unit, checkpoint.token_);
+        put(unit, checkpoint.last_);
+        put(unit, function_sources_.at(symbol_id).end_);
+        const auto& assigned_args =
+            function_sources_.at(symbol_id).assigned_args_;
+        put_vector(unit, std::vector<char>(assigned_args.begin(),
+                    assigned_args.end()));
+    }
+    put_vector(unit, call_sites_);
+    put_vector(unit, call_args_);
+    put(unit, statistics_.num_closed_form_loops_);
+    put(unit, statistics_.num_jump_tables_);
+    put(unit, statistics_.num_unchecked_accesses_);
+    put(unit, imports_.size());
+    for (const auto& path : imports_) {
+        put_string(unit, path);
+    }
+    put(unit, files_.back().exports_);
+    std::vector<std::size_t> exports(exports_.begin(), exports_.end());
+    std::sort(exports.begin(), exports.end());
+    put_vector(unit, exports);
+}
+
+bool Parser::compile_chunk(const char* source, std::size_t num_functions,
+        int fd) {
+    lexer_.consume_token();
+    auto initial = lexer_.checkpoint();
+    for (std::size_t i = 0; i < num_functions; ++i) {
+        while (lexer_.token() == Lexer::IMPORT) {
+            parse_import();
+        }
+        if (lexer_.token() != Lexer::FN && lexer_.token() != Lexer::MEMO &&
+                lexer_.token() != Lexer::EXPORT) {
+            return false;
+        }
+        parse_fn();
+    }
+    std::vector<char> chunk;
+    put(&chunk, initial);
+    put(&chunk, lexer_.checkpoint());
+    write_unit(source, &chunk);
+    return write_all(fd, chunk.data(), chunk.size());
+}
+
+std::size_t Parser::append_code(const std::vector<Instruction>& bytecode,
+        const std::vector<std::int64_t>& constants,
+        const std::vector<std::size_t>& magics,
+        const std::vector<std::size_t>& symbol_ids) {
+    // Append the constants, magic numbers of known divisors are shared.
+    std::vector<std::size_t> constant_indices(constants.size());
+    auto magic = magics.begin();
+    for (std::size_t i = 0; i < constants.size();) {
+        if (magic == magics.end() || *magic != i) {
+            constant_indices[i++] = constants_.size();
+            constants_.push_back(constants[i - 1]);
+            continue;
+        }
+        ++magic;
+        auto it = division_magics_.find(constants[i + 2]);
+        if (it == division_magics_.end()) {
+            it = division_magics_.emplace(constants[i + 2],
+                    constants_.size()).first;
+            constants_.insert(constants_.end(), constants.begin() + i,
+                    constants.begin() + i + 3);
+        }
+        constant_indices[i] = it->second;
+        i += 3;
+    }
+    // Append the bytecode.
+    std::size_t offset = bytecode_.size();
+    for (std::size_t pos = 0; pos < bytecode.size(); ++pos) {
+        auto instruction = bytecode[pos];
+        switch (instruction.opcode()) {
+        case Instruction::CONST:
+            instruction.set_d(constant_indices[
+                    static_cast<std::uint16_t>(instruction.d())]);
+            break;
+        case Instruction::DIVMAGIC:
+        case Instruction::MODMAGIC:
+            instruction.set_c(constant_indices[instruction.c()]);
+            break;
+        default:
+            break;
+        }
+        bytecode_.push_back(instruction);
+        if (instruction.opcode() == Instruction::CALL) {
+            std::size_t call = bytecode_.size() - 1;
+            set_call_operand(call, symbol_ids[call_operand(call) -
+                    Lexer::FIRST_SYMBOL_ID]);
+        }
+    }
+    return offset;
+}
+
+bool Parser::link_unit(std::experimental::string_view unit,
+        const char* source, bool exact, std::vector<std::size_t>* symbol_ids) {
+    ChunkReader reader(unit);
+    // Symbols are inserted in the order the serial lexer would meet them.
+    // If the unit is compiled serially after all, it inserts them again in
+    // the same order. The names point to the unit, which outlives the lexer.
+    symbol_ids->resize(reader.get<std::size_t>());
+    for (auto& symbol_id : *symbol_ids) {
+        symbol_id = lexer_.find_or_insert_symbol(reader.get_string());
+    }
+    auto global_id = [symbol_ids](std::size_t symbol_id) {
+        return (*symbol_ids)[symbol_id - Lexer::FIRST_SYMBOL_ID];
+    };
+    auto bytecode = reader.get_vector<Instruction>();
+    for (std::size_t pos = 0; exact && pos < bytecode.size(); ++pos) {
+        if (bytecode[pos].opcode() != Instruction::CALL) {
+            continue;
+        }
+        // Symbol ids which don't fit MOVI are loaded by CONST.
+        ASSERT_GT(pos, 0);
+        if (bytecode[pos - 1].opcode() != Instruction::MOVI ||
+                global_id(bytecode[pos - 1].d()) >
+                    static_cast<std::size_t>(
+                        std::numeric_limits<std::int16_t>::max())) {
+            return false;
+        }
+    }
+    auto constants = reader.get_vector<std::int64_t>();
+    auto magics = reader.get_vector<std::size_t>();
+    // Divisions by new divisors must be decided as if the constants of the
+    // preceding functions were present.
+    auto max_division_query = reader.get<std::size_t>();
+    if (exact && ((max_division_query != 0 &&
+                    constants_.size() + max_division_query >
+                        std::numeric_limits<std::uint8_t>::max() + 1) ||
+                constants_.size() + constants.size() >
+                    std::numeric_limits<std::uint16_t>::max() + 1)) {
+        return false;
+    }
+    // The magic numbers of new divisors must be addressable by the 'c'
+    // operand.
+    std::size_t num_constants = constants_.size();
+    auto magic = magics.begin();
+    for (std::size_t i = 0; i < constants.size();) {
+        if (magic == magics.end() || *magic != i) {
+            ++num_constants;
+            ++i;
+            continue;
+        }
+        ++magic;
+        if (division_magics_.count(constants[i + 2]) == 0) {
+            num_constants += 3;
+            if (num_constants > std::numeric_limits<std::uint8_t>::max() + 1) {
+                return false;
+            }
+        }
+        i += 3;
+    }
+    if (num_constants > std::numeric_limits<std::uint16_t>::max() + 1) {
+        return false;
+    }
+    // Redefinitions are reported by parsing the source.
+    auto functions_reader = reader;
+    std::size_t num_functions = reader.get<std::size_t>();
+    for (std::size_t i = 0; i < num_functions; ++i) {
+        std::size_t symbol_id = global_id(reader.get<std::size_t>());
+        if (functions_.count(symbol_id) != 0 ||
+                builtins_.count(symbol_id) != 0 ||
+                natives_.count(symbol_id) != 0) {
+            return false;
+        }
+        reader.get<std::size_t>();
+        reader.get<std::size_t>();
+        reader.get<bool>();
+        reader.get<std::ptrdiff_t>();
+        reader.get<std::size_t>();
+        reader.get<int>();
+        reader.get<char>();
+        reader.get<std::size_t>();
+        reader.get_vector<char>();
+    }
+    std::size_t offset = append_code(bytecode, constants, magics,
+            *symbol_ids);
+    // Register the functions.
+    for (std::size_t i = functions_reader.get<std::size_t>(); i != 0; --i) {
+        std::size_t symbol_id = global_id(functions_reader.get<std::size_t>());
+        std::size_t begin = offset + functions_reader.get<std::size_t>();
+        std::size_t num_args = functions_reader.get<std::size_t>();
+        if (functions_reader.get<bool>()) {
+            memo_functions_.insert(symbol_id);
+        }
+        functions_.emplace(symbol_id, std::make_pair(begin, num_args));
+        Parser::FunctionSource function;
+        function.checkpoint_.current_ = source +
+            functions_reader.get<std::ptrdiff_t>();
+        function.checkpoint_.current_line_number_ =
+            functions_reader.get<std::size_t>();
+        // The attribute is left from the name of the function.
+        function.checkpoint_.token_attribute_.sz = symbol_id;
+        function.checkpoint_.token_ = functions_reader.get<int>();
+        function.checkpoint_.last_ = functions_reader.get<char>();
+        function.end_ = offset + functions_reader.get<std::size_t>();
+        function.checksum_ = checksum(begin, function.end_);
+        auto assigned_args = functions_reader.get_vector<char>();
+        function.assigned_args_.assign(assigned_args.begin(),
+                assigned_args.end());
+        function.num_specializations_ = 0;
+        function_sources_.emplace(symbol_id, std::move(function));
+    }
+    // Append the calls with constant arguments.
+    std::size_t first_arg = call_args_.size();
+    for (auto site : reader.get_vector<Parser::CallSite>()) {
+        site.call_ += offset;
+        site.first_arg_ += first_arg;
+        call_sites_.push_back(site);
+    }
+    for (auto arg : reader.get_vector<Parser::CallArgument>()) {
+        if (arg.load_ != static_cast<std::size_t>(-1)) {
+            arg.load_ += offset;
+        }
+        call_args_.push_back(arg);
+    }
+    statistics_.num_closed_form_loops_ += reader.get<std::size_t>();
+    statistics_.num_jump_tables_ += reader.get<std::size_t>();
+    statistics_.num_unchecked_accesses_ += reader.get<std::size_t>();
+    for (std::size_t i = reader.get<std::size_t>(); i != 0; --i) {
+        auto path = reader.get_string();
+        imports_.emplace_back(path.data(), path.size());
+    }
+    if (reader.get<bool>()) {
+        files_.back().exports_ = true;
+    }
+    for (auto symbol_id : reader.get_vector<std::size_t>()) {
+        exports_.insert(global_id(symbol_id));
+    }
+    return true;
+}
+
+bool Parser::merge_chunk(const std::vector<char>& chunk, const char* source,
+        Lexer::Checkpoint* expected) {
+    ChunkReader reader(chunk);
+    auto initial = reader.get<Lexer::Checkpoint>();
+    auto past = reader.get<Lexer::Checkpoint>();
+    if (initial.current_ != expected->current_ ||
+            initial.current_line_number_ != expected->current_line_number_ ||
+            initial.token_ != expected->token_ ||
+            initial.last_ != expected->last_) {
+        return false;
+    }
+    std::vector<std::size_t> symbol_ids;
+    if (!link_unit(reader.rest(), source, true, &symbol_ids)) {
+        return false;
+    }
+    *expected = past;
+    if (past.token_ == Lexer::IDENTIFIER) {
+        expected->token_attribute_.sz =
+            symbol_ids[past.token_attribute_.sz - Lexer::FIRST_SYMBOL_ID];
+    }
+    return true;
+}
+
+#if defined(PARSER_WORKER_PROCESSES)
+void Parser::compile_in_parallel(const char* source,
+        std::size_t line_number) {
+    auto ends = find_function_ends(source, line_number);
+    if (ends.empty()) {
+        return;
+    }
+    std::size_t size = ends.back().position_ - source;
+    std::size_t num_jobs = std::min(options_.num_jobs_,
+            size / PARSER_MIN_JOB_SIZE);
+    if (num_jobs < 2) {
+        return;
+    }
+    // Split the functions into parts of similar sizes.
+    std::vector<std::size_t> parts(1, 0);
+    for (std::size_t i = 1; i < num_jobs; ++i) {
+        const char* target = source + size / num_jobs * i;
+        std::size_t last = std::lower_bound(ends.begin(), ends.end(), target,
+                [](const FunctionEnd& end, const char* position) {
+                    return end.position_ < position;
+                }) - ends.begin() + 1;
+        if (last > parts.back() && last < ends.size()) {
+            parts.push_back(last);
+        }
+    }
+    parts.push_back(ends.size());
+    // Fork the workers. Their errors are discarded, a part which fails is
+    // compiled again serially, which reports them once.
+    std::fflush(nullptr);
+    std::vector<std::pair<pid_t, int>> workers;
+    for (std::size_t i = 0; i + 1 < parts.size(); ++i) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0) {
+                dup2(null_fd, STDERR_FILENO);
+            }
+            const char* begin = i == 0 ? source : ends[parts[i] - 1].position_;
+            std::size_t begin_line_number = i == 0 ? line_number
+                : ends[parts[i] - 1].line_number_;
+            Parser worker(Lexer(begin, begin_line_number), options_);
+            bool compiled = worker.compile_chunk(source,
+                    parts[i + 1] - parts[i], fds[1]);
+            std::_Exit(compiled ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        close(fds[1]);
+        if (pid < 0) {
+            close(fds[0]);
+            break;
+        }
+        workers.emplace_back(pid, fds[0]);
+    }
+    // Merge the chunks in order.
+    auto expected = lexer_.checkpoint();
+    bool merging = true;
+    for (const auto& worker : workers) {
+        worker_chunks_.emplace_back();
+        auto& chunk = worker_chunks_.back();
+        bool received = read_all(worker.second, &chunk);
+        close(worker.second);
+        int status;
+        pid_t pid;
+        do {
+            pid = waitpid(worker.first, &status, 0);
+        } while (pid < 0 && errno == EINTR);
+        merging = merging && received && pid == worker.first &&
+            WIFEXITED(status) &&
+            WEXITSTATUS(status) == EXIT_SUCCESS &&
+            merge_chunk(chunk, source, &expected);
+    }
+    lexer_.restore(expected);
+}
+#endif
+
+void Parser::scan_functions() {
+    lexer_.consume_token();
+    while (lexer_.token() != 0) {
+        if (lexer_.token() == Lexer::IMPORT) {
+            parse_import();
+            continue;
+        }
+        bool exported = lexer_.token() == Lexer::EXPORT;
+        if (exported) {
+            lexer_.consume_token();
+        }
+        bool memo = lexer_.token() == Lexer::MEMO;
+        if (memo) {
+            lexer_.consume_token();
+        }
+        lexer_.check_and_consume_token(Lexer::FN);
+        std::size_t symbol_id = lexer_.token_attribute().sz;
+        lexer_.check_and_consume_token(Lexer::IDENTIFIER);
+        // Reported after linking, together with the memo functions of the
+        // modules.
+        if (memo) {
+            memo_functions_.insert(symbol_id);
+        }
+        if (exported) {
+            exports_.insert(symbol_id);
+            files_.back().exports_ = true;
+        }
+        Parser::FunctionSource source;
+        source.checkpoint_ = lexer_.checkpoint();
+        source.end_ = 0;
+        source.checksum_ = 0;
+        source.num_specializations_ = 0;
+        function_sources_.emplace(symbol_id, std::move(source));
+        // Parse the arguments only to count them.
+        Parser::Scope scope;
+        current_scope_ = &scope;
+        lexer_.check_and_consume_token('(');
+        std::size_t num_args = parse_arguments();
+        ASSERT_EQ(lexer_.token(), ')');
+        lexer_.consume_token();
+        current_scope_ = nullptr;
+        define_function(symbol_id, num_args);
+        Parser::LazyFunction function;
+        function.symbol_id_ = symbol_id;
+        function.code_ = nullptr;
+        lazy_functions_.resize(bytecode_.size());
+        lazy_functions_.push_back(function);
+        bytecode_.push_back(Instruction::make_abc(Instruction::LAZY, 0, 0, 0));
+        lexer_.skip_block();
+    }
+}
+
 void Parser::first_pass() {
+#if defined(PARSER_WORKER_PROCESSES)
+    const char* source = lexer_.position();
+    std::size_t line_number = lexer_.current_line_number();
+    lexer_.consume_token();
+    if (options_.num_jobs_ > 1) {
+        compile_in_parallel(source, line_number);
+    }
+#else
     lexer_.consume_token();
+#endif
     while (lexer_.token() != 0) {
-        parse_fn();
+        parse_declaration();
+    }
+}
+
+void Parser::compile_module(const char* source, std::vector<char>* module) {
+    first_pass();
+    write_unit(source, module);
+}
+
+bool Parser::merge_module(const std::vector<char>& module,
+        const char* source) {
+    std::vector<std::size_t> symbol_ids;
+    return link_unit(std::experimental::string_view(module.data(),
+                module.size()), source, false, &symbol_ids);
+}
+
+void Parser::link_modules() {
+    // The program can't be linked again by its modules.
+    if (char* path = realpath(file_.c_str(), nullptr)) {
+        modules_.emplace(path);
+        std::free(path);
+    }
+    for (std::size_t i = 0; i < imports_.size(); ++i) {
+        std::string path = imports_[i];
+        char* canonical_path = realpath(path.c_str(), nullptr);
+        std::experimental::optional<SourceFile> source;
+        if (canonical_path != nullptr) {
+            source = SourceFile::open(canonical_path);
+        }
+        if (UNLIKELY(!source)) {
+            std::fprintf(stderr, "Error: couldn't import the '%s' module\n",
+                    path.c_str());
+            std::exit(EXIT_FAILURE);
+        }
+        std::string name(canonical_path);
+        std::free(canonical_path);
+        if (!modules_.insert(name).second) {
+            continue;
+        }
+        Parser::File file;
+        file.name_ = name;
+        file.begin_ = bytecode_.size();
+        file.exports_ = false;
+        files_.push_back(std::move(file));
+        module_sources_.push_back(std::move(*source));
+        const char* data = module_sources_.back().data();
+        std::experimental::string_view contents(data,
+                module_sources_.back().size());
+        // Load the module or compile it by another parser.
+        const auto* cache = options_.module_cache_;
+        std::uint64_t key = 0;
+        std::experimental::optional<std::vector<char>> module;
+        if (cache != nullptr) {
+            key = cache->key(name, contents, options_.native_functions_);
+            module = cache->read(key);
+        }
+        if (module) {
+            ++statistics_.num_cached_modules_;
+        } else {
+            Parser::Options options = options_;
+            options.lazy_ = false;
+            options.filename_ = name.c_str();
+            Parser parser(Lexer(data), options);
+            module.emplace();
+            parser.compile_module(data, &*module);
+            ++statistics_.num_compiled_modules_;
+            // The module is only recompiled if it can't be cached.
+            if (cache != nullptr) {
+                cache->write(key, *module);
+            }
+        }
+        module_contents_.push_back(std::move(*module));
+        if (merge_module(module_contents_.back(), data)) {
+            continue;
+        }
+        // Parse the module like the program, errors are reported then.
+        file_ = name;
+        lexer_.reset(data);
+        if (options_.lazy_) {
+            scan_functions();
+        } else {
+            lexer_.consume_token();
+            while (lexer_.token() != 0) {
+                parse_declaration();
+            }
+        }
+    }
+    imports_.clear();
+    check_exports();
+}
+
+std::size_t Parser::find_callee(std::size_t pos) const {
+    std::size_t symbol_id = call_operand(pos);
+    auto it = functions_.find(symbol_id);
+    if (UNLIKELY(it == functions_.end())) {
+        std::fputs("Error: function '", stderr);
+        lexer_.print_symbol_name(symbol_id, stderr);
+        std::fputs("' undefined\n", stderr);
+        std::exit(EXIT_FAILURE);
+    }
+    // Check the number of arguments.
+    std::size_t num_required_args = it->second.second;
+    std::size_t num_given_args = bytecode_[pos].b();
+    if (UNLIKELY(num_required_args != num_given_args)) {
+        std::fputs("Error: function '", stderr);
+        lexer_.print_symbol_name(symbol_id, stderr);
+        std::fprintf(stderr, "' requires %zu arguments, but %zu given\n",
+                num_required_args, num_given_args);
+        std::exit(EXIT_FAILURE);
+    }
+    return it->second.first;
+}
+
+std::size_t Parser::find_file(std::size_t pos) const {
+    auto it = std::upper_bound(files_.begin(), files_.end(), pos,
+            [](std::size_t pos, const Parser::File& file) {
+                return pos < file.begin_;
+            });
+    return it - files_.begin() - 1;
+}
+
+void Parser::check_exported(std::size_t pos, std::size_t symbol_id) const {
+    auto it = functions_.find(symbol_id);
+    if (it == functions_.end() || exports_.count(symbol_id) != 0) {
+        return;
+    }
+    std::size_t file = find_file(it->second.first);
+    if (UNLIKELY(files_[file].exports_ && find_file(pos) != file)) {
+        std::fputs("Error: function '", stderr);
+        lexer_.print_symbol_name(symbol_id, stderr);
+        std::fprintf(stderr, "' isn't exported by '%s'\n",
+                files_[file].name_.c_str());
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+void Parser::check_exports() const {
+    for (std::size_t i = 0; i < bytecode_.size(); ++i) {
+        if (bytecode_[i].opcode() == Instruction::CALL) {
+            check_exported(i, call_operand(i));
+        }
     }
 }
 
 void Parser::second_pass() {
     // Patch function calls.
     for (std::size_t i = 0; i < bytecode_.size(); ++i) {
-        auto call_instruction = bytecode_[i];
-        if (LIKELY(call_instruction.opcode() != Instruction::CALL)) {
+        if (LIKELY(bytecode_[i].opcode() != Instruction::CALL)) {
             continue;
         }
-        // There must be const instruction with symbol id.
-        ASSERT_GT(i, 0);
-        auto const_instruction = bytecode_[i - 1];
-        ASSERT_EQ(const_instruction.opcode(), Instruction::MOVI);
-        // Find the function.
-        std::size_t symbol_id = const_instruction.d();
-        auto it = functions_.find(symbol_id);
-        if (UNLIKELY(it == functions_.end())) {
-            std::fputs("Error: function '", stderr);
-            lexer_.print_symbol_name(symbol_id, stderr);
-            std::fputs("' undefined\n", stderr);
-            std::exit(EXIT_FAILURE);
+        // Patch the load of the symbol id to the offset of the function.
+        std::size_t pos = find_callee(i);
+        set_call_operand(i, pos - i - 1);
+    }
+}
+
+std::int64_t Parser::call_operand(std::size_t pos) const {
+    ASSERT(bytecode_[pos].is_call());
+    ASSERT_GT(pos, 0);
+    const auto& load = bytecode_[pos - 1];
+    if (load.opcode() == Instruction::CONST) {
+        return constants_[static_cast<std::uint16_t>(load.d())];
+    }
+    ASSERT_EQ(load.opcode(), Instruction::MOVI);
+    return load.d();
+}
+
+Instruction Parser::load_call_operand(Instruction load, std::int64_t value) {
+    if (load.opcode() == Instruction::CONST) {
+        constants_[static_cast<std::uint16_t>(load.d())] = value;
+        return load;
+    }
+    ASSERT_EQ(load.opcode(), Instruction::MOVI);
+    if (value < std::numeric_limits<std::int16_t>::min() ||
+            value > std::numeric_limits<std::int16_t>::max()) {
+        return Instruction::make_ad(Instruction::CONST, load.a(),
+                add_constant(value));
+    }
+    load.set_d(value);
+    return load;
+}
+
+void Parser::set_call_operand(std::size_t pos, std::int64_t value) {
+    ASSERT(bytecode_[pos].is_call());
+    ASSERT_GT(pos, 0);
+    bytecode_[pos - 1] = load_call_operand(bytecode_[pos - 1], value);
+}
+
+std::size_t Parser::call_target(std::size_t pos) const {
+    return pos + 1 + call_operand(pos);
+}
+
+Parser::Relocation Parser::relocation(std::size_t pos) const {
+    Parser::Relocation relocation;
+    relocation.instruction_ = bytecode_[pos];
+    relocation.origin_ = pos;
+    relocation.target_ = static_cast<std::size_t>(-1);
+    if (relocation.instruction_.is_jump()) {
+        relocation.target_ = pos + 1 + relocation.instruction_.d();
+    } else if ((relocation.instruction_.opcode() == Instruction::MOVI ||
+                relocation.instruction_.opcode() == Instruction::CONST) &&
+            pos + 1 < bytecode_.size() && bytecode_[pos + 1].is_call()) {
+        // The call offset always directly precedes the call.
+        relocation.target_ = call_target(pos + 1);
+    }
+    return relocation;
+}
+
+void Parser::relocate(const std::vector<Parser::Relocation>& code) {
+    const auto none = static_cast<std::size_t>(-1);
+    // Map old positions to the new ones. Removed instructions are mapped to
+    // the next instruction.
+    std::size_t old_size = bytecode_.size();
+    std::vector<std::size_t> new_pos(old_size + 1, none);
+    for (std::size_t i = 0; i < code.size(); ++i) {
+        std::size_t origin = code[i].origin_;
+        if (origin != none && new_pos[origin] == none) {
+            new_pos[origin] = i;
         }
-        // Check the number of arguments.
-        std::size_t num_required_args = it->second.second;
-        std::size_t num_given_args = call_instruction.b();
-        if (UNLIKELY(num_required_args != num_given_args)) {
-            std::fputs("Error: function '", stderr);
-            lexer_.print_symbol_name(symbol_id, stderr);
-            std::fprintf(stderr, "' requires %zu arguments, but %zu given\n",
-                    num_required_args, num_given_args);
-            std::exit(EXIT_FAILURE);
+    }
+    if (new_pos[old_size] == none) {
+        new_pos[old_size] = code.size();
+    }
+    for (std::size_t i = old_size; i-- != 0;) {
+        if (new_pos[i] == none) {
+            new_pos[i] = new_pos[i + 1];
         }
-        // Patch the const instruction for call.
-        std::size_t pos = it->second.first;
-        std::size_t offset = pos - i - 1;
-        bytecode_[i - 1].set_d(offset);
     }
+    // Track the positions in the first pass.
+    if (!sources_.empty()) {
+        std::vector<std::size_t> sources(code.size(), none);
+        for (std::size_t i = 0; i < code.size(); ++i) {
+            std::size_t origin = code[i].origin_;
+            if (origin != none && origin < sources_.size()) {
+                sources[i] = sources_[origin];
+            }
+        }
+        sources_ = std::move(sources);
+    }
+    // Emit the new bytecode and patch jumps and calls.
+    bytecode_.clear();
+    bytecode_.reserve(code.size());
+    for (std::size_t i = 0; i < code.size(); ++i) {
+        auto instruction = code[i].instruction_;
+        if (code[i].target_ != none) {
+            std::size_t target = new_pos[code[i].target_];
+            if (instruction.is_jump()) {
+                auto offset = static_cast<std::int64_t>(target - (i + 1));
+                ASSERT_GE(offset, std::numeric_limits<std::int16_t>::min());
+                ASSERT_LE(offset, std::numeric_limits<std::int16_t>::max());
+                instruction.set_d(offset);
+            } else {
+                // Call offsets are relative to the call instruction.
+                instruction = load_call_operand(instruction, target - (i + 2));
+            }
+        }
+        bytecode_.push_back(instruction);
+    }
+    for (auto& function : functions_) {
+        function.second.first = new_pos[function.second.first];
+    }
+}
+
+void Parser::remove_dead_instructions(const std::vector<bool>& dead) {
+    std::vector<Parser::Relocation> code;
+    code.reserve(bytecode_.size());
+    for (std::size_t i = 0; i < bytecode_.size(); ++i) {
+        if (dead[i]) {
+            continue;
+        }
+        auto instruction = relocation(i);
+        // A load of the offset of a removed call is a plain load.
+        if (i + 1 < bytecode_.size() && dead[i + 1] &&
+                bytecode_[i + 1].is_call()) {
+            instruction.target_ = static_cast<std::size_t>(-1);
+        }
+        code.push_back(instruction);
+    }
+    relocate(code);
+}
+
+std::vector<Parser::Function> Parser::function_table() const {
+    std::vector<Parser::Function> table;
+    table.reserve(functions_.size());
+    for (const auto& it : functions_) {
+        Parser::Function function;
+        function.symbol_id_ = it.first;
+        function.begin_ = it.second.first;
+        function.end_ = 0;
+        function.num_args_ = it.second.second;
+        function.pure_ = true;
+        function.recursive_ = false;
+        table.push_back(function);
+    }
+    std::sort(table.begin(), table.end(),
+            [](const Parser::Function& lhs, const Parser::Function& rhs) {
+                return lhs.begin_ < rhs.begin_;
+            });
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        table[i].end_ = i + 1 < table.size() ? table[i + 1].begin_
+            : bytecode_.size();
+    }
+    // Mark functions with I/O or arrays as impure and propagate it to their
+    // callers.
+    std::vector<std::vector<std::size_t>> callers(table.size());
+    std::vector<std::size_t> worklist;
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        for (std::size_t pos = table[i].begin_; pos < table[i].end_; ++pos) {
+            switch (bytecode_[pos].opcode()) {
+            case Instruction::CALL:
+            case Instruction::CALLM: {
+                std::size_t callee = find_function(table, call_target(pos));
+                callers[callee].push_back(i);
+                if (callee == i) {
+                    table[i].recursive_ = true;
+                }
+                break;
+            }
+            case Instruction::ANEW:
+            case Instruction::ALOAD:
+            case Instruction::ALOADU:
+            case Instruction::ASTORE:
+            case Instruction::ASTOREU:
+            case Instruction::CALLN:
+            case Instruction::EXIT:
+            case Instruction::IN:
+            case Instruction::OUT:
+                table[i].pure_ = false;
+                break;
+            default:
+                break;
+            }
+        }
+        if (!table[i].pure_) {
+            worklist.push_back(i);
+        }
+    }
+    while (!worklist.empty()) {
+        std::size_t callee = worklist.back();
+        worklist.pop_back();
+        for (std::size_t caller : callers[callee]) {
+            if (table[caller].pure_) {
+                table[caller].pure_ = false;
+                worklist.push_back(caller);
+            }
+        }
+    }
+    return table;
+}
+
+std::size_t Parser::find_function(const std::vector<Parser::Function>& table,
+        std::size_t pos) {
+    auto it = std::upper_bound(table.begin(), table.end(), pos,
+            [](std::size_t pos, const Parser::Function& function) {
+                return pos < function.begin_;
+            });
+    ASSERT(it != table.begin());
+    return it - table.begin() - 1;
+}
+
+void Parser::fold_constant_calls() {
+    const auto table = function_table();
+    // Jump targets, no jump may land inside of a folded call.
+    std::vector<bool> is_target(bytecode_.size() + 1);
+    for (std::size_t i = 0; i < bytecode_.size(); ++i) {
+        if (bytecode_[i].is_jump()) {
+            is_target[i + 1 + bytecode_[i].d()] = true;
+        }
+    }
+    std::vector<bool> dead(bytecode_.size());
+    // Functions which ran out of fuel aren't evaluated again.
+    std::vector<bool> exhausted(table.size());
+    Evaluator evaluator;
+    std::size_t budget = PARSER_EVALUATION_BUDGET;
+    std::int64_t args[std::numeric_limits<std::uint8_t>::max() + 1];
+    bool folded = false;
+    for (std::size_t i = 0; i < bytecode_.size() && budget != 0; ++i) {
+        const auto call = bytecode_[i];
+        if (LIKELY(call.opcode() != Instruction::CALL)) {
+            continue;
+        }
+        std::size_t callee_index = find_function(table, call_target(i));
+        const auto& callee = table[callee_index];
+        if (!callee.pure_ || exhausted[callee_index] || is_target[i]) {
+            continue;
+        }
+        // Match the argument loads preceding the call offset load, skipping
+        // already folded calls.
+        std::size_t num_args = call.b();
+        std::size_t first = i - 1;
+        std::size_t pos = first;
+        std::size_t k = num_args;
+        while (k != 0) {
+            do {
+                --pos;
+            } while (pos != 0 && dead[pos]);
+            const auto& load = bytecode_[pos];
+            if (load.a() != call.a() + k) {
+                break;
+            }
+            if (load.opcode() == Instruction::MOVI) {
+                args[k - 1] = load.d();
+            } else if (load.opcode() == Instruction::CONST) {
+                args[k - 1] = constants_[static_cast<std::uint16_t>(load.d())];
+            } else {
+                break;
+            }
+            first = pos;
+            --k;
+        }
+        // Jumps to the first load land on the result, but jumps between the
+        // loads would skip some of them.
+        if (k != 0 || std::find(is_target.begin() + first + 1,
+                    is_target.begin() + i, true) != is_target.begin() + i) {
+            continue;
+        }
+        // Evaluate the call.
+        std::size_t fuel = std::min<std::size_t>(PARSER_EVALUATION_FUEL,
+                budget);
+        std::size_t initial_fuel = fuel;
+        auto result = evaluator.evaluate(bytecode_, constants_,
+                callee.begin_, args, num_args, &fuel);
+        budget -= initial_fuel - fuel;
+        if (!result) {
+            exhausted[callee_index] = fuel == 0;
+            continue;
+        }
+        // Replace the call by its result, the loads are dead. The result
+        // can't be taken for a call offset, no call follows it.
+        if (*result >= std::numeric_limits<std::int16_t>::min() &&
+                *result <= std::numeric_limits<std::int16_t>::max()) {
+            bytecode_[i] = Instruction::make_ad(Instruction::MOVI,
+                    call.a(), *result);
+        } else if (constants_.size() <=
+                std::numeric_limits<std::uint16_t>::max()) {
+            bytecode_[i] = Instruction::make_ad(Instruction::CONST,
+                    call.a(), constants_.size());
+            constants_.push_back(*result);
+        } else {
+            continue;
+        }
+        std::fill(dead.begin() + first, dead.begin() + i, true);
+        ++statistics_.num_folded_calls_;
+        folded = true;
+    }
+    if (folded) {
+        remove_dead_instructions(dead);
+    }
+}
+
+void Parser::memoize_calls() {
+    if (memo_functions_.empty() && !options_.memoize_) {
+        return;
+    }
+    const auto table = function_table();
+    // Assign caches to the memoized functions.
+    const auto none = static_cast<std::size_t>(-1);
+    std::vector<std::size_t> caches(table.size(), none);
+    std::size_t num_caches = 0;
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        const auto& function = table[i];
+        bool declared = memo_functions_.count(function.symbol_id_) != 0;
+        if (declared) {
+            if (UNLIKELY(!function.pure_)) {
+                std::fputs("Error: memo function '", stderr);
+                lexer_.print_symbol_name(function.symbol_id_, stderr);
+                std::fputs("' is not pure\n", stderr);
+                std::exit(EXIT_FAILURE);
+            }
+            if (UNLIKELY(function.num_args_ > INTERPRETER_MEMO_MAX_ARGS)) {
+                std::fputs("Error: memo function '", stderr);
+                lexer_.print_symbol_name(function.symbol_id_, stderr);
+                std::fprintf(stderr, "' has more than %d arguments\n",
+                        INTERPRETER_MEMO_MAX_ARGS);
+                std::exit(EXIT_FAILURE);
+            }
+        } else if (!options_.memoize_ || !function.pure_ ||
+                !function.recursive_ || function.num_args_ == 0 ||
+                function.num_args_ > INTERPRETER_MEMO_MAX_ARGS) {
+            continue;
+        }
+        if (UNLIKELY(num_caches > std::numeric_limits<std::uint8_t>::max())) {
+            if (declared) {
+                std::fputs("Error: too many memo functions\n", stderr);
+                std::exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        caches[i] = num_caches++;
+    }
+    if (num_caches == 0) {
+        return;
+    }
+    statistics_.num_memoized_functions_ += num_caches;
+    // Replace the calls, every memoized call is followed by STOREM.
+    std::vector<Parser::Relocation> code;
+    code.reserve(bytecode_.size());
+    for (std::size_t i = 0; i < bytecode_.size(); ++i) {
+        auto entry = relocation(i);
+        const auto call = bytecode_[i];
+        std::size_t cache = none;
+        if (call.opcode() == Instruction::CALL) {
+            cache = caches[find_function(table, call_target(i))];
+        }
+        if (LIKELY(cache == none)) {
+            code.push_back(entry);
+            continue;
+        }
+        entry.instruction_ = Instruction::make_abc(Instruction::CALLM,
+                call.a(), call.b(), cache);
+        code.push_back(entry);
+        entry.instruction_ = Instruction::make_abc(Instruction::STOREM,
+                call.a(), 0, 0);
+        entry.origin_ = none;
+        entry.target_ = none;
+        code.push_back(entry);
+    }
+    relocate(code);
+}
+
+std::vector<std::vector<Parser::CallEdge>> Parser::call_graph(
+        const std::vector<Parser::Function>& table) const {
+    std::vector<std::vector<Parser::CallEdge>> graph(table.size() + 1);
+    // Loop nesting depths, loops end with backward jumps.
+    std::vector<std::ptrdiff_t> depth(bytecode_.size() + 1);
+    for (std::size_t i = 0; i < bytecode_.size(); ++i) {
+        const auto& instruction = bytecode_[i];
+        if (instruction.is_jump() && instruction.d() < 0) {
+            ++depth[i + 1 + instruction.d()];
+            --depth[i + 1];
+        }
+    }
+    std::ptrdiff_t current_depth = 0;
+    std::size_t caller = table.size();
+    std::size_t next = 0;
+    for (std::size_t i = 0; i < bytecode_.size(); ++i) {
+        current_depth += depth[i];
+        if (next < table.size() && i == table[next].begin_) {
+            caller = next++;
+        }
+        if (!bytecode_[i].is_call()) {
+            continue;
+        }
+        std::size_t weight = 1;
+        if (auto count = profile_count(i)) {
+            weight = count->executed_;
+        } else {
+            for (std::ptrdiff_t k = 0; k < current_depth &&
+                    weight < std::numeric_limits<std::size_t>::max() /
+                        PARSER_LOOP_CALL_WEIGHT; ++k) {
+                weight *= PARSER_LOOP_CALL_WEIGHT;
+            }
+        }
+        Parser::CallEdge edge;
+        edge.callee_ = find_function(table, call_target(i));
+        edge.weight_ = weight;
+        graph[caller].push_back(edge);
+    }
+    // Merge the edges to the same callee.
+    for (auto& edges : graph) {
+        std::sort(edges.begin(), edges.end(),
+                [](const Parser::CallEdge& lhs, const Parser::CallEdge& rhs) {
+                    return lhs.callee_ < rhs.callee_;
+                });
+        std::size_t size = 0;
+        for (const auto& edge : edges) {
+            if (size != 0 && edges[size - 1].callee_ == edge.callee_) {
+                edges[size - 1].weight_ += edge.weight_;
+            } else {
+                edges[size++] = edge;
+            }
+        }
+        edges.resize(size);
+    }
+    return graph;
+}
+
+void Parser::layout_functions() {
+    const auto table = function_table();
+    if (table.empty()) {
+        return;
+    }
+    const auto graph = call_graph(table);
+    // Visit the functions in the depth-first order from the prolog, the
+    // heaviest callees are pushed last to be visited first. Calls that were
+    // never executed are followed only in the second round.
+    std::vector<std::size_t> order;
+    std::vector<bool> placed(table.size());
+    std::vector<std::size_t> stack;
+    std::vector<Parser::CallEdge> edges;
+    for (std::size_t round = 0; round < 2; ++round) {
+        std::vector<bool> visited(table.size() + 1);
+        stack.push_back(table.size());
+        while (!stack.empty()) {
+            std::size_t function = stack.back();
+            stack.pop_back();
+            if (visited[function]) {
+                continue;
+            }
+            visited[function] = true;
+            if (function != table.size() && !placed[function]) {
+                placed[function] = true;
+                order.push_back(function);
+            }
+            // Callees with equal weights are visited in the order of
+            // positions.
+            edges = graph[function];
+            std::sort(edges.begin(), edges.end(),
+                    [](const Parser::CallEdge& lhs,
+                        const Parser::CallEdge& rhs) {
+                        return lhs.weight_ < rhs.weight_ ||
+                            (lhs.weight_ == rhs.weight_ &&
+                             lhs.callee_ > rhs.callee_);
+                    });
+            for (const auto& edge : edges) {
+                if (!visited[edge.callee_] &&
+                        (round != 0 || edge.weight_ != 0)) {
+                    stack.push_back(edge.callee_);
+                }
+            }
+        }
+    }
+    // Forget the dead functions.
+    for (std::size_t i = 0; i < table.size(); ++i) {
+        if (!placed[i]) {
+            functions_.erase(table[i].symbol_id_);
+            ++statistics_.num_dead_functions_;
+        }
+    }
+    // Emit the prolog and the functions in the new order.
+    std::vector<Parser::Relocation> code;
+    code.reserve(bytecode_.size());
+    for (std::size_t i = 0; i < table.front().begin_; ++i) {
+        code.push_back(relocation(i));
+    }
+    for (std::size_t function : order) {
+        layout_blocks(table[function], &code);
+    }
+    relocate(code);
+}
+
+void Parser::layout_blocks(const Parser::Function& function,
+        std::vector<Parser::Relocation>* code) {
+    // Find the cold regions, nested ones are moved with the outer ones.
+    std::vector<std::pair<std::size_t, std::size_t>> cold;
+    for (std::size_t pos = function.begin_; pos < function.end_; ++pos) {
+        const auto& jump = bytecode_[pos];
+        if (jump.opcode() != Instruction::JT &&
+                jump.opcode() != Instruction::JF) {
+            continue;
+        }
+        std::size_t target = pos + 1 + jump.d();
+        auto count = profile_count(pos);
+        if (target <= pos + 1 || !count || count->executed_ == 0 ||
+                (count->executed_ - count->taken_) * PARSER_COLD_BLOCK_RATIO >
+                    count->executed_) {
+            continue;
+        }
+        cold.emplace_back(pos + 1, target);
+        pos = target - 1;
+    }
+    statistics_.num_cold_blocks_ += cold.size();
+    // Emit the hot code, jumps before the cold regions are inverted to jump
+    // to them.
+    std::size_t next = 0;
+    for (std::size_t pos = function.begin_; pos < function.end_; ++pos) {
+        if (next < cold.size() && pos == cold[next].first) {
+            pos = cold[next++].second - 1;
+            continue;
+        }
+        auto entry = relocation(pos);
+        if (next < cold.size() && pos + 1 == cold[next].first) {
+            entry.instruction_.set_opcode(
+                    entry.instruction_.opcode() == Instruction::JT ?
+                    Instruction::JF : Instruction::JT);
+            entry.target_ = pos + 1;
+        }
+        code->push_back(entry);
+    }
+    // Emit the cold regions, each jumps back unless it ends by a jump or
+    // a return.
+    for (const auto& region : cold) {
+        for (std::size_t pos = region.first; pos < region.second; ++pos) {
+            code->push_back(relocation(pos));
+        }
+        auto opcode = bytecode_[region.second - 1].opcode();
+        if (opcode != Instruction::JMP && opcode != Instruction::RETR &&
+                opcode != Instruction::RETI) {
+            Parser::Relocation entry;
+            entry.instruction_ = Instruction::make_ad(Instruction::JMP, 0, 0);
+            entry.origin_ = static_cast<std::size_t>(-1);
+            entry.target_ = region.second;
+            code->push_back(entry);
+        }
+    }
+}
+
+std::uint64_t Parser::checksum(std::size_t begin, std::size_t end) const {
+    // FNV-1a.
+    std::uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (std::size_t pos = begin; pos < end; ++pos) {
+        const auto& instruction = bytecode_[pos];
+        bool call_symbol = (instruction.opcode() == Instruction::MOVI ||
+                instruction.opcode() == Instruction::CONST) &&
+            pos + 1 < end && bytecode_[pos + 1].opcode() == Instruction::CALL;
+        std::uint8_t bytes[] = {
+            instruction.opcode(),
+            instruction.a(),
+            call_symbol ? std::uint8_t(0) : instruction.b(),
+            call_symbol ? std::uint8_t(0) : instruction.c(),
+        };
+        for (std::uint8_t byte : bytes) {
+            hash = (hash ^ byte) * UINT64_C(0x100000001b3);
+        }
+    }
+    return hash;
+}
+
+void Parser::load_profile() {
+    std::size_t size = bytecode_.size();
+    profile_counts_.assign(size, Parser::ExecutionCount());
+    profiled_.assign(size, false);
+    sources_.resize(size);
+    for (std::size_t i = 0; i < size; ++i) {
+        sources_[i] = i;
+    }
+    for (const auto& it : function_sources_) {
+        const auto* function = options_.profile_->find_function(
+                lexer_.symbol_name(it.first));
+        if (function == nullptr || function->checksum_ != it.second.checksum_) {
+            continue;
+        }
+        std::size_t begin = functions_[it.first].first;
+        std::size_t end = it.second.end_;
+        std::fill(profiled_.begin() + begin, profiled_.begin() + end, true);
+        for (const auto& counter : function->counters_) {
+            if (counter.offset_ < end - begin &&
+                    counter.taken_ <= counter.executed_) {
+                auto& count = profile_counts_[begin + counter.offset_];
+                count.executed_ = counter.executed_;
+                count.taken_ = counter.taken_;
+            }
+        }
+    }
+}
+
+std::experimental::optional<Parser::ExecutionCount> Parser::profile_count(
+        std::size_t pos) const {
+    if (pos >= sources_.size() || sources_[pos] == static_cast<std::size_t>(-1)
+            || !profiled_[sources_[pos]]) {
+        return std::experimental::nullopt;
+    }
+    return profile_counts_[sources_[pos]];
+}
+
+const Instruction* Parser::compile(const Instruction* stub,
+        const Instruction* call, const std::int64_t** constants) {
+    std::size_t stub_pos = stub - bytecode_.data();
+    ASSERT_LT(stub_pos, lazy_functions_.size());
+    auto& function = lazy_functions_[stub_pos];
+    if (function.code_ == nullptr) {
+        // Parse the function into an empty bytecode, the stubs stay in place.
+        std::vector<Instruction> code;
+        bytecode_.swap(code);
+        const Instruction* stubs = code.data();
+        lexer_.restore(function_sources_[function.symbol_id_].checkpoint_);
+        parse_function(function.symbol_id_);
+        call_sites_.clear();
+        call_args_.clear();
+        // Link the calls to the compiled functions or to their stubs.
+        function.code_ = bytecode_.data();
+        for (std::size_t i = 0; i < bytecode_.size(); ++i) {
+            if (LIKELY(bytecode_[i].opcode() != Instruction::CALL)) {
+                continue;
+            }
+            check_exported(stub_pos, call_operand(i));
+            std::size_t pos = find_callee(i);
+            const Instruction* target = lazy_functions_[pos].code_;
+            if (target == nullptr) {
+                target = stubs + pos;
+            }
+            set_call_operand(i, distance(bytecode_.data() + i + 1, target));
+        }
+        bytecode_.swap(code);
+        lazy_code_.push_back(std::move(code));
+    }
+    // Patch the load preceding the call, the bytecode is owned by the parser.
+    auto* load = const_cast<Instruction*>(call - 1);
+    *load = load_call_operand(*load, distance(call + 1, function.code_));
+    *constants = constants_.data();
+    return function.code_;
 }
 
 void Parser::parse() {
@@ -784,6 +3417,39 @@ void Parser::parse() {
     emit_call(symbol_id, reg, num_params);
     bytecode_.push_back(Instruction::make_ad(Instruction::EXIT, reg, 0));
     // Perform passes.
+    if (options_.lazy_) {
+        scan_functions();
+        link_modules();
+        // Memoization is a whole program pass, the purity of the functions
+        // isn't known before they are all compiled.
+        if (UNLIKELY(!memo_functions_.empty())) {
+            std::fputs("Error: memo function '", stderr);
+            lexer_.print_symbol_name(*memo_functions_.begin(), stderr);
+            std::fputs("' can't be compiled lazily\n", stderr);
+            std::exit(EXIT_FAILURE);
+        }
+        // The linked modules are compiled, calls to them aren't patched.
+        lazy_functions_.resize(bytecode_.size());
+        second_pass();
+        return;
+    }
     first_pass();
+    link_modules();
+    if (options_.profile_generate_) {
+        second_pass();
+        return;
+    }
+    if (options_.profile_ != nullptr) {
+        load_profile();
+    }
+    std::vector<bool> dead;
+    specialize_calls(&dead);
     second_pass();
+    if (std::find(dead.begin(), dead.end(), true) != dead.end()) {
+        dead.resize(bytecode_.size());
+        remove_dead_instructions(dead);
+    }
+    fold_constant_calls();
+    memoize_calls();
+    layout_functions();
 }
@@ -2,24 +2,88 @@
 #define PARSER_HPP
 
 #include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <experimental/optional>
+#include <map>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
+#include "image.hpp"
 #include "instruction.hpp"
+#include "interpreter.hpp"
 #include "lexer.hpp"
+#include "module.hpp"
+#include "native.hpp"
+#include "profile.hpp"
+#include "utilities.hpp"
 
-class Parser final {
+class Parser final : public LazyCompiler {
 public:
-    explicit Parser(Lexer lexer);
+    struct Options final {
+        constexpr Options()
+            : memoize_(false), profile_generate_(false), profile_(nullptr),
+              native_functions_(nullptr), num_jobs_(1), lazy_(false),
+              filename_(nullptr), module_cache_(nullptr) {}
+        constexpr Options(const Options&) = default;
+        constexpr Options& operator=(const Options&) = default;
+
+        // Whether to memoize all pure recursive functions, not only the ones
+        // declared with 'memo'.
+        bool memoize_;
+        // Whether to skip the passes after linking, so that the execution
+        // counts of the bytecode can be made into a profile.
+        bool profile_generate_;
+        // The profile to optimize with, nullptr if none.
+        const Profile* profile_;
+        // The native functions callable by the program, nullptr if none.
+        const NativeFunctions* native_functions_;
+        // The number of worker processes compiling the functions in the first
+        // pass, 1 compiles them serially. The bytecode is the same. Ignored
+        // unless built with PARSER_WORKER_PROCESSES, forking is unsafe in
+        // processes with other threads.
+        std::size_t num_jobs_;
+        // Whether to only scan the functions and compile each one on its
+        // first call. The bytecode holds their LAZY stubs, the passes after
+        // linking are skipped, and neither 'memo' nor the profiles can be
+        // used. Imported modules are compiled eagerly.
+        bool lazy_;
+        // The name of the parsed file, the imports are relative to its
+        // directory. nullptr for the current directory.
+        const char* filename_;
+        // The cache of the imported modules, nullptr to compile them on
+        // every run.
+        const ModuleCache* module_cache_;
+    };
+
+    explicit Parser(Lexer lexer, const Options& options = Options());
     Parser(const Parser&) = delete;
     void operator=(const Parser&) = delete;
 
     // Parses the source.
     void parse();
 
+    // Compiles the function of the stub in the lazy mode. Its bytecode is
+    // stored apart from the stubs, calls are linked by the distances of the
+    // instructions.
+    const Instruction* compile(const Instruction* stub,
+            const Instruction* call, const std::int64_t** constants) override;
+
     const std::vector<Instruction>& bytecode() const;
     const std::vector<std::int64_t>& constants() const;
 
+    // Gets the functions of the program sorted by their positions.
+    std::vector<Image::Function> functions() const;
+
+    // Makes the profile from the execution counts of the bytecode, which must
+    // be parsed with 'profile_generate_'.
+    Profile make_profile(const ExecutionCounts& counts) const;
+
+    // Prints statistics of the performed optimization passes.
+    COLD void print_statistics(std::FILE* file) const;
+
 private:
     enum Operator {
         // Commutative binary operators.
@@ -27,18 +91,25 @@ private:
         MUL,
         EQ,
         NE,
+        AND,
+        OR,
+        XOR,
         // Noncommutative binary operators.
         SUB,
         DIV,
         MOD,
         LT,
         LE,
+        SHL,
+        SAR,
+        SHR,
         // Other operators without corresponding instructions.
         GT,
         GE,
         // Unary operators.
         NEG,
         NOT,
+        BNOT,
     };
 
     // These constraints must be satisfied, otherwise some methods will
@@ -46,23 +117,39 @@ private:
     static_assert(MUL - ADD == Instruction::MULRR - Instruction::ADDRR);
     static_assert(EQ - ADD == Instruction::EQRR - Instruction::ADDRR);
     static_assert(NE - ADD == Instruction::NERR - Instruction::ADDRR);
+    static_assert(AND - ADD == Instruction::ANDRR - Instruction::ADDRR);
+    static_assert(OR - ADD == Instruction::ORRR - Instruction::ADDRR);
+    static_assert(XOR - ADD == Instruction::XORRR - Instruction::ADDRR);
     static_assert(MUL - ADD == Instruction::MULRI - Instruction::ADDRI);
     static_assert(EQ - ADD == Instruction::EQRI - Instruction::ADDRI);
     static_assert(NE - ADD == Instruction::NERI - Instruction::ADDRI);
+    static_assert(AND - ADD == Instruction::ANDRI - Instruction::ADDRI);
+    static_assert(OR - ADD == Instruction::ORRI - Instruction::ADDRI);
+    static_assert(XOR - ADD == Instruction::XORRI - Instruction::ADDRI);
     static_assert(DIV - SUB == Instruction::DIVRR - Instruction::SUBRR);
     static_assert(MOD - SUB == Instruction::MODRR - Instruction::SUBRR);
     static_assert(LT - SUB == Instruction::LTRR - Instruction::SUBRR);
     static_assert(LE - SUB == Instruction::LERR - Instruction::SUBRR);
+    static_assert(SHL - SUB == Instruction::SHLRR - Instruction::SUBRR);
+    static_assert(SAR - SUB == Instruction::SARRR - Instruction::SUBRR);
+    static_assert(SHR - SUB == Instruction::SHRRR - Instruction::SUBRR);
     static_assert(DIV - SUB == Instruction::DIVRI - Instruction::SUBRI);
     static_assert(MOD - SUB == Instruction::MODRI - Instruction::SUBRI);
     static_assert(LT - SUB == Instruction::LTRI - Instruction::SUBRI);
     static_assert(LE - SUB == Instruction::LERI - Instruction::SUBRI);
+    static_assert(SHL - SUB == Instruction::SHLRI - Instruction::SUBRI);
+    static_assert(SAR - SUB == Instruction::SARRI - Instruction::SUBRI);
+    static_assert(SHR - SUB == Instruction::SHRRI - Instruction::SUBRI);
     static_assert(DIV - SUB == Instruction::DIVIR - Instruction::SUBIR);
     static_assert(MOD - SUB == Instruction::MODIR - Instruction::SUBIR);
     static_assert(LT - SUB == Instruction::LTIR - Instruction::SUBIR);
     static_assert(LE - SUB == Instruction::LEIR - Instruction::SUBIR);
+    static_assert(SHL - SUB == Instruction::SHLIR - Instruction::SUBIR);
+    static_assert(SAR - SUB == Instruction::SARIR - Instruction::SUBIR);
+    static_assert(SHR - SUB == Instruction::SHRIR - Instruction::SUBIR);
     static_assert(GE - GT == LE - LT);
     static_assert(NOT - NEG == Instruction::NOT - Instruction::NEG);
+    static_assert(BNOT - NEG == Instruction::BNOT - Instruction::NEG);
 
     struct Expression final {
         constexpr Expression() : value_(0), has_reg_(false) {}
@@ -114,14 +201,179 @@ private:
         std::size_t num_variables_;
     };
 
+    struct Statistics final {
+        constexpr Statistics()
+            : num_closed_form_loops_(0), num_folded_calls_(0),
+            num_memoized_functions_(0), num_specializations_(0),
+            num_dead_functions_(0), num_cold_blocks_(0),
+            num_jump_tables_(0), num_unchecked_accesses_(0),
+            num_compiled_modules_(0), num_cached_modules_(0) {}
+        constexpr Statistics(const Statistics&) = default;
+        constexpr Statistics& operator=(const Statistics&) = default;
+
+        std::size_t num_closed_form_loops_;
+        std::size_t num_folded_calls_;
+        std::size_t num_memoized_functions_;
+        std::size_t num_specializations_;
+        std::size_t num_dead_functions_;
+        std::size_t num_cold_blocks_;
+        std::size_t num_jump_tables_;
+        std::size_t num_unchecked_accesses_;
+        std::size_t num_compiled_modules_;
+        std::size_t num_cached_modules_;
+    };
+
+    // What is known about the value of a variable. The 'bound_' is the length
+    // of an ARRAY, a constant or an unassigned variable, and the exclusive
+    // upper bound of a nonnegative INDEX.
+    struct VariableFact final {
+        enum Kind {
+            UNKNOWN,
+            ARRAY,
+            INDEX,
+        };
+
+        Kind kind_;
+        Expression bound_;
+    };
+
+    // A checked array access at the given position, proven to be in range if
+    // none of the registers is assigned in the function.
+    struct ArrayAccess final {
+        std::size_t pos_;
+        std::uint8_t regs_[3];
+        std::size_t num_regs_;
+    };
+
+    // A list of jumps to the same target, linked through their offsets and
+    // terminated by -1. The last jump is kept to append in constant time.
+    struct JumpList final {
+        constexpr JumpList()
+            : head_(static_cast<std::size_t>(-1)),
+            tail_(static_cast<std::size_t>(-1)) {}
+        constexpr explicit JumpList(std::size_t jump)
+            : head_(jump), tail_(jump) {}
+        constexpr JumpList(const JumpList&) = default;
+        constexpr JumpList& operator=(const JumpList&) = default;
+
+        constexpr bool empty() const {
+            return head_ == static_cast<std::size_t>(-1);
+        }
+
+        std::size_t head_;
+        std::size_t tail_;
+    };
+
+    // A case of a match statement, selecting the arm with the given index.
+    struct MatchCase final {
+        std::int64_t value_;
+        std::size_t arm_;
+    };
+
+    // An edge of the call graph, the weight estimates how often the callee is
+    // called by the caller.
+    struct CallEdge final {
+        std::size_t callee_;
+        std::size_t weight_;
+    };
+
+    // An argument of a call. The 'load_' is the position of the instruction
+    // loading the 'value_' if the argument is a constant, -1 otherwise.
+    struct CallArgument final {
+        std::size_t load_;
+        std::int64_t value_;
+    };
+
+    // A call in the unlinked bytecode, i.e. before the second pass, with its
+    // arguments at 'first_arg_', ..., 'first_arg_ + num_args_ - 1' in
+    // 'call_args_'.
+    struct CallSite final {
+        std::size_t call_;
+        std::size_t first_arg_;
+        std::size_t num_args_;
+    };
+
+    // The source of a function, needed to parse its specializations.
+    struct FunctionSource final {
+        // The lexer state at the '(' of the arguments.
+        Lexer::Checkpoint checkpoint_;
+        // The position past the last instruction in the first pass.
+        std::size_t end_;
+        // The checksum of the bytecode of the first pass.
+        std::uint64_t checksum_;
+        // Whether the arguments are assigned in the function body.
+        std::vector<bool> assigned_args_;
+        std::size_t num_specializations_;
+    };
+
+    // A file of the program, i.e. the program itself or a linked module.
+    struct File final {
+        std::string name_;
+        // The position of its first function in the first pass.
+        std::size_t begin_;
+        // Whether it declares exports, the other files may only call its
+        // exported functions then.
+        bool exports_;
+    };
+
+    // A function of the lazy mode, the code is nullptr until it's compiled.
+    struct LazyFunction final {
+        std::size_t symbol_id_;
+        const Instruction* code_;
+    };
+
+    // Profiled execution counts of an instruction.
+    struct ExecutionCount final {
+        std::uint64_t executed_;
+        std::uint64_t taken_;
+    };
+
+    // Values of the constant arguments of a specialization, nullopt for
+    // arguments that are not constant.
+    using ConstantArguments =
+        std::vector<std::experimental::optional<std::int64_t>>;
+
+    // A function in the linked bytecode, i.e. after the second pass.
+    struct Function final {
+        std::size_t symbol_id_;
+        // Positions of the first instruction and past the last one.
+        std::size_t begin_;
+        std::size_t end_;
+        std::size_t num_args_;
+        // Whether the function never executes IN, OUT, EXIT or an array
+        // instruction, neither directly nor in a callee.
+        bool pure_;
+        // Whether the function calls itself directly.
+        bool recursive_;
+    };
+
+    // An instruction of the relocated bytecode. Jumps to the 'origin_'
+    // position of the old bytecode land on the first instruction with that
+    // origin, instructions without an origin have it set to -1. The
+    // 'target_' is the old position jumped to by the jump instruction or
+    // called by the call instruction following the instruction, -1 for other
+    // instructions.
+    struct Relocation final {
+        Instruction instruction_;
+        std::size_t origin_;
+        std::size_t target_;
+    };
+
     // Finds the register where the given variable (symbol_id) is stored.
     // Returns the variable register if the variable exists in the current
     // scope, std::numeric_limits<std::size_t>::max() otherwise.
-    std::size_t find_variable_reg(std::size_t symbol_id) const;
+    std::size_t find_variable_reg(std::size_t symbol_id);
+
+    // Adds the variable to the current scope in the next register. Hidden
+    // variables have the symbol id std::numeric_limits<std::size_t>::max().
+    void add_variable(std::size_t symbol_id);
 
     // Stores the expression into the given register.
     Expression expr_to_reg(Expression expr, std::uint8_t reg);
 
+    // Appends the constant, returns its index.
+    std::size_t add_constant(std::int64_t value);
+
     // Stores the expression into the next free register.
     Expression expr_to_next_reg(Expression expr);
 
@@ -134,17 +386,17 @@ private:
     // Gets the next jump.
     std::size_t next_jump(std::size_t pos) const;
 
-    // Appends the position in the bytecode to the jump list.
-    void append_jump(std::size_t* list, std::size_t pos);
+    // Appends the other jump list to the jump list.
+    void append_jump(JumpList* list, JumpList other);
 
     // Patches the single instruction at given position to the target.
     void patch_single_jump(std::size_t pos, std::size_t target);
 
     // Patches the jump list to the given target.
-    void patch_jump_list(std::size_t list, std::size_t target);
+    void patch_jump_list(JumpList list, std::size_t target);
 
     // Patches the jump list to the current program counter.
-    void patch_jump_list_to_here(std::size_t list);
+    void patch_jump_list_to_here(JumpList list);
 
     // Folds a binary operator.
     static Expression fold_unary_op(int op, Expression expr);
@@ -155,12 +407,33 @@ private:
     // Emits an unary operator.
     Expression emit_unary_op(int op, Expression expr);
 
+    // Folds a builtin function, the rhs is ignored by unary ones.
+    static Expression fold_builtin(Instruction::Opcode opcode, Expression lhs,
+            Expression rhs);
+
+    // Emits an unary builtin instruction.
+    Expression emit_unary_builtin(Instruction::Opcode opcode, Expression expr);
+
+    // Emits a binary builtin instruction. None will be emitted if the both
+    // expressions can be folded.
+    Expression emit_binary_builtin(Instruction::Opcode opcode, Expression lhs,
+            Expression rhs);
+
     // Emits a commutative binary operator.
     Expression emit_commutative_op(int op, Expression lhs, Expression rhs);
 
     // Emits a noncommutative binary operator.
     Expression emit_noncommutative_op(int op, Expression lhs, Expression rhs);
 
+    // Checks whether the division by the constant divisor can be emitted
+    // without the DIV/MOD instructions.
+    bool can_emit_division_by_constant(std::int64_t divisor);
+
+    // Emits a division or modulo by the constant divisor. Powers of two are
+    // emitted as DIVPOW2/MODPOW2, other divisors as DIVMAGIC/MODMAGIC.
+    Expression emit_division_by_constant(int op, Expression lhs,
+            std::int64_t divisor);
+
     // Emits a binary operator. None will be emitted if the both expressions can
     // be folded.
     Expression emit_binary_op(int op, Expression lhs, Expression rhs);
@@ -172,10 +445,37 @@ private:
     // If confition is true, then JT will be generated, JF otherwise.
     std::size_t emit_conditional_jump(std::uint8_t reg, bool condition);
 
+    // Emits a jump for the condition, taken if it equals the 'condition'.
+    // Returns the jump list, empty if the jump is never taken.
+    JumpList emit_condition(Expression expr, bool condition = false);
+
     // Emits a call instruction.
     Expression emit_call(std::size_t symbol_id, std::uint8_t reg,
             std::size_t num_args);
 
+    // Emits a call of the native function with the given index.
+    Expression emit_native_call(std::size_t index, std::uint8_t reg,
+            std::size_t num_args);
+
+    // Emits an allocation of an array of the given length. It's recorded for
+    // the let statement if the length is a constant or a variable.
+    Expression emit_array_new(Expression length);
+
+    // Emits a load of the element of the array.
+    Expression emit_array_load(Expression array, Expression index);
+
+    // Emits a store of the value to the element of the array.
+    void emit_array_store(Expression array, Expression index,
+            Expression value);
+
+    // Records the access emitted last, if its index is proven to be in range
+    // by the facts about the array and the index variables.
+    void add_array_access(Expression array, Expression index);
+
+    // Makes the recorded accesses of the function unchecked, unless the
+    // registers they depend on are assigned.
+    void remove_array_checks();
+
     // Emits a ret instruction.
     void emit_return(Expression expr);
     
@@ -186,10 +486,21 @@ private:
     // parameters -> <none> | expr { ',' expr }
     std::size_t parse_parameters();
 
-    // Parses an identifier expression. It can be a variable or a function call.
-    // identifier_expr -> IDENTIFIER [ '(' parameters ')' ]
+    // Parses a call of a builtin, a native or a function following its
+    // consumed name.
+    // call -> IDENTIFIER ( builtin | '(' parameters ')' )
+    Expression parse_call(std::size_t symbol_id);
+
+    // Parses an identifier expression. It can be a variable, an element of an
+    // array variable or a call.
+    // identifier_expr -> IDENTIFIER [ '[' expr ']' ] | call
     Expression parse_identifier_expr();
 
+    // Parses the arguments of the builtin function with the given index in
+    // the builtin table, they must match its number of arguments.
+    // builtin -> '(' expr { ',' expr } ')'
+    Expression parse_builtin(std::size_t index);
+
     // Parses an integer literal expression.
     // integer_literal_expr -> INTEGER_LITERAL
     Expression parse_integer_literal_expr();
@@ -203,7 +514,7 @@ private:
     Expression parse_primary_expr();
 
     // Parses an unary expression.
-    // unary_expr -> [ '!' | '-' ] primary_expr
+    // unary_expr -> [ '!' | '-' | '~' ] primary_expr
     Expression parse_unary_expr();
 
     // Converts token to operator.
@@ -213,23 +524,59 @@ private:
     // binary_expr -> unary_expr [ ( '+', '-', ...) binary_expr ]
     Expression parse_binary_expr(std::size_t limit);
 
-    // Parses an expression.
-    // expr -> binary_expr
+    // Parses the '&&' and '||' operators following the left operand. Jumps
+    // of the operands deciding the result are appended to the true and false
+    // lists, the returned last operand decides the result otherwise.
+    // logical_expr -> binary_expr { ( '&&' | '||' ) binary_expr }
+    Expression parse_logical_expr(Expression lhs, JumpList* true_list,
+            JumpList* false_list);
+
+    // Parses an expression, the result of logical operators is materialized.
+    // expr -> logical_expr
     Expression parse_expr();
 
+    // Parses a condition, returns the jump list taken if it is false. Logical
+    // operators are emitted only as jumps.
+    // condition -> logical_expr
+    JumpList parse_condition();
+
     // Parses a block statement.
     // block -> '{' { statement } '}'
     void parse_block();
 
     // Parses a conditional block for IF / ELSE IF, returns the jump list
     // for false conditions.
-    // cond_block -> expr block
-    std::size_t parse_cond_block();
+    // cond_block -> condition block
+    JumpList parse_cond_block();
 
     // Parses an if statement.
     // if -> IF cond_block { ELSE IF cond_block } [ ELSE block ]
     void parse_if();
 
+    // Emits 'tmp <- reg op value' with the instruction taking a register
+    // ('rr') or an immediate ('ri') as the second operand.
+    void emit_op_with_constant(Instruction::Opcode rr, Instruction::Opcode ri,
+            std::uint8_t tmp, std::uint8_t reg, std::int64_t value);
+
+    // Emits jumps selecting the arm of the sorted cases between 'first' and
+    // 'last' for the value in the 'reg' register, using the 'tmp' register.
+    // Dense cases are dispatched by jump tables, sparse ones by a binary
+    // search. Jumps to the arms are appended to their jump lists.
+    void emit_match_dispatch(std::uint8_t reg, std::uint8_t tmp,
+            const std::vector<MatchCase>& cases, std::size_t first,
+            std::size_t last, std::size_t default_arm,
+            std::vector<JumpList>* arms);
+
+    // Parses a match pattern.
+    // match_pattern -> [ '-' ] INTEGER_LITERAL
+    std::int64_t parse_match_pattern();
+
+    // Parses a match statement. The arms are scanned first, so that the
+    // dispatch precedes them.
+    // match -> MATCH expr '{' { match_arm [ ',' ] } '}'
+    // match_arm -> ( match_pattern | WILDCARD ) ARROW block
+    void parse_match();
+
     // Parses an in statement.
     // in -> IN IDENTIFIER ';'
     void parse_in();
@@ -246,36 +593,306 @@ private:
     // return -> RETURN expr ';'
     void parse_return();
 
+    // Replaces the loop 'while i < n { ... }' starting at the 'start' position
+    // with the exit jump at the 'exit' position by its closed form, if the
+    // body only increments i by one and adds i, loop invariant variables or
+    // constants to other variables. Returns true if the loop was replaced.
+    bool emit_closed_form_loop(std::size_t start, std::size_t exit);
+
     // Parses a while statement.
     // while -> WHILE cond_block
     void parse_while();
 
-    // Parses an assignment or a call.
-    // assignment_or_call -> IDENTIFIER '=' expr ';' |
-    //                       IDENTIFIER '(' parameters ')' ';'
+    // Parses a numeric for statement. The range excludes the limit, the step
+    // is 1 by default. The limit and the step are evaluated once, assigning
+    // the variable doesn't change the iterations.
+    // for -> FOR IDENTIFIER IN expr RANGE expr [ STEP expr ] block
+    void parse_for();
+
+    // Parses an assignment or a call, the result of the call is discarded.
+    // assignment_or_call -> IDENTIFIER [ '[' expr ']' ] '=' expr ';' |
+    //                       call ';'
     void parse_assignment_or_call();
 
     // Parses a statement.
-    // statement -> block | if | in | let | out | return | while |
-    //              assignment_or_call
+    // statement -> block | for | if | in | let | match | out | return |
+    //              while | assignment_or_call
     int parse_statement();
 
+    // Gets the value loaded for the call instruction at the given position,
+    // the symbol id of the callee in the unlinked bytecode and the offset of
+    // the callee from the call in the linked one.
+    std::int64_t call_operand(std::size_t pos) const;
+
+    // Returns the load of the call operand changed to the value. Values not
+    // fitting MOVI are loaded by CONST, which keeps its constant.
+    Instruction load_call_operand(Instruction load, std::int64_t value);
+
+    // Sets the value loaded for the call instruction at the given position.
+    void set_call_operand(std::size_t pos, std::int64_t value);
+
+    // Gets the target of the call instruction at the given position in the
+    // linked bytecode.
+    std::size_t call_target(std::size_t pos) const;
+
+    // Makes the relocation of the instruction at the given position in the
+    // linked bytecode.
+    Relocation relocation(std::size_t pos) const;
+
+    // Replaces the bytecode by the relocated one, patches jumps, calls and
+    // positions of functions.
+    void relocate(const std::vector<Relocation>& code);
+
+    // Removes instructions marked as dead from the linked bytecode.
+    void remove_dead_instructions(const std::vector<bool>& dead);
+
+    // Builds the table of functions ordered by their positions, computes their
+    // purity and recursion.
+    std::vector<Function> function_table() const;
+
+    // Finds the index of the function containing the given position.
+    static std::size_t find_function(const std::vector<Function>& table,
+            std::size_t pos);
+
+    // Replaces calls of pure functions with constant arguments by their
+    // results, computed by evaluating the calls with limited fuel. The
+    // evaluation reuses the results of completed calls. Functions which once
+    // ran out of fuel aren't evaluated again.
+    void fold_constant_calls();
+
+    // Replaces calls of functions declared with 'memo' and, if enabled, of
+    // pure recursive functions by memoized calls.
+    void memoize_calls();
+
+    // Computes the checksum of the unlinked bytecode between the positions,
+    // ignoring the symbol ids of calls.
+    std::uint64_t checksum(std::size_t begin, std::size_t end) const;
+
+    // Loads the counts of the functions whose bytecode of the first pass
+    // matches the profile.
+    void load_profile();
+
+    // Gets the profiled execution counts of the instruction at the given
+    // position, nullopt if the instruction isn't profiled.
+    std::experimental::optional<ExecutionCount> profile_count(
+            std::size_t pos) const;
+
+    // Builds the call graph of the functions in the table, edges from the
+    // program prolog are stored after the ones of the functions. Calls in
+    // loops get higher weights, profiled calls are weighted by their counts.
+    std::vector<std::vector<CallEdge>> call_graph(
+            const std::vector<Function>& table) const;
+
+    // Removes functions unreachable from the program prolog and orders the
+    // remaining ones in the depth-first order of the call graph, so that
+    // every function is followed by its heaviest callee not placed yet.
+    // Functions that were never called according to the profile are placed
+    // last.
+    void layout_functions();
+
+    // Appends the function to the code. With a profile, code rarely entered
+    // by falling through a conditional jump is moved to the end of the
+    // function and the jump is inverted.
+    void layout_blocks(const Function& function, std::vector<Relocation>* code);
+
     // Parses function arguments, returns the number of them.
     // arguments -> <none> | IDENTIFIER { ',' IDENTIFIER }
     std::size_t parse_arguments();
+
+    // Registers the function at the current position of the bytecode.
+    void define_function(std::size_t symbol_id, std::size_t num_args);
+
+    // Parses the arguments and the body of the function and registers it,
+    // unless the functions were defined by scanning in the lazy mode.
+    // function -> '(' arguments ')' block
+    void parse_function(std::size_t symbol_id);
+
+    // Parses a function.
+    // fn -> [ EXPORT ] [ MEMO ] FN IDENTIFIER function
     void parse_fn();
+
+    // Parses an import, the module is linked after the first pass.
+    // import -> IMPORT STRING_LITERAL ';'
+    void parse_import();
+
+    // declaration -> import | fn
+    void parse_declaration();
+
+    // Parses the function again with the given arguments replaced by the
+    // constants, returns the symbol id of the specialization.
+    std::size_t parse_specialization(std::size_t symbol_id,
+            const ConstantArguments& args);
+
+    // Redirects calls with constant arguments to specializations of the
+    // called functions, calls in the specializations are handled as well.
+    // Loads of the constant arguments are marked as dead.
+    void specialize_calls(std::vector<bool>* dead);
+
+    // Appends the functions compiled by the first pass to the unit, with
+    // the symbols, constants, calls and imports needed to link them into
+    // another parser. Positions are stored as offsets from the source.
+    void write_unit(const char* source, std::vector<char>* unit) const;
+
+    // Compiles the given number of functions from the position of the lexer
+    // in the source and writes the result to the file descriptor. Called by
+    // a worker process, returns false if the functions don't start with
+    // 'fn'.
+    bool compile_chunk(const char* source, std::size_t num_functions,
+            int fd);
+
+    // Appends the bytecode compiled by another parser, whose constants are
+    // appended too and whose symbol ids are mapped to the given ones. The
+    // positions of the magic numbers are sorted. Returns the offset of the
+    // bytecode.
+    std::size_t append_code(const std::vector<Instruction>& bytecode,
+            const std::vector<std::int64_t>& constants,
+            const std::vector<std::size_t>& magics,
+            const std::vector<std::size_t>& symbol_ids);
+
+    // Links the unit written by write_unit with the given source, its symbol
+    // ids are mapped to the ones of this parser. If exact, the unit is only
+    // linked if its bytecode is the same as the serial compilation. Returns
+    // false if the unit can't be linked, e.g. if its magic numbers don't fit
+    // or its functions are redefined.
+    bool link_unit(std::experimental::string_view unit, const char* source,
+            bool exact, std::vector<std::size_t>* symbol_ids);
+
+    // Merges the functions compiled by a worker, if their compilation is the
+    // same as the serial one continuing from the expected lexer state, which
+    // is then advanced past them. Returns false otherwise.
+    bool merge_chunk(const std::vector<char>& chunk, const char* source,
+            Lexer::Checkpoint* expected);
+
+    // Splits the source at the ends of the functions and compiles the parts
+    // by worker processes, which are merged in the order of the source. The
+    // functions following a part which can't be merged are left to the
+    // serial compilation. It's an experiment without a measured speedup, so
+    // it's only built with PARSER_WORKER_PROCESSES. The workers are processes
+    // rather than threads because the parser reports errors by exiting and
+    // each worker needs its own lexer and symbol table.
+    void compile_in_parallel(const char* source, std::size_t line_number);
+
+    // Defines the functions with stubs instead of parsing their bodies, the
+    // lazy mode compiles them later.
+    void scan_functions();
+
     void first_pass();
+
+    // Compiles the first pass of the module starting at the source into a
+    // form that can be cached and linked into other programs.
+    void compile_module(const char* source, std::vector<char>* module);
+
+    // Links the compiled module with the given source. Returns false, if the
+    // module can't be linked.
+    bool merge_module(const std::vector<char>& module, const char* source);
+
+    // Compiles or loads the imported modules and links them after the
+    // functions of the program, modules imported by them are linked too.
+    // Modules that can't be linked are parsed from their sources again.
+    void link_modules();
+
+    // Finds the position of the function called at the given position of the
+    // unlinked bytecode, reports undefined functions and wrong numbers of
+    // arguments.
+    std::size_t find_callee(std::size_t pos) const;
+
+    // Finds the index of the file with the given position of the first pass,
+    // the program prolog belongs to the program.
+    std::size_t find_file(std::size_t pos) const;
+
+    // Reports calls of functions which aren't exported by their file from
+    // the given position of the first pass. Undefined functions are left to
+    // find_callee.
+    void check_exported(std::size_t pos, std::size_t symbol_id) const;
+
+    // Checks the calls of the first pass by check_exported.
+    void check_exports() const;
+
     void second_pass();
 
     std::size_t variable_regs_[0xff];
+    // Facts about the variables in the registers.
+    VariableFact variable_facts_[0xff];
+    // The register of the most recently added variable of every symbol, -1
+    // for symbols that were never variables. It's stale after the scope of
+    // the variable has ended.
+    std::vector<std::size_t> recent_regs_;
     // Map of defined functions with their positions in the bytecode and number
     // of arguments.
     std::unordered_map<std::size_t, std::pair<std::size_t, std::size_t>>
         functions_;
+    // Map of the symbol ids of the builtin functions to their indices in the
+    // builtin table.
+    std::unordered_map<std::size_t, std::size_t> builtins_;
+    // Map of the symbol ids of the native functions to their indices.
+    std::unordered_map<std::size_t, std::size_t> natives_;
+    // Set of functions declared with 'memo'.
+    std::unordered_set<std::size_t> memo_functions_;
+    // Sources of the parsed functions.
+    std::unordered_map<std::size_t, FunctionSource> function_sources_;
+    // Map of the specialized functions with their constant arguments to the
+    // symbol ids of the specializations.
+    std::map<std::pair<std::size_t, ConstantArguments>, std::size_t>
+        specializations_;
+    // Names of the specializations, referenced by the lexer.
+    std::deque<std::string> specialization_names_;
+    // Calls with at least one constant argument.
+    std::vector<CallSite> call_sites_;
+    std::vector<CallArgument> call_args_;
+    // Arguments of the calls being parsed.
+    std::vector<CallArgument> pending_args_;
+    // Whether the arguments of the function being parsed are assigned.
+    std::vector<bool> assigned_args_;
+    // Whether the registers of the function being parsed are assigned.
+    std::vector<bool> assigned_regs_;
+    // Array accesses of the function being parsed, which are unchecked if
+    // they stay proven at its end.
+    std::vector<ArrayAccess> array_accesses_;
+    // The position of the last recorded ANEW, -1 if none, and its length.
+    std::size_t last_allocation_;
+    Expression last_allocation_length_;
+    // Constant arguments of the specialization being parsed.
+    ConstantArguments constant_args_;
+    // Profiled counts and whether they are known, indexed by positions in
+    // the first pass.
+    std::vector<ExecutionCount> profile_counts_;
+    std::vector<bool> profiled_;
+    // Positions of the instructions in the first pass, -1 for instructions
+    // emitted later. Only tracked with a profile.
+    std::vector<std::size_t> sources_;
+    // The functions of the lazy mode indexed by the positions of their stubs.
+    std::vector<LazyFunction> lazy_functions_;
+    // The bytecode of the lazily compiled functions, which is never moved.
+    std::deque<std::vector<Instruction>> lazy_code_;
+    // The name of the file being parsed.
+    std::string file_;
+    // Files in the order of their functions, the program is the first.
+    std::vector<File> files_;
+    // Symbol ids of the exported functions.
+    std::unordered_set<std::size_t> exports_;
+    // Paths of the imported modules, which weren't linked yet.
+    std::vector<std::string> imports_;
+    // Canonical paths of the linked modules and of the program.
+    std::unordered_set<std::string> modules_;
+    // Sources and compiled contents of the linked modules, referenced by the
+    // lexer and by the sources of the functions.
+    std::deque<SourceFile> module_sources_;
+    std::deque<std::vector<char>> module_contents_;
+    // Chunks compiled by the worker processes, the names of their symbols
+    // point to them.
+    std::deque<std::vector<char>> worker_chunks_;
     Lexer lexer_;
     std::vector<Instruction> bytecode_;
     std::vector<std::int64_t> constants_;
+    // Map of divisors with the positions of their magic numbers in the
+    // constants.
+    std::unordered_map<std::int64_t, std::size_t> division_magics_;
+    // The most constants including new magic numbers a division was checked
+    // to fit, 0 if none. It validates the functions compiled by workers.
+    std::size_t max_division_query_;
     Scope* current_scope_;
+    Statistics statistics_;
+    Options options_;
 };
 
 #endif // !PARSER_HPP
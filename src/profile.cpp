@@ -0,0 +1,80 @@
+#include "profile.hpp"
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <experimental/optional>
+#include <experimental/string_view>
+#include <string>
+#include <utility>
+#include "cxx_extensions.hpp"
+
+namespace {
+
+const char header[] = "am-profile 1\n";
+
+}
+
+std::experimental::optional<Profile> Profile::read(const char* filename) {
+    std::FILE* file = std::fopen(filename, "r");
+    if (UNLIKELY(file == nullptr)) {
+        return std::experimental::nullopt;
+    }
+    Profile profile;
+    char line[sizeof(header)];
+    bool valid = std::fgets(line, sizeof(line), file) != nullptr &&
+        std::string(line) == header;
+    // Functions are stored as 'fn name checksum n' followed by n counters.
+    char name[256];
+    std::uint64_t checksum;
+    std::size_t num_counters;
+    while (valid && std::fscanf(file, " fn %255s %" SCNx64 " %zu", name,
+                &checksum, &num_counters) == 3) {
+        Profile::Function function;
+        function.checksum_ = checksum;
+        function.counters_.resize(num_counters);
+        for (auto& counter : function.counters_) {
+            if (std::fscanf(file, "%zu %" SCNu64 " %" SCNu64, &counter.offset_,
+                        &counter.executed_, &counter.taken_) != 3) {
+                valid = false;
+                break;
+            }
+        }
+        profile.functions_.emplace(name, std::move(function));
+    }
+    valid = valid && std::feof(file);
+    std::fclose(file);
+    if (UNLIKELY(!valid)) {
+        return std::experimental::nullopt;
+    }
+    return profile;
+}
+
+bool Profile::write(const char* filename) const {
+    std::FILE* file = std::fopen(filename, "w");
+    if (UNLIKELY(file == nullptr)) {
+        return false;
+    }
+    std::fputs(header, file);
+    for (const auto& it : functions_) {
+        const auto& function = it.second;
+        std::fprintf(file, "fn %s %" PRIx64 " %zu\n", it.first.c_str(),
+                function.checksum_, function.counters_.size());
+        for (const auto& counter : function.counters_) {
+            std::fprintf(file, "%zu %" PRIu64 " %" PRIu64 "\n",
+                    counter.offset_, counter.executed_, counter.taken_);
+        }
+    }
+    return std::fclose(file) == 0;
+}
+
+void Profile::add_function(std::experimental::string_view name,
+        Profile::Function function) {
+    functions_[std::string(name)] = std::move(function);
+}
+
+const Profile::Function* Profile::find_function(
+        std::experimental::string_view name) const {
+    auto it = functions_.find(std::string(name));
+    return it != functions_.end() ? &it->second : nullptr;
+}
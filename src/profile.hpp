@@ -0,0 +1,55 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <experimental/optional>
+#include <experimental/string_view>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Execution counts of the functions of a program, recorded by running the
+// bytecode of the first pass. Positions are relative to the beginnings of the
+// functions.
+class Profile final {
+public:
+    // Execution counts of a single instruction.
+    struct Counter final {
+        std::size_t offset_;
+        std::uint64_t executed_;
+        // The number of times the jump was taken, 0 for other instructions.
+        std::uint64_t taken_;
+    };
+
+    struct Function final {
+        // The checksum of the bytecode the profile was recorded with.
+        std::uint64_t checksum_;
+        std::vector<Counter> counters_;
+    };
+
+    Profile() = default;
+    Profile(const Profile&) = default;
+    Profile& operator=(const Profile&) = default;
+    Profile(Profile&&) = default;
+    Profile& operator=(Profile&&) = default;
+
+    // Reads the profile, returns nullopt if the file can't be read or is
+    // malformed.
+    static std::experimental::optional<Profile> read(const char* filename);
+
+    // Writes the profile, returns false on failure.
+    bool write(const char* filename) const;
+
+    // Adds the function with the given name.
+    void add_function(std::experimental::string_view name, Function function);
+
+    // Finds the function with the given name, returns nullptr if there is no
+    // such function.
+    const Function* find_function(std::experimental::string_view name) const;
+
+private:
+    std::unordered_map<std::string, Function> functions_;
+};
+
+#endif // !PROFILE_HPP
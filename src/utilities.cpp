@@ -1,21 +1,163 @@
 #include "utilities.hpp"
-#include <cstdio>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
 #include <experimental/optional>
+#include <limits>
 #include <string>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "assert.hpp"
 #include "cxx_extensions.hpp"
 
-std::experimental::optional<std::string> file_contents(const char* filename) {
-    std::FILE* file = std::fopen(filename, "rb");
-    if (UNLIKELY(file == nullptr)) {
+// The initial size of the buffer for files read until their end, it is
+// doubled whenever it fills up.
+#if !defined(UTILITIES_READ_BUFFER_SIZE)
+#   define UTILITIES_READ_BUFFER_SIZE (64 * 1024)
+#endif
+
+SourceFile::SourceFile() : mapping_(nullptr), mapping_size_(0), size_(0) {}
+
+SourceFile::SourceFile(SourceFile&& other)
+        : mapping_(other.mapping_), mapping_size_(other.mapping_size_),
+          buffer_(std::move(other.buffer_)), size_(other.size_) {
+    other.mapping_ = nullptr;
+    other.mapping_size_ = 0;
+    other.size_ = 0;
+}
+
+SourceFile& SourceFile::operator=(SourceFile&& other) {
+    std::swap(mapping_, other.mapping_);
+    std::swap(mapping_size_, other.mapping_size_);
+    std::swap(buffer_, other.buffer_);
+    std::swap(size_, other.size_);
+    return *this;
+}
+
+SourceFile::~SourceFile() {
+    if (mapping_ != nullptr) {
+        ::munmap(mapping_, mapping_size_);
+    }
+}
+
+std::experimental::optional<SourceFile> SourceFile::open(
+        const char* filename) {
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (UNLIKELY(fd == -1)) {
+        return std::experimental::nullopt;
+    }
+    SourceFile file;
+    struct stat status;
+    bool success = ::fstat(fd, &status) == 0;
+    if (success && S_ISREG(status.st_mode) && status.st_size > 0) {
+        success = file.map(fd, status.st_size);
+    } else if (success) {
+        success = file.read(fd);
+    }
+    ::close(fd);
+    if (UNLIKELY(!success)) {
         return std::experimental::nullopt;
     }
-    std::string content;
-    std::fseek(file, 0, SEEK_END);
-    content.resize(std::ftell(file));
-    std::rewind(file);
-    // Suppress unused result warnings.
-    if (std::fread(&content[0], 1, content.size(), file)) {
+    return std::experimental::optional<SourceFile>(std::move(file));
+}
+
+const char* SourceFile::data() const {
+    return mapping_ != nullptr ? static_cast<const char*>(mapping_)
+        : buffer_.c_str();
+}
+
+std::size_t SourceFile::size() const {
+    return size_;
+}
+
+bool SourceFile::map(int fd, std::size_t size) {
+    // Reserve zero-filled pages with at least one byte after the contents
+    // and map the file over them. The rest of the last page of the file is
+    // zero-filled as well.
+    auto page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    std::size_t mapping_size = (size / page_size + 1) * page_size;
+    void* mapping = ::mmap(nullptr, mapping_size, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (UNLIKELY(mapping == MAP_FAILED)) {
+        return false;
+    }
+    if (UNLIKELY(::mmap(mapping, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+                    0) == MAP_FAILED)) {
+        ::munmap(mapping, mapping_size);
+        return false;
+    }
+    mapping_ = mapping;
+    mapping_size_ = mapping_size;
+    size_ = size;
+    return true;
+}
+
+bool SourceFile::read(int fd) {
+    std::size_t size = 0;
+    buffer_.resize(UTILITIES_READ_BUFFER_SIZE);
+    for (;;) {
+        if (size == buffer_.size()) {
+            buffer_.resize(2 * size);
+        }
+        ssize_t num_read = ::read(fd, &buffer_[size], buffer_.size() - size);
+        if (num_read == 0) {
+            break;
+        }
+        if (UNLIKELY(num_read == -1)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        size += num_read;
+    }
+    buffer_.resize(size);
+    size_ = size;
+    return true;
+}
+
+DivisionMagic division_magic(std::int64_t divisor) {
+    ASSERT(divisor <= -2 || divisor >= 2);
+    ASSERT_NE(divisor, std::numeric_limits<std::int64_t>::min());
+    const std::uint64_t two63 = std::uint64_t(1) << 63;
+    std::uint64_t ad = divisor < 0 ? -static_cast<std::uint64_t>(divisor)
+        : static_cast<std::uint64_t>(divisor);
+    std::uint64_t t = two63 + (static_cast<std::uint64_t>(divisor) >> 63);
+    // Absolute value of nc.
+    std::uint64_t anc = t - 1 - t % ad;
+    std::int64_t p = 63;
+    // Initialize q1 = 2^p / |nc|, r1 = rem(2^p, |nc|).
+    std::uint64_t q1 = two63 / anc;
+    std::uint64_t r1 = two63 - q1 * anc;
+    // Initialize q2 = 2^p / |d|, r2 = rem(2^p, |d|).
+    std::uint64_t q2 = two63 / ad;
+    std::uint64_t r2 = two63 - q2 * ad;
+    std::uint64_t delta;
+    do {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            ++q1;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            ++q2;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    std::uint64_t multiplier = q2 + 1;
+    if (divisor < 0) {
+        multiplier = -multiplier;
     }
-    std::fclose(file);
-    return content;
+    DivisionMagic magic;
+    magic.multiplier_ = static_cast<std::int64_t>(multiplier);
+    magic.shift_ = p - 64;
+    return magic;
 }
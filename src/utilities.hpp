@@ -1,9 +1,56 @@
 #ifndef UTILITIES_HPP
 #define UTILITIES_HPP
 
+#include <cstddef>
+#include <cstdint>
 #include <experimental/optional>
 #include <string>
 
-std::experimental::optional<std::string> file_contents(const char* filename);
+// Magic numbers for the signed division by a constant.
+struct DivisionMagic final {
+    std::int64_t multiplier_;
+    std::int64_t shift_;
+};
+
+// The contents of a source file terminated by a NUL sentinel. Regular files
+// are mapped into memory, the sentinel is in the zero-filled rest of the
+// mapping. Other files, like pipes, are read until their end.
+class SourceFile final {
+public:
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    SourceFile(SourceFile&& other);
+    SourceFile& operator=(SourceFile&& other);
+    ~SourceFile();
+
+    // Opens the file, returns nullopt if it can't be mapped or read.
+    static std::experimental::optional<SourceFile> open(const char* filename);
+
+    // Gets the contents terminated by NUL.
+    const char* data() const;
+
+    // Gets the size of the contents without the sentinel.
+    std::size_t size() const;
+
+private:
+    SourceFile();
+
+    // Maps the regular file with the given size, returns false on failure.
+    bool map(int fd, std::size_t size);
+
+    // Reads the file until its end, returns false on failure.
+    bool read(int fd);
+
+    // The mapping, nullptr if the contents are read into the buffer.
+    void* mapping_;
+    std::size_t mapping_size_;
+    std::string buffer_;
+    std::size_t size_;
+};
+
+// Computes the magic numbers for the signed division by the given divisor, see
+// Hacker's Delight, chapter 10-1. The divisor must satisfy 2 <= |divisor| and
+// must not be equal to the minimal 64-bit integer.
+DivisionMagic division_magic(std::int64_t divisor);
 
 #endif // !UTILITIES_HPP
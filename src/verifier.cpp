@@ -0,0 +1,376 @@
+#include "verifier.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "instruction.hpp"
+#include "interpreter.hpp"
+
+namespace {
+
+// Gets the largest register used by the instruction plus one, 0 if it uses
+// none.
+std::size_t num_registers(Instruction instruction) {
+    std::size_t a = instruction.a();
+    std::size_t b = instruction.b();
+    std::size_t c = instruction.c();
+    switch (instruction.opcode()) {
+    // Register-register binary instructions.
+    case Instruction::ADDRR:
+    case Instruction::MULRR:
+    case Instruction::EQRR:
+    case Instruction::NERR:
+    case Instruction::ANDRR:
+    case Instruction::ORRR:
+    case Instruction::XORRR:
+    case Instruction::SUBRR:
+    case Instruction::DIVRR:
+    case Instruction::MODRR:
+    case Instruction::LTRR:
+    case Instruction::LERR:
+    case Instruction::SHLRR:
+    case Instruction::SARRR:
+    case Instruction::SHRRR:
+    case Instruction::MIN:
+    case Instruction::MAX:
+    case Instruction::GCD:
+    case Instruction::IPOW:
+    case Instruction::MULHI:
+    case Instruction::ALOAD:
+    case Instruction::ALOADU:
+    case Instruction::ASTORE:
+    case Instruction::ASTOREU:
+        return std::max({a, b, c}) + 1;
+    // Register-immediate binary and unary instructions.
+    case Instruction::ADDRI:
+    case Instruction::MULRI:
+    case Instruction::EQRI:
+    case Instruction::NERI:
+    case Instruction::ANDRI:
+    case Instruction::ORRI:
+    case Instruction::XORRI:
+    case Instruction::SUBRI:
+    case Instruction::DIVRI:
+    case Instruction::MODRI:
+    case Instruction::LTRI:
+    case Instruction::LERI:
+    case Instruction::SHLRI:
+    case Instruction::SARRI:
+    case Instruction::SHRRI:
+    case Instruction::DIVMAGIC:
+    case Instruction::MODMAGIC:
+    case Instruction::DIVPOW2:
+    case Instruction::MODPOW2:
+    case Instruction::NEG:
+    case Instruction::NOT:
+    case Instruction::BNOT:
+    case Instruction::TRI:
+    case Instruction::ABS:
+    case Instruction::POPCOUNT:
+    case Instruction::CLZ:
+    case Instruction::CTZ:
+    case Instruction::ISQRT:
+    case Instruction::MOVR:
+    case Instruction::ANEW:
+        return std::max(a, b) + 1;
+    // Immediate-register binary instructions.
+    case Instruction::SUBIR:
+    case Instruction::DIVIR:
+    case Instruction::MODIR:
+    case Instruction::LTIR:
+    case Instruction::LEIR:
+    case Instruction::SHLIR:
+    case Instruction::SARIR:
+    case Instruction::SHRIR:
+        return std::max(a, c) + 1;
+    // Instructions using only the register a.
+    case Instruction::CONST:
+    case Instruction::MOVI:
+    case Instruction::JT:
+    case Instruction::JF:
+    case Instruction::JTAB:
+    case Instruction::STOREM:
+    case Instruction::RETR:
+    case Instruction::EXIT:
+    case Instruction::IN:
+    case Instruction::OUT:
+        return a + 1;
+    case Instruction::FORPREP:
+    case Instruction::FORLOOP:
+        return a + 4;
+    // The return address and the arguments.
+    case Instruction::CALL:
+    case Instruction::CALLM:
+    case Instruction::CALLN:
+        return a + b + 1;
+    default:
+        return 0;
+    }
+}
+
+class Verifier final {
+public:
+    Verifier(const Instruction* bytecode, std::size_t size,
+            const std::int64_t* constants, std::size_t num_constants,
+            std::size_t num_natives)
+        : bytecode_(bytecode), size_(size), constants_(constants),
+          num_constants_(num_constants), num_natives_(num_natives),
+          owners_(size, 0), targets_(size, false) {
+        result_.valid_ = true;
+        result_.error_ = nullptr;
+        result_.error_pos_ = 0;
+        result_.frame_sizes_.assign(size, 0);
+    }
+
+    Verification run() {
+        if (size_ == 0) {
+            fail(0, "empty bytecode");
+            return std::move(result_);
+        }
+        add_entry(0, 0);
+        // The entries are appended while the functions are verified.
+        for (std::size_t i = 0; result_.valid_ && i < entries_.size(); ++i) {
+            verify_function(i);
+        }
+        // The calls are loaded by the preceding instructions, which must
+        // not be skipped. Every function is entered by a call.
+        for (std::size_t pos : calls_) {
+            if (!result_.valid_) {
+                break;
+            }
+            if (targets_[pos] || result_.frame_sizes_[pos] != 0) {
+                fail(pos, "jump to a call");
+            }
+        }
+        if (!result_.valid_) {
+            result_.frame_sizes_.clear();
+        }
+        return std::move(result_);
+    }
+
+private:
+    void fail(std::size_t pos, const char* error) {
+        if (result_.valid_) {
+            result_.valid_ = false;
+            result_.error_ = error;
+            result_.error_pos_ = pos;
+        }
+    }
+
+    // Adds the function starting at the given position, unless it's already
+    // added. The frame sizes mark the entries until they are computed.
+    void add_entry(std::size_t call, std::size_t entry) {
+        if (result_.frame_sizes_[entry] != 0) {
+            return;
+        }
+        if (owners_[entry] != 0) {
+            fail(call, "call into the middle of a function");
+            return;
+        }
+        result_.frame_sizes_[entry] = 1;
+        entries_.push_back(entry);
+    }
+
+    // Adds the target of the jump at the given position.
+    void add_jump(std::size_t pos, std::int64_t offset) {
+        auto target = static_cast<std::int64_t>(pos) + 1 + offset;
+        if (target < 0 || static_cast<std::size_t>(target) >= size_) {
+            fail(pos, "jump out of the bytecode");
+            return;
+        }
+        targets_[target] = true;
+        worklist_.push_back(target);
+    }
+
+    // Adds the next instruction.
+    void add_next(std::size_t pos) {
+        if (pos + 1 >= size_) {
+            fail(pos, "execution falls off the bytecode");
+            return;
+        }
+        worklist_.push_back(pos + 1);
+    }
+
+    // Finds the function called by the instruction at the given position,
+    // its offset is loaded to the register a by the previous instruction.
+    void add_callee(std::size_t pos) {
+        const auto& call = bytecode_[pos];
+        if (pos == 0) {
+            fail(pos, "unknown callee");
+            return;
+        }
+        const auto& load = bytecode_[pos - 1];
+        std::int64_t offset;
+        if (load.opcode() == Instruction::MOVI && load.a() == call.a()) {
+            offset = load.d();
+        } else if (load.opcode() == Instruction::CONST &&
+                load.a() == call.a() &&
+                static_cast<std::uint16_t>(load.d()) < num_constants_) {
+            offset = constants_[static_cast<std::uint16_t>(load.d())];
+        } else {
+            fail(pos, "unknown callee");
+            return;
+        }
+        if (offset < -static_cast<std::int64_t>(pos) - 1 ||
+                offset >= static_cast<std::int64_t>(size_ - pos - 1)) {
+            fail(pos, "call out of the bytecode");
+            return;
+        }
+        add_entry(pos, pos + 1 + offset);
+    }
+
+    void verify_function(std::size_t index) {
+        std::size_t entry = entries_[index];
+        std::size_t owner = index + 1;
+        std::size_t frame_size = 1;
+        worklist_.push_back(entry);
+        while (result_.valid_ && !worklist_.empty()) {
+            std::size_t pos = worklist_.back();
+            worklist_.pop_back();
+            if (owners_[pos] == owner) {
+                continue;
+            }
+            if (owners_[pos] != 0) {
+                fail(pos, "code shared by functions");
+                break;
+            }
+            owners_[pos] = owner;
+            verify_instruction(pos, index == 0);
+            frame_size = std::max(frame_size, num_registers(bytecode_[pos]));
+        }
+        worklist_.clear();
+        result_.frame_sizes_[entry] = static_cast<std::uint16_t>(frame_size);
+    }
+
+    void verify_instruction(std::size_t pos, bool is_first_function) {
+        const auto& instruction = bytecode_[pos];
+        switch (instruction.opcode()) {
+        case Instruction::CONST:
+            if (static_cast<std::uint16_t>(instruction.d()) >=
+                    num_constants_) {
+                fail(pos, "constant out of range");
+            }
+            add_next(pos);
+            break;
+        case Instruction::DIVMAGIC:
+        case Instruction::MODMAGIC:
+            if (instruction.c() + std::size_t(2) >= num_constants_) {
+                fail(pos, "constant out of range");
+            }
+            add_next(pos);
+            break;
+        case Instruction::DIVPOW2:
+        case Instruction::MODPOW2:
+            if (instruction.c() == 0 || instruction.c() >= 64) {
+                fail(pos, "shift out of range");
+            }
+            add_next(pos);
+            break;
+        // Jump instructions.
+        case Instruction::JMP:
+            add_jump(pos, instruction.d());
+            break;
+        case Instruction::JT:
+        case Instruction::JF:
+        case Instruction::FORPREP:
+        case Instruction::FORLOOP:
+            add_jump(pos, instruction.d());
+            add_next(pos);
+            break;
+        case Instruction::JTAB: {
+            // The jumps in the table are executed without being dispatched.
+            std::size_t num_slots =
+                static_cast<std::uint16_t>(instruction.d()) + std::size_t(1);
+            if (num_slots > size_ - pos - 1) {
+                fail(pos, "jump table out of the bytecode");
+                break;
+            }
+            for (std::size_t i = pos + 1; i <= pos + num_slots; ++i) {
+                if (bytecode_[i].opcode() != Instruction::JMP) {
+                    fail(i, "expected a jump in the jump table");
+                    break;
+                }
+                worklist_.push_back(i);
+            }
+            break;
+        }
+        // Call/ret instructions.
+        case Instruction::CALL:
+            calls_.push_back(pos);
+            add_callee(pos);
+            add_next(pos);
+            break;
+        case Instruction::CALLM:
+            if (instruction.b() > INTERPRETER_MEMO_MAX_ARGS) {
+                fail(pos, "too many memoized arguments");
+            } else if (pos + 1 >= size_ ||
+                    bytecode_[pos + 1].opcode() != Instruction::STOREM) {
+                fail(pos, "CALLM not followed by STOREM");
+            }
+            calls_.push_back(pos);
+            add_callee(pos);
+            add_next(pos);
+            // The STOREM is skipped if the result is cached.
+            add_next(pos + 1);
+            break;
+        case Instruction::STOREM:
+            if (pos == 0 || bytecode_[pos - 1].opcode() != Instruction::CALLM) {
+                fail(pos, "STOREM not preceded by CALLM");
+            }
+            calls_.push_back(pos);
+            add_next(pos);
+            break;
+        case Instruction::CALLN:
+            if (instruction.c() >= num_natives_) {
+                fail(pos, "native function out of range");
+            }
+            add_next(pos);
+            break;
+        case Instruction::LAZY:
+            fail(pos, "unexpected LAZY");
+            break;
+        case Instruction::RETR:
+        case Instruction::RETI:
+            if (is_first_function) {
+                fail(pos, "return from the first function");
+            }
+            break;
+        // System instructions.
+        case Instruction::EXIT:
+            break;
+        default:
+            if (instruction.opcode() > Instruction::OUT) {
+                fail(pos, "unknown opcode");
+                break;
+            }
+            add_next(pos);
+            break;
+        }
+    }
+
+    const Instruction* bytecode_;
+    std::size_t size_;
+    const std::int64_t* constants_;
+    std::size_t num_constants_;
+    std::size_t num_natives_;
+    // Indices of the functions owning the instructions plus one, 0 for
+    // unreachable instructions.
+    std::vector<std::size_t> owners_;
+    std::vector<bool> targets_;
+    // Positions of the first instructions of the functions.
+    std::vector<std::size_t> entries_;
+    // Positions of the calls and STOREMs, which must not be jumped to.
+    std::vector<std::size_t> calls_;
+    std::vector<std::size_t> worklist_;
+    Verification result_;
+};
+
+}
+
+Verification verify(const Instruction* bytecode, std::size_t size,
+        const std::int64_t* constants, std::size_t num_constants,
+        std::size_t num_natives) {
+    Verifier verifier(bytecode, size, constants, num_constants, num_natives);
+    return verifier.run();
+}
@@ -0,0 +1,33 @@
+#ifndef VERIFIER_HPP
+#define VERIFIER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "instruction.hpp"
+
+// The result of the verification of a bytecode.
+struct Verification final {
+    // Whether the bytecode is valid, otherwise the error describes the
+    // instruction at 'error_pos_'.
+    bool valid_;
+    const char* error_;
+    std::size_t error_pos_;
+    // The numbers of registers of the functions indexed by the positions of
+    // their first instructions, 0 for other instructions.
+    std::vector<std::uint16_t> frame_sizes_;
+};
+
+// Verifies the code reachable from the first instruction, so that it can be
+// interpreted without any checks except of the stack at calls. It proves that
+// the opcodes are known, the jumps and calls stay in the bytecode, CONST and
+// the magic numbers index the constants, CALLN the natives, and that every
+// path ends in RETR, RETI or EXIT without returning from the first function.
+// Every call is loaded by the preceding MOVI or CONST, which is never jumped
+// over, and CALLM is followed by STOREM. Functions must not share code, which
+// keeps the verification linear.
+Verification verify(const Instruction* bytecode, std::size_t size,
+        const std::int64_t* constants, std::size_t num_constants,
+        std::size_t num_natives);
+
+#endif // !VERIFIER_HPP
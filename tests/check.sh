@@ -0,0 +1,12 @@
+#!/bin/sh
+# Runs the command and compares its output followed by its exit code with the
+# expected file.
+# Usage: check.sh EXPECTED COMMAND [ARGUMENT]...
+expected_file=$1
+shift
+actual=$("$@" < /dev/null; echo "exit $?")
+expected=$(cat "$expected_file") || exit 1
+if [ "$actual" != "$expected" ]; then
+    printf 'Expected:\n%s\nActual:\n%s\n' "$expected" "$actual" >&2
+    exit 1
+fi
@@ -0,0 +1,4 @@
+#!/bin/sh
+# Runs the command and prints its error messages instead of its output.
+# Usage: errors.sh COMMAND [ARGUMENT]...
+"$@" 2>&1 >/dev/null
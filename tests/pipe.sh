@@ -0,0 +1,5 @@
+#!/bin/sh
+# Pipes the file followed by 128 KiB of spaces into the compiler, which reads
+# it from /dev/stdin, so the read buffer has to grow.
+# Usage: pipe.sh COMPILER FILE
+{ cat "$2"; printf '%131072s' ''; } | "$1" /dev/stdin
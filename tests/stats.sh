@@ -0,0 +1,4 @@
+#!/bin/sh
+# Compiles the file with --stats and prints the statistic with the given name.
+# Usage: stats.sh COMPILER FILE NAME
+"$1" --compile --stats "$2" 2>&1 >/dev/null | grep "^$3:"